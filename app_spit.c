@@ -53,7 +53,19 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision$")
 #include "asterisk/pbx.h"
 #include "asterisk/config.h"
 #include "asterisk/app.h"
+#include "asterisk/audiohook.h"
+#include "asterisk/file.h"
 #include "asterisk/format_cache.h"
+#include "asterisk/cli.h"
+#include "asterisk/datastore.h"
+#include "asterisk/manager.h"
+#include "asterisk/options.h"
+
+#include "spit_engine.h"
+#include "spit_call.h"
+#include "spit_analytics.h"
+#include "spit_remote.h"
+#include "spit_tuning.h"
 
 /*** DOCUMENTATION
 	<application name="SPIT" language="en_US">
@@ -95,6 +107,49 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision$")
 				<para>Is the maximum duration of a word to accept.</para>
 				<para>If exceeded set as MACHINE</para>
 			</parameter>
+			<parameter name="options" required="false">
+				<optionlist>
+					<option name="e">
+						<para>Early media. When the channel has not been answered yet, start
+						analyzing the progress media right away and carry the analysis across
+						the answer. Only MACHINE verdicts are given before answer, silence before
+						answer is not counted against the caller. Ringback detected in the
+						progress media is skipped. The time spent before answer is limited by
+						<literal>early_media_timeout</literal> in spit.conf, not by totalAnalysisTime.</para>
+					</option>
+					<option name="b">
+						<argument name="prompt" required="true" />
+						<para>Barge-in. Play <replaceable>prompt</replaceable> to the caller while the
+						analysis runs instead of waiting in silence. Our own prompt coming back as
+						echo is not counted as caller speech, as long as it is at least
+						<literal>echo_return_loss</literal> dB down. A caller that talks over the
+						prompt and then goes quiet for <literal>barge_in_silence</literal> ms while it
+						still plays is HUMAN. The prompt is stopped once there is a verdict. With
+						<literal>e</literal> the prompt starts when the call is answered.</para>
+					</option>
+					<option name="g">
+						<argument name="timeout" required="false" />
+						<para>Greeting end. After a MACHINE verdict on a greeting (MAXWORDS,
+						LONGGREETING, MAXWORDLENGTH, SYNTHETIC or BURST) keep listening until the
+						greeting is over, so a message can be dropped right after it. Other MACHINE
+						causes return right away. The greeting
+						ends with a beep of at least <literal>beep_min_length</literal> ms or with
+						<literal>greeting_end_silence</literal> ms of silence. Gives up after
+						<replaceable>timeout</replaceable> ms, <literal>greeting_end_timeout</literal>
+						in spit.conf by default. Sets <variable>SPITGREETINGEND</variable> and
+						<variable>SPITGREETINGENDCAUSE</variable>.</para>
+					</option>
+					<option name="r">
+						<para>Resume. Go on with the analysis an earlier SPIT() left on the channel
+						instead of starting over, so a dialplan can play a prompt between two parts
+						of the same analysis. The words, durations and detector state carry over, and
+						the resumed run has totalAnalysisTime of its own from where it resumes. Pass
+						a shorter totalAnalysisTime to give the parts one budget. An earlier verdict other than TIMEOUT or EARLYTIMEOUT is set again
+						without listening. The audio between the runs is not analyzed. Without an
+						earlier SPIT() on the channel the analysis starts from the beginning.</para>
+					</option>
+				</optionlist>
+			</parameter>
 		</syntax>
 		<description>
 			<para>This application attempts to detect automated dialers at the beginning
@@ -104,6 +159,26 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision$")
 			<para>When loaded, SPIT reads spit.conf and uses the parameters specified as
 			default values. Those default values get overwritten when the calling SPIT
 			with parameters.</para>
+			<para>With <literal>[remote]</literal> enabled in spit.conf the analysis of answered
+			calls runs on spitd, SPIT only passes the audio on and sets what spitd decided.
+			SPITProgress events spitd reports are raised here, its performance counters and
+			analytics log are kept by spitd. A later SPIT with <literal>r</literal> on the
+			channel starts over. Early media and the <literal>b</literal> and <literal>r</literal> options need the
+			channel and are analyzed here. So are all calls while spitd can't be reached,
+			unless <literal>fallback = no</literal>.</para>
+			<para>With <literal>[tuning]</literal> enabled in spit.conf, silenceThreshold,
+			betweenWordSilence and totalAnalysisTime start from the values learned for the
+			trunk of the call out of what <literal>SPIT_FEEDBACK()</literal> was told.
+			Arguments given to SPIT still win. The trunk is <variable>SPITTRUNK</variable>
+			when it is set, else the channel name without its unique suffix, SIP/carrier for
+			SIP/carrier-00000012.</para>
+			<para>Detection runs as a pipeline of stages, set in the <literal>[pipeline]</literal>
+			section of spit.conf: burst (the caller ANI prefix), dtmf, energy, words and
+			synthetic. Each frame, digit or call start goes through the stages in the configured
+			order and the first one to decide ends it, the stages after it never see it. An
+			optional stage can be left out or given a budget in cycles per sample, a stage that
+			goes over its budget sits out the rest of the analysis. Use
+			<literal>spit show pipeline</literal> to see the hit rate and cost of each stage.</para>
 			<para>This application sets the following channel variables:</para>
 			<variablelist>
 				<variable name="SPITSTATUS">
@@ -145,6 +220,46 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision$")
 					<value name="DTMFFRAME">
 						AST_FRAME_DTMF_BEGIN or AST_FRAME_DTMF_END with digit.
 					</value>
+					<value name="BURST">
+						The caller ANI prefix is part of a call burst and burst action is machine.
+					</value>
+					<value name="EARLYTIMEOUT">
+						Early media analysis ran past early_media_timeout without an answer.
+					</value>
+					<value name="BARGEIN">
+						The caller talked over the prompt of the b option and stopped to listen,
+						HUMAN. BARGEIN-ms into the prompt-ms of silence.
+					</value>
+					<value name="SYNTHETIC">
+						The greeting has the steady syllable rate and pitch of TTS or a studio
+						recording, MACHINE. SYNTHETIC-modulation-pitch jitter. Only with
+						<literal>synthetic = yes</literal> in spit.conf.
+					</value>
+					<value name="LOSS">
+						More than max_loss_percent of the audio was lost, NOTSURE. When audio was
+						lost on the way, other causes end with -LOSS-lost ms-number of gaps.
+					</value>
+					<value name="REMOTE">
+						The call went to spitd and spitd went away or did not answer in time,
+						NOTSURE.
+					</value>
+				</variable>
+				<variable name="SPITPHASE">
+					<para>Whether the verdict was reached before or after the call was answered</para>
+					<value name="EARLY" />
+					<value name="ANSWERED" />
+				</variable>
+				<variable name="SPITGREETINGEND">
+					<para>With the <literal>g</literal> option, ms of audio from the start of
+					SPIT to the end of the greeting, the end of the beep or the start of the
+					silence. -1 when the end was not heard.</para>
+				</variable>
+				<variable name="SPITGREETINGENDCAUSE">
+					<para>With the <literal>g</literal> option, how the greeting ended</para>
+					<value name="BEEP" />
+					<value name="SILENCE" />
+					<value name="TIMEOUT" />
+					<value name="HANGUP" />
 				</variable>
 			</variablelist>
 		</description>
@@ -152,125 +267,406 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision$")
 			<ref type="application">AMD</ref>
 			<ref type="application">WaitForSilence</ref>
 			<ref type="application">WaitForNoise</ref>
+			<ref type="function">SPIT_FEATURES</ref>
+			<ref type="function">SPIT_FEEDBACK</ref>
+			<ref type="managerEvent">SPITProgress</ref>
 		</see-also>
 	</application>
+	<function name="SPIT_FEATURES" language="en_US">
+		<synopsis>
+			Read the measurements of the last SPIT analysis on the channel.
+		</synopsis>
+		<syntax>
+			<parameter name="field" required="true">
+				<enumlist>
+					<enum name="voiceduration"><para>Total ms of voice.</para></enum>
+					<enum name="words"><para>Number of words counted.</para></enum>
+					<enum name="shortwords"><para>Number of voice bursts shorter than minimumWordLength.</para></enum>
+					<enum name="longestword"><para>Longest stretch of voice in ms.</para></enum>
+					<enum name="initialsilence"><para>Ms of audio before the first word, -1 when there was none.</para></enum>
+					<enum name="longestsilence"><para>Longest silence in ms.</para></enum>
+					<enum name="gaps"><para>Number of silences between words.</para></enum>
+					<enum name="analysistime"><para>Ms of audio analyzed after answer.</para></enum>
+					<enum name="earlytime"><para>Ms of audio analyzed before answer.</para></enum>
+					<enum name="decisiontime"><para>Wall clock ms from the start of SPIT to the verdict.</para></enum>
+					<enum name="lost"><para>Ms of audio lost on the way.</para></enum>
+					<enum name="lossgaps"><para>Number of gaps the audio was lost in.</para></enum>
+					<enum name="burstcalls"><para>Calls from the busiest ANI prefix of the caller in the burst window.</para></enum>
+					<enum name="answered"><para>1 when the verdict was reached after answer.</para></enum>
+					<enum name="bargein"><para>Ms into the prompt the caller started talking over it, -1 when they didn't.</para></enum>
+					<enum name="echo"><para>Ms of caller audio taken for the echo of the prompt.</para></enum>
+					<enum name="modulation"><para>Percent of the 2-8 Hz envelope modulation in its strongest bin, -1 when not measured.</para></enum>
+					<enum name="pitchjitter"><para>Mean pitch change between voiced frames in 1/1000 of the pitch period, -1 when not measured.</para></enum>
+				</enumlist>
+			</parameter>
+		</syntax>
+		<description>
+			<para>Once SPIT finishes it keeps what it measured on the channel. This function
+			formats one of those values on request.</para>
+		</description>
+		<see-also>
+			<ref type="application">SPIT</ref>
+		</see-also>
+	</function>
+	<function name="SPIT_FEEDBACK" language="en_US">
+		<synopsis>
+			Tell SPIT what the call it analyzed really was.
+		</synopsis>
+		<syntax />
+		<description>
+			<para>Write <literal>HUMAN</literal> or <literal>MACHINE</literal>, from the agent
+			disposition for example, with <literal>Set(SPIT_FEEDBACK()=HUMAN)</literal>. The
+			outcome is counted against the verdict of the last SPIT on the channel, once, for
+			the trunk the call came in on. Every <literal>window</literal> reports of a trunk
+			its silenceThreshold, betweenWordSilence and totalAnalysisTime move one step within
+			the bounds of the <literal>[tuning]</literal> section of spit.conf: the analysis
+			time gets shorter as long as the trunk meets <literal>target</literal> and longer
+			when it does not, the other two follow the mistakes. Use
+			<literal>spit show tuning</literal> to see the trunks.</para>
+		</description>
+		<see-also>
+			<ref type="application">SPIT</ref>
+		</see-also>
+	</function>
+	<managerEvent language="en_US" name="SPITProgress">
+		<managerEventInstance class="EVENT_FLAG_CALL">
+			<synopsis>Raised while SPIT analyzes a channel, with <literal>progress_events = yes</literal>
+			in spit.conf. At most one event per <literal>progress_interval</literal> ms, the verdict and
+			the end of the greeting are raised right away.</synopsis>
+			<syntax>
+				<parameter name="Channel" />
+				<parameter name="Uniqueid" />
+				<parameter name="Events">
+					<para>What happened since the last event, comma separated.</para>
+					<enumlist>
+						<enum name="FIRSTWORD"><para>The greeting started.</para></enum>
+						<enum name="WORD"><para>The word count went up.</para></enum>
+						<enum name="SILENCE"><para>The caller went quiet after a word, afterGreetingSilence is counting.</para></enum>
+						<enum name="PROVISIONAL"><para>The provisional verdict changed or its confidence went up a 25% step.</para></enum>
+						<enum name="VERDICT"><para>SPIT decided, see <literal>Cause</literal>.</para></enum>
+						<enum name="GREETINGEND"><para>With the <literal>g</literal> option, the greeting ended.</para></enum>
+					</enumlist>
+				</parameter>
+				<parameter name="Time"><para>Ms of audio since SPIT started.</para></parameter>
+				<parameter name="Words" />
+				<parameter name="VoiceDuration" />
+				<parameter name="SilenceDuration" />
+				<parameter name="Provisional">
+					<para>The verdict the analysis leans towards, the final one after VERDICT.</para>
+					<enumlist>
+						<enum name="UNDECIDED" />
+						<enum name="HUMAN" />
+						<enum name="MACHINE" />
+						<enum name="NOTSURE" />
+						<enum name="HANGUP" />
+					</enumlist>
+				</parameter>
+				<parameter name="Confidence"><para>How far the analysis got towards that verdict in percent, 100 once it is final.</para></parameter>
+				<parameter name="Cause"><para>With VERDICT, the value of <variable>SPITCAUSE</variable>.</para></parameter>
+				<parameter name="GreetingEnd"><para>With GREETINGEND, the value of <variable>SPITGREETINGEND</variable>.</para></parameter>
+				<parameter name="GreetingEndCause"><para>With GREETINGEND, the value of <variable>SPITGREETINGENDCAUSE</variable>.</para></parameter>
+			</syntax>
+			<see-also>
+				<ref type="application">SPIT</ref>
+			</see-also>
+		</managerEventInstance>
+	</managerEvent>
 
  ***/
 
 static const char app[] = "SPIT";
 
-#define STATE_IN_WORD       1
-#define STATE_IN_SILENCE    2
+enum spit_option_flags {
+	OPT_EARLY_MEDIA = (1 << 0),
+	OPT_BARGE_IN    = (1 << 1),
+	OPT_GREETING_END = (1 << 2),
+	OPT_RESUME      = (1 << 3),
+};
 
-/* Some default values for the algorithm parameters. These defaults will be overwritten from spit.conf */
-static int dfltInitialSilence       = 2500;
-static int dfltGreeting             = 1500;
-static int dfltAfterGreetingSilence = 800;
-static int dfltTotalAnalysisTime    = 5000;
-static int dfltMinimumWordLength    = 100;
-static int dfltBetweenWordsSilence  = 50;
-static int dfltMaximumNumberOfWords = 3;
-static int dfltSilenceThreshold     = 256;
-static int dfltMaximumWordLength    = 5000; /* Setting this to a large default so it is not used unless specify it in the configs or command line */
+enum spit_option_args {
+	OPT_ARG_BARGE_IN = 0,
+	OPT_ARG_GREETING_END,
+	/* note: this entry _MUST_ be the last one in the enum */
+	OPT_ARG_ARRAY_SIZE,
+};
 
-/* Set to the lowest ms value provided in spit.conf or application parameters */
-static int dfltMaxWaitTimeForFrame  = 50;
+AST_APP_OPTIONS(spit_opts, {
+	AST_APP_OPTION('e', OPT_EARLY_MEDIA),
+	AST_APP_OPTION_ARG('b', OPT_BARGE_IN, OPT_ARG_BARGE_IN),
+	AST_APP_OPTION_ARG('g', OPT_GREETING_END, OPT_ARG_GREETING_END),
+	AST_APP_OPTION('r', OPT_RESUME),
+});
 
-static void isAutomatedDialer(struct ast_channel *chan, const char *data)
+/* Default values for the algorithm parameters. These defaults will be overwritten from spit.conf */
+static struct spit_params dfltParams;
+
+/* Tone zone used to spot ringback in early media */
+static char dfltProgressZone[16]    = "us";
+
+static const struct {
+	const char *name;
+	size_t offset;
+} spit_feature_fields[] = {
+	{ "voiceduration",  offsetof(struct spit_features, voiceDuration) },
+	{ "words",          offsetof(struct spit_features, words) },
+	{ "shortwords",     offsetof(struct spit_features, shortWords) },
+	{ "longestword",    offsetof(struct spit_features, longestWord) },
+	{ "initialsilence", offsetof(struct spit_features, initialSilence) },
+	{ "longestsilence", offsetof(struct spit_features, longestSilence) },
+	{ "gaps",           offsetof(struct spit_features, gaps) },
+	{ "analysistime",   offsetof(struct spit_features, analysisTime) },
+	{ "earlytime",      offsetof(struct spit_features, earlyTime) },
+	{ "decisiontime",   offsetof(struct spit_features, decisionTime) },
+	{ "lost",           offsetof(struct spit_features, lost) },
+	{ "lossgaps",       offsetof(struct spit_features, lossGaps) },
+	{ "burstcalls",     offsetof(struct spit_features, burstCalls) },
+	{ "answered",       offsetof(struct spit_features, answered) },
+	{ "bargein",        offsetof(struct spit_features, bargeIn) },
+	{ "echo",           offsetof(struct spit_features, echoTime) },
+	{ "modulation",     offsetof(struct spit_features, modulation) },
+	{ "pitchjitter",    offsetof(struct spit_features, pitchJitter) },
+};
+
+static const struct ast_datastore_info spit_features_info = {
+	.type = "SPIT_FEATURES",
+	.destroy = ast_free_ptr,
+};
+
+static int64_t spit_now(void)
 {
-	int res = 0;
-	struct ast_frame *f = NULL;
-	struct ast_dsp *silenceDetector = NULL;
-	int dspsilence = 0, framelength = 0;
-	RAII_VAR(struct ast_format *, readFormat, NULL, ao2_cleanup);
-	int inInitialSilence = 1;
-	int inGreeting = 0;
-	int voiceDuration = 0;
-	int silenceDuration = 0;
-	int iTotalTime = 0;
-	int iWordsCount = 0;
-	int currentState = STATE_IN_WORD;
-	int consecutiveVoiceDuration = 0;
-	char spitCause[256] = "", spitStatus[256] = "";
-	char *parse = ast_strdupa(data);
+	struct timeval now = ast_tvnow();
 
-	/* Lets set the initial values of the variables that will control the algorithm.
-	   The initial values are the default ones. If they are passed as arguments
-	   when invoking the application, then the default values will be overwritten
-	   by the ones passed as parameters. */
-	int initialSilence       = dfltInitialSilence;
-	int greeting             = dfltGreeting;
-	int afterGreetingSilence = dfltAfterGreetingSilence;
-	int totalAnalysisTime    = dfltTotalAnalysisTime;
-	int minimumWordLength    = dfltMinimumWordLength;
-	int betweenWordsSilence  = dfltBetweenWordsSilence;
-	int maximumNumberOfWords = dfltMaximumNumberOfWords;
-	int silenceThreshold     = dfltSilenceThreshold;
-	int maximumWordLength    = dfltMaximumWordLength;
-	int maxWaitTimeForFrame  = dfltMaxWaitTimeForFrame;
+	return (int64_t) now.tv_sec * 1000 + now.tv_usec / 1000;
+}
 
-	AST_DECLARE_APP_ARGS(args,
-		AST_APP_ARG(argInitialSilence);
-		AST_APP_ARG(argGreeting);
-		AST_APP_ARG(argAfterGreetingSilence);
-		AST_APP_ARG(argTotalAnalysisTime);
-		AST_APP_ARG(argMinimumWordLength);
-		AST_APP_ARG(argBetweenWordsSilence);
-		AST_APP_ARG(argMaximumNumberOfWords);
-		AST_APP_ARG(argSilenceThreshold);
-		AST_APP_ARG(argMaximumWordLength);
-	);
+/* Engine messages go to the verbose log with the channel in front */
+static void spit_log(void *data, const char *fmt, ...)
+{
+	struct ast_channel *chan = data;
+	char buf[256];
+	va_list ap;
 
-	ast_verb(3, "SPIT: %s %s %s (Fmt: %s)\n", ast_channel_name(chan),
-		S_COR(ast_channel_caller(chan)->ani.number.valid, ast_channel_caller(chan)->ani.number.str, "(N/A)"),
-		S_COR(ast_channel_redirecting(chan)->from.number.valid, ast_channel_redirecting(chan)->from.number.str, "(N/A)"),
-		ast_format_get_name(ast_channel_readformat(chan)));
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
 
-	/* Lets parse the arguments. */
-	if (!ast_strlen_zero(parse)) {
-		/* Some arguments have been passed. Lets parse them and overwrite the defaults. */
-		AST_STANDARD_APP_ARGS(args, parse);
-		if (!ast_strlen_zero(args.argInitialSilence))
-			initialSilence = atoi(args.argInitialSilence);
-		if (!ast_strlen_zero(args.argGreeting))
-			greeting = atoi(args.argGreeting);
-		if (!ast_strlen_zero(args.argAfterGreetingSilence))
-			afterGreetingSilence = atoi(args.argAfterGreetingSilence);
-		if (!ast_strlen_zero(args.argTotalAnalysisTime))
-			totalAnalysisTime = atoi(args.argTotalAnalysisTime);
-		if (!ast_strlen_zero(args.argMinimumWordLength))
-			minimumWordLength = atoi(args.argMinimumWordLength);
-		if (!ast_strlen_zero(args.argBetweenWordsSilence))
-			betweenWordsSilence = atoi(args.argBetweenWordsSilence);
-		if (!ast_strlen_zero(args.argMaximumNumberOfWords))
-			maximumNumberOfWords = atoi(args.argMaximumNumberOfWords);
-		if (!ast_strlen_zero(args.argSilenceThreshold))
-			silenceThreshold = atoi(args.argSilenceThreshold);
-		if (!ast_strlen_zero(args.argMaximumWordLength))
-			maximumWordLength = atoi(args.argMaximumWordLength);
-	} else {
-		ast_debug(1, "SPIT using the default parameters.\n");
+	ast_verb(3, "SPIT: Channel [%s]. %s\n", ast_channel_name(chan), buf);
+}
+
+/* The whole engine of the last analysis, so a later SPIT(...,r) can go on with it */
+static const struct ast_datastore_info spit_state_info = {
+	.type = "SPIT_STATE",
+	.destroy = ast_free_ptr,
+};
+
+/* The verdict SPIT_FEEDBACK() reports on, gone once it has */
+static const struct ast_datastore_info spit_sample_info = {
+	.type = "SPIT_SAMPLE",
+	.destroy = ast_free_ptr,
+};
+
+/* SPITTRUNK or the channel name up to the unique suffix the channel driver adds */
+static void spit_trunk_name(struct ast_channel *chan, char *trunk, size_t len)
+{
+	const char *name;
+	char *suffix;
+
+	ast_channel_lock(chan);
+	name = pbx_builtin_getvar_helper(chan, "SPITTRUNK");
+	ast_copy_string(trunk, S_OR(name, ast_channel_name(chan)), len);
+	ast_channel_unlock(chan);
+
+	if (ast_strlen_zero(name) && (suffix = strrchr(trunk, '-')))
+		*suffix = '\0';
+}
+
+static void spit_store_sample(struct ast_channel *chan, const char *trunk, enum spit_status status, const char *cause)
+{
+	struct ast_datastore *datastore;
+	struct spit_tuning_sample *sample;
+
+	ast_channel_lock(chan);
+	if (!(datastore = ast_channel_datastore_find(chan, &spit_sample_info, NULL))) {
+		if (!(datastore = ast_datastore_alloc(&spit_sample_info, NULL))) {
+			ast_channel_unlock(chan);
+			return;
+		}
+		if (!(datastore->data = ast_calloc(1, sizeof(*sample)))) {
+			ast_datastore_free(datastore);
+			ast_channel_unlock(chan);
+			return;
+		}
+		ast_channel_datastore_add(chan, datastore);
+	}
+	sample = datastore->data;
+	ast_copy_string(sample->trunk, trunk, sizeof(sample->trunk));
+	sample->status = status;
+	ast_copy_string(sample->cause, cause, sizeof(sample->cause));
+	ast_channel_unlock(chan);
+}
+
+static void spit_save_state(struct ast_channel *chan, const struct spit_engine *engine)
+{
+	struct ast_datastore *datastore;
+	struct spit_engine *state;
+
+	ast_channel_lock(chan);
+	if (!(datastore = ast_channel_datastore_find(chan, &spit_state_info, NULL))) {
+		if (!(datastore = ast_datastore_alloc(&spit_state_info, NULL))) {
+			ast_channel_unlock(chan);
+			return;
+		}
+		if (!(datastore->data = ast_calloc(1, sizeof(*engine)))) {
+			ast_datastore_free(datastore);
+			ast_channel_unlock(chan);
+			return;
+		}
+		ast_channel_datastore_add(chan, datastore);
+	}
+	state = datastore->data;
+	memcpy(state, engine, sizeof(*engine));
+	/* The log goes to the channel of the run that uses the state */
+	state->log = NULL;
+	state->logData = NULL;
+	ast_channel_unlock(chan);
+}
+
+/* A run on spitd leaves no engine here, a later SPIT(...,r) must not go on with the one of a run before it */
+static void spit_clear_state(struct ast_channel *chan)
+{
+	struct ast_datastore *datastore;
+
+	ast_channel_lock(chan);
+	if ((datastore = ast_channel_datastore_find(chan, &spit_state_info, NULL))) {
+		ast_channel_datastore_remove(chan, datastore);
+		ast_datastore_free(datastore);
 	}
+	ast_channel_unlock(chan);
+}
 
-	/* Find lowest ms value, that will be max wait time for a frame */
-	if (maxWaitTimeForFrame > initialSilence)
-		maxWaitTimeForFrame = initialSilence;
-	if (maxWaitTimeForFrame > greeting)
-		maxWaitTimeForFrame = greeting;
-	if (maxWaitTimeForFrame > afterGreetingSilence)
-		maxWaitTimeForFrame = afterGreetingSilence;
-	if (maxWaitTimeForFrame > totalAnalysisTime)
-		maxWaitTimeForFrame = totalAnalysisTime;
-	if (maxWaitTimeForFrame > minimumWordLength)
-		maxWaitTimeForFrame = minimumWordLength;
-	if (maxWaitTimeForFrame > betweenWordsSilence)
-		maxWaitTimeForFrame = betweenWordsSilence;
-
-	/* Now we're ready to roll! */
-	ast_verb(3, "SPIT: initialSilence [%d] greeting [%d] afterGreetingSilence [%d] "
-		"totalAnalysisTime [%d] minimumWordLength [%d] betweenWordsSilence [%d] maximumNumberOfWords [%d] silenceThreshold [%d] maximumWordLength [%d] \n",
-				initialSilence, greeting, afterGreetingSilence, totalAnalysisTime,
-				minimumWordLength, betweenWordsSilence, maximumNumberOfWords, silenceThreshold, maximumWordLength);
+static int spit_load_state(struct ast_channel *chan, struct spit_engine *engine)
+{
+	struct ast_datastore *datastore;
+
+	ast_channel_lock(chan);
+	if (!(datastore = ast_channel_datastore_find(chan, &spit_state_info, NULL))) {
+		ast_channel_unlock(chan);
+		return -1;
+	}
+	memcpy(engine, datastore->data, sizeof(*engine));
+	ast_channel_unlock(chan);
+
+	return 0;
+}
+
+static void spit_store_features(struct ast_channel *chan, const struct spit_features *features)
+{
+	struct ast_datastore *datastore;
+
+	ast_channel_lock(chan);
+	if (!(datastore = ast_channel_datastore_find(chan, &spit_features_info, NULL))) {
+		if (!(datastore = ast_datastore_alloc(&spit_features_info, NULL))) {
+			ast_channel_unlock(chan);
+			return;
+		}
+		if (!(datastore->data = ast_calloc(1, sizeof(*features)))) {
+			ast_datastore_free(datastore);
+			ast_channel_unlock(chan);
+			return;
+		}
+		ast_channel_datastore_add(chan, datastore);
+	}
+	memcpy(datastore->data, features, sizeof(*features));
+	ast_channel_unlock(chan);
+}
+
+/* Start the barge-in prompt with a spy on what we write, so the engine hears it too */
+static int spit_start_prompt(struct ast_channel *chan, struct spit_engine *engine, struct ast_audiohook *spy, const char *prompt)
+{
+	ast_audiohook_init(spy, AST_AUDIOHOOK_TYPE_SPY, "SPIT", 0);
+	if (ast_audiohook_attach(chan, spy)) {
+		ast_log(LOG_WARNING, "SPIT: Channel [%s]. Unable to listen to the prompt, analyzing without barge-in\n", ast_channel_name(chan));
+		ast_audiohook_destroy(spy);
+		return -1;
+	}
+	if (ast_streamfile(chan, prompt, ast_channel_language(chan))) {
+		ast_log(LOG_WARNING, "SPIT: Channel [%s]. Unable to play %s, analyzing without barge-in\n", ast_channel_name(chan), prompt);
+		ast_audiohook_lock(spy);
+		ast_audiohook_detach(spy);
+		ast_audiohook_unlock(spy);
+		ast_audiohook_destroy(spy);
+		return -1;
+	}
+	spit_engine_prompt_start(engine);
+
+	return 0;
+}
+
+/* Hand the engine what we wrote to the caller while their last frame came in */
+static void spit_read_prompt(struct ast_audiohook *spy, struct spit_engine *engine, int samples)
+{
+	struct ast_frame *pf;
+
+	ast_audiohook_lock(spy);
+	pf = ast_audiohook_read_frame(spy, samples, AST_AUDIOHOOK_DIRECTION_WRITE, ast_format_slin);
+	ast_audiohook_unlock(spy);
+
+	if (pf) {
+		spit_engine_prompt(engine, pf->data.ptr, pf->samples);
+		ast_frfree(pf);
+	}
+}
+
+/* Tell AMI how the analysis is going. manager_event() does not format anything
+   unless a manager session is listening. */
+static void spit_progress_event(struct ast_channel *chan, const struct spit_progress *progress, const char *cause,
+	int greetingEndTime, enum spit_greeting_end greetingEndCause)
+{
+	char events[96], verdict[300] = "", greetingEnd[64] = "";
+
+	spit_event_names(progress->events, events, sizeof(events));
+	if (progress->events & SPIT_EVENT_VERDICT)
+		snprintf(verdict, sizeof(verdict), "Cause: %s\r\n", cause);
+	if (progress->events & SPIT_EVENT_GREETINGEND) {
+		snprintf(greetingEnd, sizeof(greetingEnd), "GreetingEnd: %d\r\nGreetingEndCause: %s\r\n",
+			greetingEndTime, spit_greeting_end_name(greetingEndCause));
+	}
+
+	ast_manager_event(chan, EVENT_FLAG_CALL, "SPITProgress",
+		"Channel: %s\r\n"
+		"Uniqueid: %s\r\n"
+		"Events: %s\r\n"
+		"Time: %d\r\n"
+		"Words: %d\r\n"
+		"VoiceDuration: %d\r\n"
+		"SilenceDuration: %d\r\n"
+		"Provisional: %s\r\n"
+		"Confidence: %d\r\n"
+		"%s%s",
+		ast_channel_name(chan), ast_channel_uniqueid(chan), events, progress->time, progress->words,
+		progress->voiceDuration, progress->silenceDuration,
+		progress->provisional ? spit_status_name(progress->provisional) : "UNDECIDED", progress->confidence, verdict, greetingEnd);
+}
+
+static void spit_publish_progress(struct spit_call *call, const struct spit_progress *progress)
+{
+	char status[32], cause[256] = "";
+
+	if (progress->events & SPIT_EVENT_VERDICT)
+		spit_engine_format(&call->engine, status, sizeof(status), cause, sizeof(cause));
+	spit_progress_event(call->chan, progress, cause, call->engine.greetingEnd, call->engine.greetingEndCause);
+}
+
+/* Read frames from the channel and feed them to the engine until it has a verdict */
+static int spit_analyze(struct ast_channel *chan, struct spit_call *call, const char *prompt)
+{
+	int res = 0, waitMs, schedMs, spying = 0, done;
+	struct spit_engine *engine = &call->engine;
+	struct ast_frame *f = NULL;
+	struct ast_dsp *progressDetector = NULL;
+	struct ast_audiohook spy;
+	struct spit_read frame;
+	RAII_VAR(struct ast_format *, readFormat, NULL, ao2_cleanup);
 
 	/* Set read format to signed linear so we get signed linear frames in */
 	readFormat = ao2_bump(ast_channel_readformat(chan));
@@ -278,184 +674,419 @@ static void isAutomatedDialer(struct ast_channel *chan, const char *data)
 		ast_log(LOG_WARNING, "SPIT: Channel [%s]. Unable to set to linear mode, giving up\n", ast_channel_name(chan));
 		pbx_builtin_setvar_helper(chan , "SPITSTATUS", "NOTSLIN");
 		pbx_builtin_setvar_helper(chan , "SPITCAUSE", "INVALIDFORMAT");
-		return;
+		return -1;
 	}
 
-	/* Create a new DSP that will detect the silence */
-	if (!(silenceDetector = ast_dsp_new())) {
-		ast_log(LOG_WARNING, "SPIT: Channel [%s]. Unable to create silence detector :(\n", ast_channel_name(chan));
-		pbx_builtin_setvar_helper(chan , "SPITSTATUS", "NODETECTOR");
-		pbx_builtin_setvar_helper(chan , "SPITCAUSE", "CANNOTCREATE");
-		return;
+	/* In early media mode we start on the progress media and need to tell ringback from a greeting */
+	if (!engine->answered) {
+		if ((progressDetector = ast_dsp_new())) {
+			ast_dsp_set_features(progressDetector, DSP_FEATURE_CALL_PROGRESS);
+			ast_dsp_set_call_progress_zone(progressDetector, dfltProgressZone);
+		} else {
+			ast_log(LOG_WARNING, "SPIT: Channel [%s]. Unable to create progress detector, ringback will be analyzed\n", ast_channel_name(chan));
+		}
+		ast_verb(3, "SPIT: Channel [%s]. Analyzing early media\n", ast_channel_name(chan));
 	}
 
-	/* Set silence threshold to specified value */
-	ast_dsp_set_threshold(silenceDetector, silenceThreshold);
+	if (!ast_strlen_zero(prompt) && engine->answered)
+		spying = !spit_start_prompt(chan, engine, &spy, prompt);
 
 	/* Now we go into a loop waiting for frames from the channel */
-	while ((res = ast_waitfor(chan, 2 * maxWaitTimeForFrame)) > -1) {
+	for (;;) {
+		/* Without a timer on the channel the prompt is played from the scheduler */
+		waitMs = 2 * engine->maxWaitTimeForFrame;
+		if (engine->promptPlaying && (schedMs = ast_sched_wait(ast_channel_sched(chan))) >= 0 && schedMs < waitMs)
+			waitMs = schedMs;
+		if ((res = ast_waitfor(chan, waitMs)) < 0)
+			break;
+
+		memset(&frame, 0, sizeof(frame));
+		if (engine->params.perfCounters)
+			frame.ingest = spit_cycles();
 
 		/* If we fail to read in a frame, that means they hung up */
 		if (!(f = ast_read(chan))) {
-			ast_verb(3, "SPIT: Channel [%s]. HANGUP\n", ast_channel_name(chan));
 			ast_debug(1, "Got hangup\n");
-			strcpy(spitStatus, "HANGUP");
-			res = 1;
+			frame.kind = SPIT_READ_HANGUP;
+			spit_call_frame(call, &frame);
 			break;
 		}
 
-		if (f->frametype == AST_FRAME_DTMF_BEGIN || f->frametype == AST_FRAME_DTMF_END){
-			ast_verb(3, "CPA: Channel [%s] has incoming DTMF, Digit received: [%d]\n", ast_channel_name(chan), f->subclass.integer);
-			strcpy(spitStatus , "MACHINE");
-			sprintf(spitCause , "DTMF-%d", f->subclass.integer-48);
-			res = 1;	
+		if (!engine->answered && ast_channel_state(chan) == AST_STATE_UP) {
+			spit_engine_answer(engine);
+			if (!ast_strlen_zero(prompt))
+				spying = !spit_start_prompt(chan, engine, &spy, prompt);
+		}
+
+		switch (f->frametype) {
+		case AST_FRAME_CONTROL:
+			if (f->subclass.integer == AST_CONTROL_RINGING)
+				frame.kind = SPIT_READ_RINGING;
+			break;
+		case AST_FRAME_DTMF_BEGIN:
+		case AST_FRAME_DTMF_END:
+			frame.kind = SPIT_READ_DTMF;
+			frame.digit = f->subclass.integer;
+			break;
+		case AST_FRAME_VOICE:
+			if (progressDetector && !engine->answered)
+				f = ast_dsp_process(chan, progressDetector, f);
+			if (spying)
+				spit_read_prompt(&spy, engine, f->samples);
+			frame.kind = SPIT_READ_VOICE;
+			frame.samples = f->data.ptr;
+			frame.nsamples = f->samples;
+			frame.flags = (ast_test_flag(f, AST_FRFLAG_HAS_SEQUENCE_NUMBER) ? SPIT_READ_SEQNO : 0)
+				| (ast_test_flag(f, AST_FRFLAG_HAS_TIMING_INFO) ? SPIT_READ_TIMING : 0);
+			frame.seqno = f->seqno;
+			frame.ts = f->ts;
+			break;
+		case AST_FRAME_CNG:
+			frame.kind = SPIT_READ_CNG;
+			break;
+		case AST_FRAME_NULL:
+			frame.kind = SPIT_READ_NULL;
+			frame.waited = !res && waitMs == 2 * engine->maxWaitTimeForFrame;
+			break;
+		default:
 			break;
 		}
+		done = spit_call_frame(call, &frame);
+		ast_frfree(f);
 
+		if (done)
+			break;
 
-		if (f->frametype == AST_FRAME_VOICE || f->frametype == AST_FRAME_NULL || f->frametype == AST_FRAME_CNG) {
-			/* If the total time exceeds the analysis time then give up as we are not too sure */
-			if (f->frametype == AST_FRAME_VOICE) {
-				framelength = (ast_codec_samples_count(f) / DEFAULT_SAMPLES_PER_MS);
-			} else {
-				framelength = 2 * maxWaitTimeForFrame;
-			}
+		/* A machine gets no more of the prompt while we wait for its greeting to end */
+		if (engine->status && engine->promptPlaying) {
+			ast_stopstream(chan);
+			spit_engine_prompt_stop(engine);
+		}
+
+		if (engine->promptPlaying) {
+			ast_sched_runq(ast_channel_sched(chan));
+			if (!ast_channel_stream(chan))
+				spit_engine_prompt_stop(engine);
+		}
+	}
 
-			iTotalTime += framelength;
-			if (iTotalTime >= totalAnalysisTime) {
-				ast_verb(3, "SPIT: Channel [%s]. Nothing definitive before timeout, erring on the side of MACHINE...\n", ast_channel_name(chan));
-				ast_frfree(f);
-				strcpy(spitStatus , "MACHINE");
-				sprintf(spitCause , "TIMEOUT-%d", iTotalTime);
+	if (spying) {
+		ast_stopstream(chan);
+		ast_audiohook_lock(&spy);
+		ast_audiohook_detach(&spy);
+		ast_audiohook_unlock(&spy);
+		ast_audiohook_destroy(&spy);
+	}
+
+	/* Restore channel read format */
+	if (readFormat && ast_set_read_format(chan, readFormat))
+		ast_log(LOG_WARNING, "SPIT: Unable to restore read format on '%s'\n", ast_channel_name(chan));
+
+	if (progressDetector)
+		ast_dsp_free(progressDetector);
+
+	return 0;
+}
+
+/* Set what spitd decided on the channel, the way isAutomatedDialer() does for a local analysis */
+static void spit_set_remote_verdict(struct ast_channel *chan, struct spit_remote_verdict *verdict, struct timeval start,
+	const char *trunk)
+{
+	enum spit_status status;
+
+	pbx_builtin_setvar_helper(chan, "SPITSTATUS", verdict->status);
+	pbx_builtin_setvar_helper(chan, "SPITCAUSE", verdict->cause);
+	pbx_builtin_setvar_helper(chan, "SPITPHASE", verdict->answered ? "ANSWERED" : "EARLY");
+	if (verdict->greetingEndCause) {
+		char greetingEnd[16];
+
+		snprintf(greetingEnd, sizeof(greetingEnd), "%d", verdict->greetingEnd);
+		pbx_builtin_setvar_helper(chan, "SPITGREETINGEND", greetingEnd);
+		pbx_builtin_setvar_helper(chan, "SPITGREETINGENDCAUSE", spit_greeting_end_name(verdict->greetingEndCause));
+	}
+
+	verdict->features.decisionTime = ast_tvdiff_ms(ast_tvnow(), start);
+	spit_store_features(chan, &verdict->features);
+
+	if (spit_tuning_enabled()) {
+		for (status = SPIT_HUMAN; status <= SPIT_HANGUP; status++) {
+			if (!strcmp(spit_status_name(status), verdict->status)) {
+				spit_store_sample(chan, trunk, status, verdict->cause);
 				break;
 			}
+		}
+	}
+}
 
-			/* Feed the frame of audio into the silence detector and see if we get a result */
-			if (f->frametype != AST_FRAME_VOICE)
-				dspsilence += 2 * maxWaitTimeForFrame;
-			else {
-				dspsilence = 0;
-				ast_dsp_silence(silenceDetector, f, &dspsilence);
-			}
+/* Read what spitd sent, its progress reports go out as SPITProgress events */
+static int spit_remote_poll(struct ast_channel *chan, struct spit_remote *remote, struct spit_remote_verdict *verdict)
+{
+	struct spit_remote_progress progress;
+	int res;
 
-			if (dspsilence > 0) {
-				silenceDuration = dspsilence;
-				
-				if (silenceDuration >= betweenWordsSilence) {
-					if (currentState != STATE_IN_SILENCE ) {
-						ast_verb(3, "SPIT: Channel [%s]. Changed state to STATE_IN_SILENCE\n", ast_channel_name(chan));
-					}
-					/* Find words less than word duration */
-					if (consecutiveVoiceDuration < minimumWordLength && consecutiveVoiceDuration > 0){
-						ast_verb(3, "SPIT: Channel [%s]. Short Word Duration: %d\n", ast_channel_name(chan), consecutiveVoiceDuration);
-					}
-					currentState  = STATE_IN_SILENCE;
-					consecutiveVoiceDuration = 0;
-				}
+	while ((res = spit_remote_read(remote, verdict, &progress)) == 2) {
+		spit_progress_event(chan, &progress.progress, progress.cause, progress.greetingEnd,
+			progress.greetingEndCause);
+	}
 
-				if (inInitialSilence == 1  && silenceDuration >= initialSilence) {
-					ast_verb(3, "SPIT: Channel [%s]. AUTOMATED DIALER: silenceDuration:%d initialSilence:%d\n",
-						ast_channel_name(chan), silenceDuration, initialSilence);
-					ast_frfree(f);
-					strcpy(spitStatus , "HUMAN");
-					sprintf(spitCause , "INITIALSILENCE-%d-%d", silenceDuration, initialSilence);
-					res = 1;
-					break;
-				}
-				
-				if (silenceDuration >= afterGreetingSilence  &&  inGreeting == 1) {
-					ast_verb(3, "SPIT: Channel [%s]. HUMAN: silenceDuration:%d afterGreetingSilence:%d\n",
-						ast_channel_name(chan), silenceDuration, afterGreetingSilence);
-					ast_frfree(f);
-					strcpy(spitStatus , "HUMAN");
-					sprintf(spitCause , "SILENCEAFTERNOISE-%d-%d", silenceDuration, afterGreetingSilence);
-					res = 1;
-					break;
-				}
-				
-			} else {
-				consecutiveVoiceDuration += framelength;
-				voiceDuration += framelength;
-
-				/* If I have enough consecutive voice to say that I am in a Word, I can only increment the
-				   number of words if my previous state was Silence, which means that I moved into a word. */
-				if (consecutiveVoiceDuration >= minimumWordLength && currentState == STATE_IN_SILENCE) {
-					iWordsCount++;
-					ast_verb(3, "SPIT: Channel [%s]. Word detected. iWordsCount:%d\n", ast_channel_name(chan), iWordsCount);
-					currentState = STATE_IN_WORD;
-				}
-				if (consecutiveVoiceDuration >= maximumWordLength){
-					ast_verb(3, "SPIT: Channel [%s]. Maximum Word Length detected. [%d]\n", ast_channel_name(chan), consecutiveVoiceDuration);
-					ast_frfree(f);
-					strcpy(spitStatus , "MACHINE");
-					sprintf(spitCause , "MAXWORDLENGTH-%d", consecutiveVoiceDuration);
-					break;
-				}
-				if (iWordsCount >= maximumNumberOfWords) {
-					ast_verb(3, "SPIT: Channel [%s]. ANSWERING MACHINE: iWordsCount:%d\n", ast_channel_name(chan), iWordsCount);
-					ast_frfree(f);
-					strcpy(spitStatus , "MACHINE");
-					sprintf(spitCause , "MAXWORDS-%d-%d", iWordsCount, maximumNumberOfWords);
-					res = 1;
-					break;
-				}
+	return res;
+}
 
-				if (inGreeting == 1 && voiceDuration >= greeting) {
-					ast_verb(3, "SPIT: Channel [%s]. ANSWERING MACHINE: voiceDuration:%d greeting:%d\n", ast_channel_name(chan), voiceDuration, greeting);
-					ast_frfree(f);
-					strcpy(spitStatus , "MACHINE");
-					sprintf(spitCause , "LONGGREETING-%d-%d", voiceDuration, greeting);
-					res = 1;
-					break;
-				}
+/*!
+ * \brief Have spitd analyze the call, we only pass the audio on
+ * \retval 0 done, the channel variables are set
+ * \retval -1 spitd did not take the call, analyze it here
+ */
+static int spit_analyze_remote(struct ast_channel *chan, const struct spit_engine *engine, struct timeval start,
+	const char *trunk)
+{
+	struct spit_remote_config config;
+	struct spit_remote remote;
+	struct spit_remote_verdict verdict;
+	struct spit_frame_info info;
+	struct ast_frame *f;
+	struct ast_channel *ready;
+	int res = 0, ms, outfd;
+	int64_t deadline;
+	RAII_VAR(struct ast_format *, readFormat, NULL, ao2_cleanup);
 
-				if (voiceDuration >= minimumWordLength ) {
-					if (silenceDuration > 0)
-						ast_verb(3, "SPIT: Channel [%s]. Detected Talk, previous silence duration: %d, current voice duration: %d\n", ast_channel_name(chan), silenceDuration, voiceDuration);
-					silenceDuration = 0;
-				}
-				if (consecutiveVoiceDuration >= minimumWordLength && inGreeting == 0) {
-					/* Only go in here once to change the greeting flag when we detect the 1st word */
-					if (silenceDuration > 0)
-						ast_verb(3, "SPIT: Channel [%s]. Before Greeting Time:  silenceDuration: %d voiceDuration: %d\n", ast_channel_name(chan), silenceDuration, voiceDuration);
-					inInitialSilence = 0;
-					inGreeting = 1;
-				}
-				
-			}
-			ast_debug(3, "SPIT: Channel [%s]: silenceDuration [%d] voiceDuration [%d] consecutiveVoiceDuration [%d]"
-				" iWordsCount [%d] currentState [%d] inInitialSilence [%d] inGreeting [%d]\n",
-				ast_channel_name(chan), silenceDuration, voiceDuration, consecutiveVoiceDuration,
-				 iWordsCount, currentState, inInitialSilence, inGreeting);
+	spit_remote_get_config(&config);
+	if (spit_remote_start(&remote, ast_channel_uniqueid(chan), &engine->params, engine->answered,
+			S_COR(ast_channel_caller(chan)->ani.number.valid, ast_channel_caller(chan)->ani.number.str, NULL))) {
+		if (config.fallback) {
+			ast_log(LOG_WARNING, "SPIT: Channel [%s]. spitd at %s:%d did not take the call, analyzing here\n",
+				ast_channel_name(chan), config.host, config.port);
+			return -1;
 		}
-		ast_frfree(f);
+		ast_log(LOG_WARNING, "SPIT: Channel [%s]. spitd at %s:%d did not take the call\n",
+			ast_channel_name(chan), config.host, config.port);
+		pbx_builtin_setvar_helper(chan, "SPITSTATUS", "NOTSURE");
+		pbx_builtin_setvar_helper(chan, "SPITCAUSE", "REMOTE");
+		return 0;
 	}
-	
-	if (!res) {
-		/* It took too long to get a frame back. Giving up. */
-		ast_verb(3, "SPIT: Channel [%s]. No frames detected, erring on the side of MACHINE...\n", ast_channel_name(chan));
-		strcpy(spitStatus , "MACHINE");
-		sprintf(spitCause , "NOFRAMES-%d", iTotalTime);
+	spit_clear_state(chan);
+
+	readFormat = ao2_bump(ast_channel_readformat(chan));
+	if (ast_set_read_format(chan, ast_format_slin) < 0 ) {
+		ast_log(LOG_WARNING, "SPIT: Channel [%s]. Unable to set to linear mode, giving up\n", ast_channel_name(chan));
+		spit_remote_stop(&remote);
+		pbx_builtin_setvar_helper(chan , "SPITSTATUS", "NOTSLIN");
+		pbx_builtin_setvar_helper(chan , "SPITCAUSE", "INVALIDFORMAT");
+		return 0;
 	}
 
-	/* Set the status and cause on the channel */
-	pbx_builtin_setvar_helper(chan , "SPITSTATUS" , spitStatus);
-	pbx_builtin_setvar_helper(chan , "SPITCAUSE" , spitCause);
+	ast_verb(3, "SPIT: Channel [%s]. Analyzing on spitd at %s:%d\n", ast_channel_name(chan), config.host, config.port);
+
+	/* spitd keeps time by the audio, we only make sure a verdict that never comes does not hold the call */
+	deadline = spit_now() + engine->params.totalAnalysisTime + config.timeout
+		+ (engine->params.trackGreetingEnd ? engine->params.greetingEndTimeout : 0);
+
+	while ((ms = deadline - spit_now()) > 0) {
+		outfd = -1;
+		ready = ast_waitfor_nandfds(&chan, 1, &remote.control, 1, NULL, &outfd, &ms);
+		if (!ready) {
+			if ((res = spit_remote_poll(chan, &remote, &verdict)))
+				break;
+			continue;
+		}
+
+		if (!(f = ast_read(chan))) {
+			/* spitd settles on HANGUP, or on greeting end HANGUP after a verdict */
+			ast_debug(1, "Got hangup\n");
+			spit_remote_hangup(&remote);
+			for (ms = config.timeout; !res && ast_wait_for_input(remote.control, ms) > 0; )
+				res = spit_remote_poll(chan, &remote, &verdict);
+			break;
+		}
+
+		switch (f->frametype) {
+		case AST_FRAME_DTMF_END:
+			/* spitd takes every DTMF as a digit, the begin would send it twice */
+			spit_remote_dtmf(&remote, f->subclass.integer);
+			break;
+		case AST_FRAME_VOICE:
+			info.hasSeqno = ast_test_flag(f, AST_FRFLAG_HAS_SEQUENCE_NUMBER) ? 1 : 0;
+			info.seqno = f->seqno;
+			info.hasTimestamp = ast_test_flag(f, AST_FRFLAG_HAS_TIMING_INFO) ? 1 : 0;
+			info.ts = f->ts;
+			spit_remote_audio(&remote, f->data.ptr, f->samples, &info);
+			break;
+		default:
+			break;
+		}
+		ast_frfree(f);
+	}
+
+	spit_remote_stop(&remote);
 
-	/* Restore channel read format */
 	if (readFormat && ast_set_read_format(chan, readFormat))
 		ast_log(LOG_WARNING, "SPIT: Unable to restore read format on '%s'\n", ast_channel_name(chan));
 
-	/* Free the DSP used to detect silence */
-	ast_dsp_free(silenceDetector);
+	if (res != 1) {
+		ast_log(LOG_WARNING, "SPIT: Channel [%s]. %s\n", ast_channel_name(chan),
+			res < 0 ? "Lost spitd before the verdict" : "No verdict from spitd in time");
+		pbx_builtin_setvar_helper(chan, "SPITSTATUS", "NOTSURE");
+		pbx_builtin_setvar_helper(chan, "SPITCAUSE", "REMOTE");
+		return 0;
+	}
 
-	return;
+	spit_set_remote_verdict(chan, &verdict, start, trunk);
+
+	return 0;
+}
+
+/* Set the status and cause on the channel */
+static void spit_set_verdict(struct spit_call *call)
+{
+	struct ast_channel *chan = call->chan;
+	const struct spit_engine *engine = &call->engine;
+
+	pbx_builtin_setvar_helper(chan , "SPITSTATUS" , call->status);
+	pbx_builtin_setvar_helper(chan , "SPITCAUSE" , call->cause);
+	pbx_builtin_setvar_helper(chan , "SPITPHASE" , engine->answered ? "ANSWERED" : "EARLY");
+	if (engine->greetingEndCause) {
+		char greetingEnd[16];
+
+		snprintf(greetingEnd, sizeof(greetingEnd), "%d", engine->greetingEnd);
+		pbx_builtin_setvar_helper(chan, "SPITGREETINGEND", greetingEnd);
+		pbx_builtin_setvar_helper(chan, "SPITGREETINGENDCAUSE", spit_greeting_end_name(engine->greetingEndCause));
+	}
+}
+
+/* What the analysis found stays on the channel for SPIT_FEATURES(), SPIT(...,r) and SPIT_FEEDBACK() */
+static void spit_store(struct spit_call *call)
+{
+	spit_store_features(call->chan, &call->features);
+	spit_save_state(call->chan, &call->engine);
+	if (spit_tuning_enabled())
+		spit_store_sample(call->chan, call->trunk, call->engine.status, call->cause);
+}
+
+static const struct spit_call_ops spit_call_ops = {
+	.set_verdict = spit_set_verdict,
+	.progress = spit_publish_progress,
+	.store = spit_store,
+};
+
+static void isAutomatedDialer(struct ast_channel *chan, const char *data, const struct spit_burst_hit *burst)
+{
+	struct ast_flags options = { 0 };
+	char *opts[OPT_ARG_ARRAY_SIZE] = { NULL, };
+	struct spit_call call = { .ops = &spit_call_ops, .chan = chan, .log = spit_log };
+	struct spit_engine state;
+	struct timeval start = ast_tvnow();
+	int answered, resumed;
+	char *parse = ast_strdupa(data);
+
+	/* Lets set the initial values of the variables that will control the algorithm.
+	   The initial values are the default ones. If they are passed as arguments
+	   when invoking the application, then the default values will be overwritten
+	   by the ones passed as parameters. */
+	struct spit_params params = dfltParams;
+
+	AST_DECLARE_APP_ARGS(args,
+		AST_APP_ARG(argInitialSilence);
+		AST_APP_ARG(argGreeting);
+		AST_APP_ARG(argAfterGreetingSilence);
+		AST_APP_ARG(argTotalAnalysisTime);
+		AST_APP_ARG(argMinimumWordLength);
+		AST_APP_ARG(argBetweenWordsSilence);
+		AST_APP_ARG(argMaximumNumberOfWords);
+		AST_APP_ARG(argSilenceThreshold);
+		AST_APP_ARG(argMaximumWordLength);
+		AST_APP_ARG(argOptions);
+	);
+
+	ast_verb(3, "SPIT: %s %s %s (Fmt: %s)\n", ast_channel_name(chan),
+		S_COR(ast_channel_caller(chan)->ani.number.valid, ast_channel_caller(chan)->ani.number.str, "(N/A)"),
+		S_COR(ast_channel_redirecting(chan)->from.number.valid, ast_channel_redirecting(chan)->from.number.str, "(N/A)"),
+		ast_format_get_name(ast_channel_readformat(chan)));
+
+	/* What the trunk learned from feedback goes under the arguments */
+	if (spit_tuning_enabled()) {
+		spit_trunk_name(chan, call.trunk, sizeof(call.trunk));
+		if (!spit_tuning_apply(call.trunk, &params)) {
+			ast_verb(3, "SPIT: Channel [%s]. Tuned for trunk [%s]\n", ast_channel_name(chan), call.trunk);
+		}
+	}
+
+	/* Lets parse the arguments. */
+	if (!ast_strlen_zero(parse)) {
+		/* Some arguments have been passed. Lets parse them and overwrite the defaults. */
+		AST_STANDARD_APP_ARGS(args, parse);
+		if (!ast_strlen_zero(args.argInitialSilence))
+			params.initialSilence = atoi(args.argInitialSilence);
+		if (!ast_strlen_zero(args.argGreeting))
+			params.greeting = atoi(args.argGreeting);
+		if (!ast_strlen_zero(args.argAfterGreetingSilence))
+			params.afterGreetingSilence = atoi(args.argAfterGreetingSilence);
+		if (!ast_strlen_zero(args.argTotalAnalysisTime))
+			params.totalAnalysisTime = atoi(args.argTotalAnalysisTime);
+		if (!ast_strlen_zero(args.argMinimumWordLength))
+			params.minimumWordLength = atoi(args.argMinimumWordLength);
+		if (!ast_strlen_zero(args.argBetweenWordsSilence))
+			params.betweenWordsSilence = atoi(args.argBetweenWordsSilence);
+		if (!ast_strlen_zero(args.argMaximumNumberOfWords))
+			params.maximumNumberOfWords = atoi(args.argMaximumNumberOfWords);
+		if (!ast_strlen_zero(args.argSilenceThreshold))
+			params.silenceThreshold = atoi(args.argSilenceThreshold);
+		if (!ast_strlen_zero(args.argMaximumWordLength))
+			params.maximumWordLength = atoi(args.argMaximumWordLength);
+		if (!ast_strlen_zero(args.argOptions))
+			ast_app_parse_options(spit_opts, &options, opts, args.argOptions);
+		if (ast_test_flag(&options, OPT_GREETING_END)) {
+			params.trackGreetingEnd = 1;
+			if (!ast_strlen_zero(opts[OPT_ARG_GREETING_END]))
+				params.greetingEndTimeout = atoi(opts[OPT_ARG_GREETING_END]);
+		}
+	} else {
+		ast_debug(1, "SPIT using the default parameters.\n");
+	}
+
+	answered = !ast_test_flag(&options, OPT_EARLY_MEDIA) || ast_channel_state(chan) == AST_STATE_UP;
+	resumed = ast_test_flag(&options, OPT_RESUME) && !spit_load_state(chan, &state);
+	call.ani = S_COR(ast_channel_caller(chan)->ani.number.valid, ast_channel_caller(chan)->ani.number.str, NULL);
+	call.start = (int64_t) start.tv_sec * 1000 + start.tv_usec / 1000;
+	call.logLevel = option_debug ? SPIT_LOG_DEBUG : VERBOSITY_ATLEAST(3) ? SPIT_LOG_VERBOSE : SPIT_LOG_NONE;
+
+	switch (spit_call_start(&call, &params, answered, resumed ? &state : NULL, burst)) {
+	case SPIT_CALL_DONE:
+		return;
+	case SPIT_CALL_ANALYZE:
+		/* spitd gets answered calls without a prompt, early media and barge-in need the channel here */
+		if (spit_remote_enabled() && call.engine.answered && !resumed && !ast_test_flag(&options, OPT_BARGE_IN)
+			&& !spit_analyze_remote(chan, &call.engine, start, call.trunk))
+			return;
+		if (spit_analyze(chan, &call, ast_test_flag(&options, OPT_BARGE_IN) ? opts[OPT_ARG_BARGE_IN] : NULL))
+			return;
+		break;
+	case SPIT_CALL_GREETING:
+		/* Decided on the burst alone, the whole greeting is still to come */
+		if (spit_analyze(chan, &call, NULL))
+			return;
+		break;
+	case SPIT_CALL_FINISH:
+		break;
+	}
+
+	spit_call_finish(&call, spit_now());
 }
 
 
 static int spit_exec(struct ast_channel *chan, const char *data)
 {
-	isAutomatedDialer(chan, data);
+	struct spit_burst_hit burst = { "", 0 };
+	struct spit_engine state;
+
+	/* A call that has been through SPIT before was counted then, go by what that run found */
+	if (!spit_load_state(chan, &state)) {
+		burst = state.burst;
+	} else {
+		spit_burst_record(S_COR(ast_channel_caller(chan)->ani.number.valid,
+			ast_channel_caller(chan)->ani.number.str, NULL), spit_now(), &burst);
+	}
+
+	isAutomatedDialer(chan, data, &burst);
 
 	return 0;
 }
@@ -466,8 +1097,21 @@ static int load_config(int reload)
 	char *cat = NULL;
 	struct ast_variable *var = NULL;
 	struct ast_flags config_flags = { reload ? CONFIG_FLAG_FILEUNCHANGED : 0 };
+	struct spit_params params;
+	struct spit_burst_config burst;
+	struct spit_analytics_config analytics;
+	struct spit_remote_config remote;
+	struct spit_tuning_config tuning;
+	struct spit_pipeline pipeline;
+	char stages[128];
 
-	dfltSilenceThreshold = ast_dsp_get_threshold_from_settings(THRESHOLD_SILENCE);
+	spit_params_defaults(&params);
+	spit_burst_defaults(&burst);
+	spit_analytics_defaults(&analytics);
+	spit_remote_defaults(&remote);
+	spit_tuning_defaults(&tuning);
+	spit_pipeline_defaults(&pipeline);
+	params.silenceThreshold = ast_dsp_get_threshold_from_settings(THRESHOLD_SILENCE);
 
 	if (!(cfg = ast_config_load("spit.conf", config_flags))) {
 		ast_log(LOG_ERROR, "Configuration file spit.conf missing.\n");
@@ -482,51 +1126,402 @@ static int load_config(int reload)
 	cat = ast_category_browse(cfg, NULL);
 
 	while (cat) {
-		if (!strcasecmp(cat, "general") ) {
+		if (!strcasecmp(cat, "general") || !strcasecmp(cat, "burst")) {
 			var = ast_variable_browse(cfg, cat);
 			while (var) {
-				if (!strcasecmp(var->name, "initial_silence")) {
-					dfltInitialSilence = atoi(var->value);
-				} else if (!strcasecmp(var->name, "greeting")) {
-					dfltGreeting = atoi(var->value);
-				} else if (!strcasecmp(var->name, "after_greeting_silence")) {
-					dfltAfterGreetingSilence = atoi(var->value);
-				} else if (!strcasecmp(var->name, "silence_threshold")) {
-					dfltSilenceThreshold = atoi(var->value);
-				} else if (!strcasecmp(var->name, "total_analysis_time")) {
-					dfltTotalAnalysisTime = atoi(var->value);
-				} else if (!strcasecmp(var->name, "min_word_length")) {
-					dfltMinimumWordLength = atoi(var->value);
-				} else if (!strcasecmp(var->name, "between_words_silence")) {
-					dfltBetweenWordsSilence = atoi(var->value);
-				} else if (!strcasecmp(var->name, "maximum_number_of_words")) {
-					dfltMaximumNumberOfWords = atoi(var->value);
-				} else if (!strcasecmp(var->name, "maximum_word_length")) {
-					dfltMaximumWordLength = atoi(var->value);
-
-				} else {
-					ast_log(LOG_WARNING, "%s: Cat:%s. Unknown keyword %s at line %d of spit.conf\n",
+				if (!strcasecmp(cat, "general") && !strcasecmp(var->name, "progress_zone")) {
+					ast_copy_string(dfltProgressZone, var->value, sizeof(dfltProgressZone));
+				} else if (spit_config_apply(&params, &burst, cat, var->name, var->value)) {
+					ast_log(LOG_WARNING, "%s: Cat:%s. Unknown keyword or bad value %s at line %d of spit.conf\n",
 						app, cat, var->name, var->lineno);
 				}
 				var = var->next;
 			}
+		} else if (!strcasecmp(cat, "analytics")) {
+			for (var = ast_variable_browse(cfg, cat); var; var = var->next) {
+				if (spit_analytics_config_apply(&analytics, var->name, var->value)) {
+					ast_log(LOG_WARNING, "%s: Cat:%s. Unknown keyword %s at line %d of spit.conf\n",
+						app, cat, var->name, var->lineno);
+				}
+			}
+		} else if (!strcasecmp(cat, "remote")) {
+			for (var = ast_variable_browse(cfg, cat); var; var = var->next) {
+				if (spit_remote_config_apply(&remote, var->name, var->value)) {
+					ast_log(LOG_WARNING, "%s: Cat:%s. Unknown keyword %s at line %d of spit.conf\n",
+						app, cat, var->name, var->lineno);
+				}
+			}
+		} else if (!strcasecmp(cat, "tuning")) {
+			for (var = ast_variable_browse(cfg, cat); var; var = var->next) {
+				if (spit_tuning_config_apply(&tuning, var->name, var->value)) {
+					ast_log(LOG_WARNING, "%s: Cat:%s. Unknown keyword or bad value %s at line %d of spit.conf\n",
+						app, cat, var->name, var->lineno);
+				}
+			}
+		} else if (!strcasecmp(cat, "pipeline")) {
+			for (var = ast_variable_browse(cfg, cat); var; var = var->next) {
+				if (spit_pipeline_config_apply(&pipeline, var->name, var->value)) {
+					ast_log(LOG_WARNING, "%s: Cat:%s. Unknown keyword or bad value %s at line %d of spit.conf\n",
+						app, cat, var->name, var->lineno);
+				}
+			}
 		}
 		cat = ast_category_browse(cfg, cat);
 	}
 
 	ast_config_destroy(cfg);
 
+	dfltParams = params;
+	spit_burst_configure(&burst);
+	spit_analytics_configure(&analytics);
+	spit_remote_configure(&remote);
+	spit_tuning_configure(&tuning, &params);
+	spit_pipeline_configure(&pipeline);
+
 	ast_verb(3, "SPIT defaults: initialSilence [%d] greeting [%d] afterGreetingSilence [%d] "
 		"totalAnalysisTime [%d] minimumWordLength [%d] betweenWordsSilence [%d] maximumNumberOfWords [%d] silenceThreshold [%d] maximumWordLength [%d]\n",
-		dfltInitialSilence, dfltGreeting, dfltAfterGreetingSilence, dfltTotalAnalysisTime,
-		dfltMinimumWordLength, dfltBetweenWordsSilence, dfltMaximumNumberOfWords, dfltSilenceThreshold, dfltMaximumWordLength);
+		params.initialSilence, params.greeting, params.afterGreetingSilence, params.totalAnalysisTime,
+		params.minimumWordLength, params.betweenWordsSilence, params.maximumNumberOfWords, params.silenceThreshold, params.maximumWordLength);
+
+	spit_pipeline_format(&pipeline, stages, sizeof(stages));
+	ast_verb(3, "SPIT pipeline: %s\n", stages);
+
+	if (burst.enabled) {
+		ast_verb(3, "SPIT burst detection: window [%d] threshold [%d] prefixes [%d] action [%s]\n",
+			burst.window, burst.threshold, burst.numPrefixes,
+			burst.action == BURST_ACTION_MACHINE ? "machine" : "strict");
+	}
+
+	if (analytics.enabled) {
+		ast_verb(3, "SPIT analytics: directory [%s] rotate_size [%d] rotate_interval [%d] flush_interval [%d]\n",
+			analytics.directory, analytics.rotateSize, analytics.rotateInterval, analytics.flushInterval);
+	}
+
+	if (remote.enabled) {
+		ast_verb(3, "SPIT remote analysis: spitd [%s:%d] timeout [%d] fallback [%s]\n",
+			remote.host, remote.port, remote.timeout, remote.fallback ? "yes" : "no");
+	}
+
+	if (tuning.enabled) {
+		ast_verb(3, "SPIT tuning: target [%d%%] window [%d] silenceThreshold [%d-%d] "
+			"betweenWordsSilence [%d-%d] totalAnalysisTime [%d-%d]\n", tuning.target, tuning.window,
+			tuning.min[SPIT_TUNED_SILENCE_THRESHOLD], tuning.max[SPIT_TUNED_SILENCE_THRESHOLD],
+			tuning.min[SPIT_TUNED_BETWEEN_WORDS_SILENCE], tuning.max[SPIT_TUNED_BETWEEN_WORDS_SILENCE],
+			tuning.min[SPIT_TUNED_TOTAL_ANALYSIS_TIME], tuning.max[SPIT_TUNED_TOTAL_ANALYSIS_TIME]);
+	}
 
 	return 0;
 }
 
+static int spit_features_read(struct ast_channel *chan, const char *cmd, char *data, char *buf, size_t len)
+{
+	struct ast_datastore *datastore;
+	struct spit_features features;
+	int i;
+
+	if (!chan) {
+		ast_log(LOG_WARNING, "No channel was provided to %s function.\n", cmd);
+		return -1;
+	}
+
+	if (ast_strlen_zero(data)) {
+		ast_log(LOG_WARNING, "%s requires a field name.\n", cmd);
+		return -1;
+	}
+
+	for (i = 0; i < (int) ARRAY_LEN(spit_feature_fields); i++) {
+		if (!strcasecmp(spit_feature_fields[i].name, data))
+			break;
+	}
+	if (i == ARRAY_LEN(spit_feature_fields)) {
+		ast_log(LOG_WARNING, "%s: Unknown field '%s'.\n", cmd, data);
+		return -1;
+	}
+
+	ast_channel_lock(chan);
+	if (!(datastore = ast_channel_datastore_find(chan, &spit_features_info, NULL))) {
+		ast_channel_unlock(chan);
+		return -1;
+	}
+	memcpy(&features, datastore->data, sizeof(features));
+	ast_channel_unlock(chan);
+
+	snprintf(buf, len, "%d", *(int *) ((char *) &features + spit_feature_fields[i].offset));
+
+	return 0;
+}
+
+static struct ast_custom_function spit_features_function = {
+	.name = "SPIT_FEATURES",
+	.read = spit_features_read,
+};
+
+static int spit_feedback_write(struct ast_channel *chan, const char *cmd, char *data, const char *value)
+{
+	struct ast_datastore *datastore;
+	struct spit_tuning_sample sample;
+	enum spit_status truth;
+
+	if (!chan) {
+		ast_log(LOG_WARNING, "No channel was provided to %s function.\n", cmd);
+		return -1;
+	}
+
+	if (!strcasecmp(value, "HUMAN")) {
+		truth = SPIT_HUMAN;
+	} else if (!strcasecmp(value, "MACHINE")) {
+		truth = SPIT_MACHINE;
+	} else {
+		ast_log(LOG_WARNING, "%s: Unknown outcome '%s', use HUMAN or MACHINE.\n", cmd, value);
+		return -1;
+	}
+
+	/* Each verdict is reported on once */
+	ast_channel_lock(chan);
+	if (!(datastore = ast_channel_datastore_find(chan, &spit_sample_info, NULL))) {
+		ast_channel_unlock(chan);
+		ast_debug(1, "%s: No SPIT verdict on %s to report on.\n", cmd, ast_channel_name(chan));
+		return 0;
+	}
+	memcpy(&sample, datastore->data, sizeof(sample));
+	ast_channel_datastore_remove(chan, datastore);
+	ast_channel_unlock(chan);
+	ast_datastore_free(datastore);
+
+	if (!spit_tuning_feedback(&sample, truth)) {
+		ast_debug(1, "%s: %s on trunk %s was %s.\n", cmd, spit_status_name(sample.status), sample.trunk,
+			spit_status_name(truth));
+	}
+
+	return 0;
+}
+
+static struct ast_custom_function spit_feedback_function = {
+	.name = "SPIT_FEEDBACK",
+	.write = spit_feedback_write,
+};
+
+static char *handle_cli_spit_show_bursts(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct spit_burst_heavy_hitter hitters[BURST_HEAVY_HITTERS];
+	struct spit_burst_config burst;
+	int i, shown;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "spit show bursts";
+		e->usage =
+			"Usage: spit show bursts\n"
+			"       Lists the ANI prefixes with the highest call rate in the\n"
+			"       current burst window.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 3)
+		return CLI_SHOWUSAGE;
+
+	spit_burst_get_config(&burst);
+	if (!burst.enabled) {
+		ast_cli(a->fd, "Burst detection is disabled.\n");
+		return CLI_SUCCESS;
+	}
+
+	shown = spit_burst_heavy_hitters(spit_now(), hitters, ARRAY_LEN(hitters));
+
+	ast_cli(a->fd, "%-16s %-8s %s\n", "Prefix", "Calls", "Status");
+	for (i = 0; i < shown; i++) {
+		ast_cli(a->fd, "%-16s %-8u %s\n", hitters[i].prefix, hitters[i].count,
+			hitters[i].count >= (unsigned int) burst.threshold ? "BURST" : "watching");
+	}
+	ast_cli(a->fd, "%d prefix%s over %d calls per %d ms\n", shown, shown == 1 ? "" : "es",
+		burst.threshold / 2, burst.window);
+
+	return CLI_SUCCESS;
+}
+
+static char *handle_cli_spit_show_perf(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct spit_perf_stage stages[SPIT_STAGES];
+	uint64_t analyses;
+	int i;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "spit show perf";
+		e->usage =
+			"Usage: spit show perf\n"
+			"       Shows the cycles spent in each stage of the analysis since the\n"
+			"       module was loaded. Needs perf_counters = yes in spit.conf.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 3)
+		return CLI_SHOWUSAGE;
+
+	if (!dfltParams.perfCounters)
+		ast_cli(a->fd, "Performance counters are disabled, cycles are from when they were on.\n");
+
+	analyses = spit_perf_get(stages);
+
+	ast_cli(a->fd, "%-10s %-12s %-14s %-14s %s\n", "Stage", "Calls", "Samples", "Cycles/call", "Cycles/sample");
+	for (i = 0; i < SPIT_STAGES; i++) {
+		ast_cli(a->fd, "%-10s %-12" PRIu64 " %-14" PRIu64 " %-14" PRIu64 " %.2f\n", spit_stage_name(i),
+			stages[i].calls, stages[i].samples,
+			stages[i].calls ? stages[i].cycles / stages[i].calls : 0,
+			stages[i].samples ? (double) stages[i].cycles / stages[i].samples : 0.0);
+	}
+	ast_cli(a->fd, "%" PRIu64 " analys%s\n", analyses, analyses == 1 ? "is" : "es");
+
+	return CLI_SUCCESS;
+}
+
+static char *handle_cli_spit_show_pipeline(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct spit_perf_stage stages[SPIT_STAGES];
+	struct spit_pipeline pipeline;
+	struct spit_perf_stage *s;
+	char budget[16];
+	int i;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "spit show pipeline";
+		e->usage =
+			"Usage: spit show pipeline\n"
+			"       Shows the detection stages in the order they run, how often\n"
+			"       each one decided and what it costs.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 3)
+		return CLI_SHOWUSAGE;
+
+	spit_pipeline_get(&pipeline);
+	spit_perf_get(stages);
+
+	ast_cli(a->fd, "%-10s %-8s %-10s %-10s %-7s %-14s %s\n", "Stage", "Budget", "Analyses", "Verdicts", "Hit%",
+		"Cycles/sample", "Over budget");
+	for (i = 0; i < pipeline.numStages; i++) {
+		s = &stages[pipeline.stages[i]];
+		if (pipeline.budget[pipeline.stages[i]])
+			snprintf(budget, sizeof(budget), "%d", pipeline.budget[pipeline.stages[i]]);
+		else
+			ast_copy_string(budget, "-", sizeof(budget));
+		ast_cli(a->fd, "%-10s %-8s %-10" PRIu64 " %-10" PRIu64 " %-7.1f %-14.2f %" PRIu64 "\n",
+			spit_stage_name(pipeline.stages[i]), budget, s->analyses, s->verdicts,
+			s->analyses ? (double) s->verdicts * 100 / s->analyses : 0.0,
+			s->samples ? (double) s->cycles / s->samples : 0.0, s->overBudget);
+	}
+	if (!dfltParams.perfCounters)
+		ast_cli(a->fd, "Cycles are only counted with perf_counters = yes or for stages with a budget.\n");
+
+	return CLI_SUCCESS;
+}
+
+static char *handle_cli_spit_show_analytics(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct spit_analytics_stats stats;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "spit show analytics";
+		e->usage =
+			"Usage: spit show analytics\n"
+			"       Shows how many analyses went to the analytics log and the\n"
+			"       file they are written to.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 3)
+		return CLI_SHOWUSAGE;
+
+	if (!spit_analytics_enabled())
+		ast_cli(a->fd, "The analytics log is disabled, counters are from when it was on.\n");
+
+	spit_analytics_get_stats(&stats);
+
+	ast_cli(a->fd, "Records logged:  %" PRIu64 "\n", stats.records);
+	ast_cli(a->fd, "Records written: %" PRIu64 "\n", stats.written);
+	ast_cli(a->fd, "Records dropped: %" PRIu64 "\n", stats.dropped);
+	ast_cli(a->fd, "Write errors:    %" PRIu64 "\n", stats.errors);
+	ast_cli(a->fd, "Bytes written:   %" PRIu64 "\n", stats.bytes);
+	ast_cli(a->fd, "Files opened:    %u\n", stats.files);
+	ast_cli(a->fd, "Current file:    %s\n", S_OR(stats.file, "(none)"));
+
+	return CLI_SUCCESS;
+}
+
+static char *handle_cli_spit_show_tuning(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct spit_tuning_trunk *trunks;
+	char right[8], window[24];
+	int i, shown;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "spit show tuning";
+		e->usage =
+			"Usage: spit show tuning\n"
+			"       Lists the trunks SPIT_FEEDBACK() reported on, how often their\n"
+			"       verdicts were right and the values they are analyzed with.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 3)
+		return CLI_SHOWUSAGE;
+
+	if (!spit_tuning_enabled())
+		ast_cli(a->fd, "Tuning is disabled, trunks keep the values they were tuned to.\n");
+
+	if (!(trunks = ast_calloc(SPIT_TUNING_TRUNKS, sizeof(*trunks))))
+		return CLI_FAILURE;
+	shown = spit_tuning_get_trunks(trunks, SPIT_TUNING_TRUNKS);
+
+	ast_cli(a->fd, "%-24s %-9s %-9s %-9s %-10s %-10s %-10s %s\n", "Trunk", "Reports", "Right", "Window",
+		"Threshold", "Between", "Total", "Adjusted");
+	for (i = 0; i < shown; i++) {
+		snprintf(right, sizeof(right), "%d%%", (int) (trunks[i].correct * 100 / trunks[i].reports));
+		snprintf(window, sizeof(window), "%d/%d", trunks[i].windowCorrect, trunks[i].windowReports);
+		ast_cli(a->fd, "%-24s %-9" PRIu64 " %-9s %-9s %-10d %-10d %-10d %u\n", trunks[i].name, trunks[i].reports,
+			right, window, trunks[i].values[SPIT_TUNED_SILENCE_THRESHOLD],
+			trunks[i].values[SPIT_TUNED_BETWEEN_WORDS_SILENCE], trunks[i].values[SPIT_TUNED_TOTAL_ANALYSIS_TIME],
+			trunks[i].adjustments);
+	}
+	ast_cli(a->fd, "%d trunk%s\n", shown, shown == 1 ? "" : "s");
+	ast_free(trunks);
+
+	return CLI_SUCCESS;
+}
+
+static struct ast_cli_entry cli_spit[] = {
+	AST_CLI_DEFINE(handle_cli_spit_show_bursts, "Show ANI prefixes with the highest call rate"),
+	AST_CLI_DEFINE(handle_cli_spit_show_perf, "Show the cycles spent in each stage of SPIT"),
+	AST_CLI_DEFINE(handle_cli_spit_show_pipeline, "Show the hit rate and cost of the SPIT detection stages"),
+	AST_CLI_DEFINE(handle_cli_spit_show_analytics, "Show the counters of the SPIT analytics log"),
+	AST_CLI_DEFINE(handle_cli_spit_show_tuning, "Show the trunks SPIT tuned from feedback"),
+};
+
 static int unload_module(void)
 {
-	return ast_unregister_application(app);
+	int res;
+
+	ast_cli_unregister_multiple(cli_spit, ARRAY_LEN(cli_spit));
+	res = ast_custom_function_unregister(&spit_features_function);
+	res |= ast_custom_function_unregister(&spit_feedback_function);
+	res |= ast_unregister_application(app);
+	spit_analytics_shutdown();
+
+	return res;
 }
 
 /*!
@@ -545,6 +1540,19 @@ static int load_module(void)
 		return AST_MODULE_LOAD_DECLINE;
 	}
 
+	if (ast_custom_function_register(&spit_features_function)) {
+		ast_unregister_application(app);
+		return AST_MODULE_LOAD_DECLINE;
+	}
+
+	if (ast_custom_function_register(&spit_feedback_function)) {
+		ast_custom_function_unregister(&spit_features_function);
+		ast_unregister_application(app);
+		return AST_MODULE_LOAD_DECLINE;
+	}
+
+	ast_cli_register_multiple(cli_spit, ARRAY_LEN(cli_spit));
+
 	return AST_MODULE_LOAD_SUCCESS;
 }
 
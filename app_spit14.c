@@ -30,11 +30,23 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 277182 $")
 #include "asterisk/module.h"
 #include "asterisk/lock.h"
 #include "asterisk/options.h"
+#include "asterisk/manager.h"
 #include "asterisk/channel.h"
 #include "asterisk/dsp.h"
 #include "asterisk/pbx.h"
 #include "asterisk/config.h"
 #include "asterisk/app.h"
+#include "asterisk/audiohook.h"
+#include "asterisk/file.h"
+#include "asterisk/sched.h"
+#include "asterisk/cli.h"
+#include "asterisk/utils.h"
+
+#include "spit_engine.h"
+#include "spit_call.h"
+#include "spit_analytics.h"
+#include "spit_remote.h"
+#include "spit_tuning.h"
 
 
 static char *app = "SPIT";
@@ -42,7 +54,7 @@ static char *synopsis = "Attempts to detect automated dialers";
 static char *descrip =
 "  SPIT([initialSilence][|greeting][|afterGreetingSilence][|totalAnalysisTime]\n"
 "      [|minimumWordLength][|betweenWordsSilence][|maximumNumberOfWords]\n"
-"      [|silenceThreshold])\n"
+"      [|silenceThreshold][|maximumWordLength][|options])\n"
 "  This application attempts to detect automated dialers at the beginning\n"
 "  of inbound calls.  Simply call this application after the call\n"
 "  has been answered. To prevent silence, playtones(ring), wait a second\n"
@@ -63,124 +75,354 @@ static char *descrip =
 "- 'maximumNumberOfWords'is the maximum number of words in the greeting. \n"
 "   If exceeded then MACHINE.\n"
 "- 'silenceThreshold' is the silence threshold.\n"
+"- 'maximumWordLength' is the maximum duration of a word. If exceeded then MACHINE.\n"
+"- 'options':\n"
+"    e - Early media. Start on the progress media of an unanswered channel and\n"
+"        carry the analysis across the answer. Ringback is skipped and only\n"
+"        MACHINE is given before answer.\n"
+"    b(prompt) - Barge-in. Play prompt while the analysis runs. Its echo is not\n"
+"        counted as caller speech, a caller that talks over it and then goes\n"
+"        quiet for barge_in_silence ms is HUMAN. The prompt stops at the verdict.\n"
+"    g([timeout]) - Greeting end. After a MACHINE verdict on a greeting (MAXWORDS,\n"
+"        LONGGREETING, MAXWORDLENGTH, SYNTHETIC or BURST) keep listening until\n"
+"        a beep or greeting_end_silence ms of silence ends the greeting, for at\n"
+"        most timeout ms (greeting_end_timeout by default).\n"
+"    r - Resume. Go on with the analysis an earlier SPIT() left on the channel,\n"
+"        the resumed run has totalAnalysisTime of its own from where it resumes.\n"
+"        A verdict other than TIMEOUT or EARLYTIMEOUT is set again without\n"
+"        listening.\n"
 "This application sets the following channel variable upon completion:\n"
 "    SPITSTATUS - This is the status of the answering machine detection.\n"
 "                Possible values are:\n"
 "                MACHINE | HUMAN | NOTSURE | HANGUP\n"
 "    SPITCAUSE - Indicates the cause that led to the conclusion.\n"
 "               Possible values are:\n"
-"               TOOLONG-<%d total_time>\n"
+"               TIMEOUT-<%d total_time>\n"
 "               INITIALSILENCE-<%d silenceDuration>-<%d initialSilence>\n"
-"               HUMAN-<%d silenceDuration>-<%d afterGreetingSilence>\n"
+"               SILENCEAFTERNOISE-<%d silenceDuration>-<%d afterGreetingSilence>\n"
+"               MAXWORDLENGTH-<%d consecutiveVoiceDuration>\n"
 "               MAXWORDS-<%d wordsCount>-<%d maximumNumberOfWords>\n"
 "               LONGGREETING-<%d voiceDuration>-<%d greeting>\n"
-"				DTMFFRAME-<%d f->subclass>\n";
+"               DTMF-<%d digit>\n"
+"               NOFRAMES-<%d total_time>\n"
+"               EARLYTIMEOUT-<%d early_time>\n"
+"               LOSS-<%d lost>-<%d gaps>\n"
+"               BURST-<%s prefix>-<%d calls>\n"
+"               BARGEIN-<%d ms into the prompt>-<%d silenceDuration>\n"
+"               SYNTHETIC-<%d modulation>-<%d pitch jitter>\n"
+"               REMOTE (spitd went away or did not answer in time)\n"
+"               When audio was lost on the way the cause ends with -LOSS-<%d lost>-<%d gaps>\n"
+"    SPITPHASE - EARLY | ANSWERED\n"
+"    SPITGREETINGEND - With g, ms of audio from the start of SPIT to the end of\n"
+"                the greeting, -1 when it was not heard.\n"
+"    SPITGREETINGENDCAUSE - With g, BEEP | SILENCE | TIMEOUT | HANGUP\n"
+"  The measurements of the analysis can be read with SPIT_FEATURES(field).\n"
+"  With progress_events = yes in spit.conf, SPITProgress manager events tell\n"
+"  how the analysis is going: Events (FIRSTWORD, WORD, SILENCE, PROVISIONAL,\n"
+"  VERDICT, GREETINGEND), Time, Words, VoiceDuration, SilenceDuration,\n"
+"  Provisional and Confidence, and Cause once there is a verdict.\n"
+"  With [remote] enabled in spit.conf answered calls without the b and r\n"
+"  options are analyzed by spitd, SPIT only passes the audio on.\n"
+"  With [tuning] enabled in spit.conf silenceThreshold, betweenWordsSilence\n"
+"  and totalAnalysisTime start from the values learned for the trunk of the\n"
+"  call, arguments still win. The trunk is SPITTRUNK when set, else the\n"
+"  channel name without its unique suffix. Tell SPIT what the call really\n"
+"  was with Set(SPIT_FEEDBACK()=HUMAN) or MACHINE.\n"
+"  Detection runs as a pipeline of stages set in [pipeline] of spit.conf:\n"
+"  burst, dtmf, energy, words and synthetic. The first stage to decide ends\n"
+"  it, optional stages can be left out or given a budget in cycles per\n"
+"  sample. 'spit show pipeline' shows the hit rate and cost of each stage.\n";
+
+enum spit_option_flags {
+	OPT_EARLY_MEDIA = (1 << 0),
+	OPT_BARGE_IN    = (1 << 1),
+	OPT_GREETING_END = (1 << 2),
+	OPT_RESUME      = (1 << 3),
+};
+
+enum spit_option_args {
+	OPT_ARG_BARGE_IN = 0,
+	OPT_ARG_GREETING_END,
+	/* note: this entry _MUST_ be the last one in the enum */
+	OPT_ARG_ARRAY_SIZE,
+};
 
-#define STATE_IN_WORD       1
-#define STATE_IN_SILENCE    2
+AST_APP_OPTIONS(spit_opts, {
+	AST_APP_OPTION('e', OPT_EARLY_MEDIA),
+	AST_APP_OPTION_ARG('b', OPT_BARGE_IN, OPT_ARG_BARGE_IN),
+	AST_APP_OPTION_ARG('g', OPT_GREETING_END, OPT_ARG_GREETING_END),
+	AST_APP_OPTION('r', OPT_RESUME),
+});
 
-/* Some default values for the algorithm parameters. These defaults will be overwritten from spit.conf */
-static int dfltInitialSilence       = 2500;
-static int dfltGreeting             = 1500;
-static int dfltAfterGreetingSilence = 800;
-static int dfltTotalAnalysisTime    = 5000;
-static int dfltMinimumWordLength    = 100;
-static int dfltBetweenWordsSilence  = 50;
-static int dfltMaximumNumberOfWords = 3;
-static int dfltSilenceThreshold     = 256;
+/* Default values for the algorithm parameters. These defaults will be overwritten from spit.conf */
+static struct spit_params dfltParams;
 
-/* Set to the lowest ms value provided in spit.conf or application parameters */
-static int dfltMaxWaitTimeForFrame  = 50;
+/* Tone zone used to spot ringback in early media */
+static char dfltProgressZone[16]    = "us";
 
-static void isAutomatedDialer(struct ast_channel *chan, void *data)
+static const struct {
+	const char *name;
+	size_t offset;
+} spit_feature_fields[] = {
+	{ "voiceduration",  offsetof(struct spit_features, voiceDuration) },
+	{ "words",          offsetof(struct spit_features, words) },
+	{ "shortwords",     offsetof(struct spit_features, shortWords) },
+	{ "longestword",    offsetof(struct spit_features, longestWord) },
+	{ "initialsilence", offsetof(struct spit_features, initialSilence) },
+	{ "longestsilence", offsetof(struct spit_features, longestSilence) },
+	{ "gaps",           offsetof(struct spit_features, gaps) },
+	{ "analysistime",   offsetof(struct spit_features, analysisTime) },
+	{ "earlytime",      offsetof(struct spit_features, earlyTime) },
+	{ "decisiontime",   offsetof(struct spit_features, decisionTime) },
+	{ "lost",           offsetof(struct spit_features, lost) },
+	{ "lossgaps",       offsetof(struct spit_features, lossGaps) },
+	{ "burstcalls",     offsetof(struct spit_features, burstCalls) },
+	{ "answered",       offsetof(struct spit_features, answered) },
+	{ "bargein",        offsetof(struct spit_features, bargeIn) },
+	{ "echo",           offsetof(struct spit_features, echoTime) },
+	{ "modulation",     offsetof(struct spit_features, modulation) },
+	{ "pitchjitter",    offsetof(struct spit_features, pitchJitter) },
+};
+
+static const struct ast_datastore_info spit_features_info = {
+	.type = "SPIT_FEATURES",
+	.destroy = free,
+};
+
+static int64_t spit_now(void)
 {
-	int res = 0;
-	struct ast_frame *f = NULL;
-	struct ast_dsp *silenceDetector = NULL;
-	int dspsilence = 0, readFormat, framelength = 0;
-	int inInitialSilence = 1;
-	int inGreeting = 0;
-	int voiceDuration = 0;
-	int silenceDuration = 0;
-	int iTotalTime = 0;
-	int iWordsCount = 0;
-	int currentState = STATE_IN_WORD;
-	int previousState = STATE_IN_SILENCE;
-	int consecutiveVoiceDuration = 0;
-	char spitCause[256] = "", spitStatus[256] = "";
-	char *parse = ast_strdupa(data);
+	struct timeval now = ast_tvnow();
 
-	/* Lets set the initial values of the variables that will control the algorithm.
-	   The initial values are the default ones. If they are passed as arguments
-	   when invoking the application, then the default values will be overwritten
-	   by the ones passed as parameters. */
-	int initialSilence       = dfltInitialSilence;
-	int greeting             = dfltGreeting;
-	int afterGreetingSilence = dfltAfterGreetingSilence;
-	int totalAnalysisTime    = dfltTotalAnalysisTime;
-	int minimumWordLength    = dfltMinimumWordLength;
-	int betweenWordsSilence  = dfltBetweenWordsSilence;
-	int maximumNumberOfWords = dfltMaximumNumberOfWords;
-	int silenceThreshold     = dfltSilenceThreshold;
-	int maxWaitTimeForFrame  = dfltMaxWaitTimeForFrame;
+	return (int64_t) now.tv_sec * 1000 + now.tv_usec / 1000;
+}
 
-	AST_DECLARE_APP_ARGS(args,
-			     AST_APP_ARG(argInitialSilence);
-			     AST_APP_ARG(argGreeting);
-			     AST_APP_ARG(argAfterGreetingSilence);
-			     AST_APP_ARG(argTotalAnalysisTime);
-			     AST_APP_ARG(argMinimumWordLength);
-			     AST_APP_ARG(argBetweenWordsSilence);
-			     AST_APP_ARG(argMaximumNumberOfWords);
-			     AST_APP_ARG(argSilenceThreshold);
-	);
+/* Engine messages go to the verbose log with the channel in front */
+static void spit_log(void *data, const char *fmt, ...)
+{
+	struct ast_channel *chan = data;
+	char buf[256];
+	va_list ap;
 
-	if (option_verbose > 2)
-		ast_verbose(VERBOSE_PREFIX_3 "SPIT: %s %s %s (Fmt: %d)\n", chan->name ,chan->cid.cid_ani, chan->cid.cid_rdnis, chan->readformat);
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
 
-	/* Lets parse the arguments. */
-	if (!ast_strlen_zero(parse)) {
-		/* Some arguments have been passed. Lets parse them and overwrite the defaults. */
-		AST_STANDARD_APP_ARGS(args, parse);
-		if (!ast_strlen_zero(args.argInitialSilence))
-			initialSilence = atoi(args.argInitialSilence);
-		if (!ast_strlen_zero(args.argGreeting))
-			greeting = atoi(args.argGreeting);
-		if (!ast_strlen_zero(args.argAfterGreetingSilence))
-			afterGreetingSilence = atoi(args.argAfterGreetingSilence);
-		if (!ast_strlen_zero(args.argTotalAnalysisTime))
-			totalAnalysisTime = atoi(args.argTotalAnalysisTime);
-		if (!ast_strlen_zero(args.argMinimumWordLength))
-			minimumWordLength = atoi(args.argMinimumWordLength);
-		if (!ast_strlen_zero(args.argBetweenWordsSilence))
-			betweenWordsSilence = atoi(args.argBetweenWordsSilence);
-		if (!ast_strlen_zero(args.argMaximumNumberOfWords))
-			maximumNumberOfWords = atoi(args.argMaximumNumberOfWords);
-		if (!ast_strlen_zero(args.argSilenceThreshold))
-			silenceThreshold = atoi(args.argSilenceThreshold);
-	} else if (option_debug)
-		ast_log(LOG_DEBUG, "SPIT using the default parameters.\n");
+	ast_verbose(VERBOSE_PREFIX_3 "SPIT: Channel [%s]. %s\n", chan->name, buf);
+}
 
-	/* Find lowest ms value, that will be max wait time for a frame */
-	if (maxWaitTimeForFrame > initialSilence)
-		maxWaitTimeForFrame = initialSilence;
-	if (maxWaitTimeForFrame > greeting)
-		maxWaitTimeForFrame = greeting;
-	if (maxWaitTimeForFrame > afterGreetingSilence)
-		maxWaitTimeForFrame = afterGreetingSilence;
-	if (maxWaitTimeForFrame > totalAnalysisTime)
-		maxWaitTimeForFrame = totalAnalysisTime;
-	if (maxWaitTimeForFrame > minimumWordLength)
-		maxWaitTimeForFrame = minimumWordLength;
-	if (maxWaitTimeForFrame > betweenWordsSilence)
-		maxWaitTimeForFrame = betweenWordsSilence;
-
-	/* Now we're ready to roll! */
-	if (option_verbose > 2)
-		ast_verbose(VERBOSE_PREFIX_3 "SPIT: initialSilence [%d] greeting [%d] afterGreetingSilence [%d] "
-		"totalAnalysisTime [%d] minimumWordLength [%d] betweenWordsSilence [%d] maximumNumberOfWords [%d] silenceThreshold [%d] \n",
-				initialSilence, greeting, afterGreetingSilence, totalAnalysisTime,
-				minimumWordLength, betweenWordsSilence, maximumNumberOfWords, silenceThreshold );
+/* The whole engine of the last analysis, so a later SPIT(...,r) can go on with it */
+static const struct ast_datastore_info spit_state_info = {
+	.type = "SPIT_STATE",
+	.destroy = free,
+};
+
+/* The verdict SPIT_FEEDBACK() reports on, gone once it has */
+static const struct ast_datastore_info spit_sample_info = {
+	.type = "SPIT_SAMPLE",
+	.destroy = free,
+};
+
+/* SPITTRUNK or the channel name up to the unique suffix the channel driver adds */
+static void spit_trunk_name(struct ast_channel *chan, char *trunk, size_t len)
+{
+	const char *name;
+	char *suffix;
+
+	ast_channel_lock(chan);
+	name = pbx_builtin_getvar_helper(chan, "SPITTRUNK");
+	ast_copy_string(trunk, !ast_strlen_zero(name) ? name : chan->name, len);
+	ast_channel_unlock(chan);
+
+	if (ast_strlen_zero(name) && (suffix = strrchr(trunk, '-')))
+		*suffix = '\0';
+}
+
+static void spit_store_sample(struct ast_channel *chan, const char *trunk, enum spit_status status, const char *cause)
+{
+	struct ast_datastore *datastore;
+	struct spit_tuning_sample *sample;
+
+	ast_channel_lock(chan);
+	if (!(datastore = ast_channel_datastore_find(chan, &spit_sample_info, NULL))) {
+		if (!(datastore = ast_channel_datastore_alloc(&spit_sample_info, NULL))) {
+			ast_channel_unlock(chan);
+			return;
+		}
+		if (!(datastore->data = ast_calloc(1, sizeof(*sample)))) {
+			ast_channel_datastore_free(datastore);
+			ast_channel_unlock(chan);
+			return;
+		}
+		ast_channel_datastore_add(chan, datastore);
+	}
+	sample = datastore->data;
+	ast_copy_string(sample->trunk, trunk, sizeof(sample->trunk));
+	sample->status = status;
+	ast_copy_string(sample->cause, cause, sizeof(sample->cause));
+	ast_channel_unlock(chan);
+}
+
+static void spit_save_state(struct ast_channel *chan, const struct spit_engine *engine)
+{
+	struct ast_datastore *datastore;
+	struct spit_engine *state;
+
+	ast_channel_lock(chan);
+	if (!(datastore = ast_channel_datastore_find(chan, &spit_state_info, NULL))) {
+		if (!(datastore = ast_channel_datastore_alloc(&spit_state_info, NULL))) {
+			ast_channel_unlock(chan);
+			return;
+		}
+		if (!(datastore->data = ast_calloc(1, sizeof(*engine)))) {
+			ast_channel_datastore_free(datastore);
+			ast_channel_unlock(chan);
+			return;
+		}
+		ast_channel_datastore_add(chan, datastore);
+	}
+	state = datastore->data;
+	memcpy(state, engine, sizeof(*engine));
+	/* The log goes to the channel of the run that uses the state */
+	state->log = NULL;
+	state->logData = NULL;
+	ast_channel_unlock(chan);
+}
+
+/* A run on spitd leaves no engine here, a later SPIT(...,r) must not go on with the one of a run before it */
+static void spit_clear_state(struct ast_channel *chan)
+{
+	struct ast_datastore *datastore;
+
+	ast_channel_lock(chan);
+	if ((datastore = ast_channel_datastore_find(chan, &spit_state_info, NULL))) {
+		ast_channel_datastore_remove(chan, datastore);
+		ast_channel_datastore_free(datastore);
+	}
+	ast_channel_unlock(chan);
+}
+
+static int spit_load_state(struct ast_channel *chan, struct spit_engine *engine)
+{
+	struct ast_datastore *datastore;
+
+	ast_channel_lock(chan);
+	if (!(datastore = ast_channel_datastore_find(chan, &spit_state_info, NULL))) {
+		ast_channel_unlock(chan);
+		return -1;
+	}
+	memcpy(engine, datastore->data, sizeof(*engine));
+	ast_channel_unlock(chan);
+
+	return 0;
+}
+
+static void spit_store_features(struct ast_channel *chan, const struct spit_features *features)
+{
+	struct ast_datastore *datastore;
+
+	ast_channel_lock(chan);
+	if (!(datastore = ast_channel_datastore_find(chan, &spit_features_info, NULL))) {
+		if (!(datastore = ast_channel_datastore_alloc(&spit_features_info, NULL))) {
+			ast_channel_unlock(chan);
+			return;
+		}
+		if (!(datastore->data = ast_calloc(1, sizeof(*features)))) {
+			ast_channel_datastore_free(datastore);
+			ast_channel_unlock(chan);
+			return;
+		}
+		ast_channel_datastore_add(chan, datastore);
+	}
+	memcpy(datastore->data, features, sizeof(*features));
+	ast_channel_unlock(chan);
+}
+
+/* Start the barge-in prompt with a spy on what we write, so the engine hears it too */
+static int spit_start_prompt(struct ast_channel *chan, struct spit_engine *engine, struct ast_audiohook *spy, const char *prompt)
+{
+	ast_audiohook_init(spy, AST_AUDIOHOOK_TYPE_SPY, "SPIT");
+	if (ast_audiohook_attach(chan, spy)) {
+		ast_log(LOG_WARNING, "SPIT: Channel [%s]. Unable to listen to the prompt, analyzing without barge-in\n", chan->name);
+		ast_audiohook_destroy(spy);
+		return -1;
+	}
+	if (ast_streamfile(chan, prompt, chan->language)) {
+		ast_log(LOG_WARNING, "SPIT: Channel [%s]. Unable to play %s, analyzing without barge-in\n", chan->name, prompt);
+		ast_audiohook_lock(spy);
+		ast_audiohook_detach(spy);
+		ast_audiohook_unlock(spy);
+		ast_audiohook_destroy(spy);
+		return -1;
+	}
+	spit_engine_prompt_start(engine);
+
+	return 0;
+}
+
+/* Hand the engine what we wrote to the caller while their last frame came in */
+static void spit_read_prompt(struct ast_audiohook *spy, struct spit_engine *engine, int samples)
+{
+	struct ast_frame *pf;
+
+	ast_audiohook_lock(spy);
+	pf = ast_audiohook_read_frame(spy, samples, AST_AUDIOHOOK_DIRECTION_WRITE, AST_FORMAT_SLINEAR);
+	ast_audiohook_unlock(spy);
+
+	if (pf) {
+		spit_engine_prompt(engine, pf->data, pf->samples);
+		ast_frfree(pf);
+	}
+}
+
+/* Tell AMI how the analysis is going. manager_event() does not format anything
+   unless a manager session is listening. */
+static void spit_progress_event(struct ast_channel *chan, const struct spit_progress *progress, const char *cause,
+	int greetingEndTime, enum spit_greeting_end greetingEndCause)
+{
+	char events[96], verdict[300] = "", greetingEnd[64] = "";
+
+	spit_event_names(progress->events, events, sizeof(events));
+	if (progress->events & SPIT_EVENT_VERDICT)
+		snprintf(verdict, sizeof(verdict), "Cause: %s\r\n", cause);
+	if (progress->events & SPIT_EVENT_GREETINGEND) {
+		snprintf(greetingEnd, sizeof(greetingEnd), "GreetingEnd: %d\r\nGreetingEndCause: %s\r\n",
+			greetingEndTime, spit_greeting_end_name(greetingEndCause));
+	}
+
+	manager_event(EVENT_FLAG_CALL, "SPITProgress",
+		"Channel: %s\r\n"
+		"Uniqueid: %s\r\n"
+		"Events: %s\r\n"
+		"Time: %d\r\n"
+		"Words: %d\r\n"
+		"VoiceDuration: %d\r\n"
+		"SilenceDuration: %d\r\n"
+		"Provisional: %s\r\n"
+		"Confidence: %d\r\n"
+		"%s%s",
+		chan->name, chan->uniqueid, events, progress->time, progress->words,
+		progress->voiceDuration, progress->silenceDuration,
+		progress->provisional ? spit_status_name(progress->provisional) : "UNDECIDED", progress->confidence, verdict, greetingEnd);
+}
+
+static void spit_publish_progress(struct spit_call *call, const struct spit_progress *progress)
+{
+	char status[32], cause[256] = "";
+
+	if (progress->events & SPIT_EVENT_VERDICT)
+		spit_engine_format(&call->engine, status, sizeof(status), cause, sizeof(cause));
+	spit_progress_event(call->chan, progress, cause, call->engine.greetingEnd, call->engine.greetingEndCause);
+}
+
+/* Read frames from the channel and feed them to the engine until it has a verdict */
+static int spit_analyze(struct ast_channel *chan, struct spit_call *call, const char *prompt)
+{
+	int res = 0, readFormat, waitMs, schedMs, spying = 0, done;
+	struct spit_engine *engine = &call->engine;
+	struct ast_frame *f = NULL;
+	struct ast_dsp *progressDetector = NULL;
+	struct ast_audiohook spy;
+	struct spit_read frame;
 
 	/* Set read format to signed linear so we get signed linear frames in */
 	readFormat = chan->readformat;
@@ -188,177 +430,416 @@ static void isAutomatedDialer(struct ast_channel *chan, void *data)
 		ast_log(LOG_WARNING, "SPIT: Channel [%s]. Unable to set to linear mode, giving up\n", chan->name );
 		pbx_builtin_setvar_helper(chan , "SPITSTATUS", "NOTSLIN");
 		pbx_builtin_setvar_helper(chan , "SPITCAUSE", "INVALIDFORMAT");
-		return;
+		return -1;
 	}
 
-	/* Create a new DSP that will detect the silence */
-	if (!(silenceDetector = ast_dsp_new())) {
-		ast_log(LOG_WARNING, "SPIT: Channel [%s]. Unable to create silence detector :(\n", chan->name );
-		pbx_builtin_setvar_helper(chan , "SPITSTATUS", "NODETECTOR");
-		pbx_builtin_setvar_helper(chan , "SPITCAUSE", "CANNOT_CREATE");
-		return;
+	/* In early media mode we start on the progress media and need to tell ringback from a greeting */
+	if (!engine->answered) {
+		if ((progressDetector = ast_dsp_new())) {
+			ast_dsp_set_features(progressDetector, DSP_FEATURE_CALL_PROGRESS);
+			ast_dsp_set_call_progress_zone(progressDetector, dfltProgressZone);
+		} else {
+			ast_log(LOG_WARNING, "SPIT: Channel [%s]. Unable to create progress detector, ringback will be analyzed\n", chan->name);
+		}
+		if (option_verbose > 2)
+			ast_verbose(VERBOSE_PREFIX_3 "SPIT: Channel [%s]. Analyzing early media\n", chan->name);
 	}
 
-	/* Set silence threshold to specified value */
-	ast_dsp_set_threshold(silenceDetector, silenceThreshold);
+	if (!ast_strlen_zero(prompt) && engine->answered)
+		spying = !spit_start_prompt(chan, engine, &spy, prompt);
 
 	/* Now we go into a loop waiting for frames from the channel */
-	while ((res = ast_waitfor(chan, 2 * maxWaitTimeForFrame)) > -1) {
+	for (;;) {
+		/* Without a timer on the channel the prompt is played from the scheduler */
+		waitMs = 2 * engine->maxWaitTimeForFrame;
+		if (engine->promptPlaying && (schedMs = ast_sched_wait(chan->sched)) >= 0 && schedMs < waitMs)
+			waitMs = schedMs;
+		if ((res = ast_waitfor(chan, waitMs)) < 0)
+			break;
+
+		memset(&frame, 0, sizeof(frame));
+		if (engine->params.perfCounters)
+			frame.ingest = spit_cycles();
 
 		/* If we fail to read in a frame, that means they hung up */
 		if (!(f = ast_read(chan))) {
-			if (option_verbose > 2)
-				ast_verbose(VERBOSE_PREFIX_3 "SPIT: HANGUP\n");
 			if (option_debug)
 				ast_log(LOG_DEBUG, "Got hangup\n");
-			strcpy(spitStatus, "HANGUP");
-			res = 1;
+			frame.kind = SPIT_READ_HANGUP;
+			spit_call_frame(call, &frame);
 			break;
 		}
 
-		if (f->frametype == AST_FRAME_DTMF_BEGIN || f->frametype == AST_FRAME_DTMF_END){
-			ast_verbose(VERBOSE_PREFIX_3 "CPA: Channel [%s] has incoming DTMF, Digit received: [%d]\n", chan->name, f->subclass);
-			strcpy(spitStatus , "MACHINE");
-			sprintf(spitCause , "DTMF-%d", f->subclass);
-			res = 1;	
+		if (!engine->answered && chan->_state == AST_STATE_UP) {
+			spit_engine_answer(engine);
+			if (!ast_strlen_zero(prompt))
+				spying = !spit_start_prompt(chan, engine, &spy, prompt);
+		}
+
+		switch (f->frametype) {
+		case AST_FRAME_CONTROL:
+			if (f->subclass == AST_CONTROL_RINGING)
+				frame.kind = SPIT_READ_RINGING;
+			break;
+		case AST_FRAME_DTMF_BEGIN:
+		case AST_FRAME_DTMF_END:
+			frame.kind = SPIT_READ_DTMF;
+			frame.digit = f->subclass;
+			break;
+		case AST_FRAME_VOICE:
+			if (progressDetector && !engine->answered)
+				f = ast_dsp_process(chan, progressDetector, f);
+			if (spying)
+				spit_read_prompt(&spy, engine, f->samples);
+			frame.kind = SPIT_READ_VOICE;
+			frame.samples = f->data;
+			frame.nsamples = f->samples;
+			/* 1.4 has no separate flag for the sequence number, it comes with the timing info */
+			frame.flags = ast_test_flag(f, AST_FRFLAG_HAS_TIMING_INFO) ? SPIT_READ_SEQNO | SPIT_READ_TIMING : 0;
+			frame.seqno = f->seqno;
+			frame.ts = f->ts;
+			break;
+		case AST_FRAME_CNG:
+			frame.kind = SPIT_READ_CNG;
+			break;
+		case AST_FRAME_NULL:
+			frame.kind = SPIT_READ_NULL;
+			frame.waited = !res && waitMs == 2 * engine->maxWaitTimeForFrame;
+			break;
+		default:
 			break;
 		}
+		done = spit_call_frame(call, &frame);
+		ast_frfree(f);
 
-		if (f->frametype == AST_FRAME_VOICE || f->frametype == AST_FRAME_NULL || f->frametype == AST_FRAME_CNG) {
-			/* If the total time exceeds the analysis time then give up as we are not too sure */
-			if (f->frametype == AST_FRAME_VOICE) {
-				framelength = (ast_codec_get_samples(f) / DEFAULT_SAMPLES_PER_MS);
-			} else {
-				framelength = 2 * maxWaitTimeForFrame;
-			}
+		if (done)
+			break;
+
+		/* A machine gets no more of the prompt while we wait for its greeting to end */
+		if (engine->status && engine->promptPlaying) {
+			ast_stopstream(chan);
+			spit_engine_prompt_stop(engine);
+		}
 
-			iTotalTime += framelength;
-			if (iTotalTime >= totalAnalysisTime) {
-				if (option_verbose > 2)	
-					ast_verbose(VERBOSE_PREFIX_3 "SPIT: Channel [%s]. Too long...\n", chan->name );
-				ast_frfree(f);
-				strcpy(spitStatus , "MACHINE");
-				sprintf(spitCause , "TOOLONG-%d", iTotalTime);
+		if (engine->promptPlaying) {
+			ast_sched_runq(chan->sched);
+			if (!chan->stream)
+				spit_engine_prompt_stop(engine);
+		}
+	}
+
+	if (spying) {
+		ast_stopstream(chan);
+		ast_audiohook_lock(&spy);
+		ast_audiohook_detach(&spy);
+		ast_audiohook_unlock(&spy);
+		ast_audiohook_destroy(&spy);
+	}
+
+	/* Restore channel read format */
+	if (readFormat && ast_set_read_format(chan, readFormat))
+		ast_log(LOG_WARNING, "SPIT: Unable to restore read format on '%s'\n", chan->name);
+
+	if (progressDetector)
+		ast_dsp_free(progressDetector);
+
+	return 0;
+}
+
+/* Set what spitd decided on the channel, the way isAutomatedDialer() does for a local analysis */
+static void spit_set_remote_verdict(struct ast_channel *chan, struct spit_remote_verdict *verdict, struct timeval start,
+	const char *trunk)
+{
+	enum spit_status status;
+
+	pbx_builtin_setvar_helper(chan, "SPITSTATUS", verdict->status);
+	pbx_builtin_setvar_helper(chan, "SPITCAUSE", verdict->cause);
+	pbx_builtin_setvar_helper(chan, "SPITPHASE", verdict->answered ? "ANSWERED" : "EARLY");
+	if (verdict->greetingEndCause) {
+		char greetingEnd[16];
+
+		snprintf(greetingEnd, sizeof(greetingEnd), "%d", verdict->greetingEnd);
+		pbx_builtin_setvar_helper(chan, "SPITGREETINGEND", greetingEnd);
+		pbx_builtin_setvar_helper(chan, "SPITGREETINGENDCAUSE", spit_greeting_end_name(verdict->greetingEndCause));
+	}
+
+	verdict->features.decisionTime = ast_tvdiff_ms(ast_tvnow(), start);
+	spit_store_features(chan, &verdict->features);
+
+	if (spit_tuning_enabled()) {
+		for (status = SPIT_HUMAN; status <= SPIT_HANGUP; status++) {
+			if (!strcmp(spit_status_name(status), verdict->status)) {
+				spit_store_sample(chan, trunk, status, verdict->cause);
 				break;
 			}
+		}
+	}
+}
 
-			/* Feed the frame of audio into the silence detector and see if we get a result */
-			if (f->frametype != AST_FRAME_VOICE)
-				dspsilence += 2 * maxWaitTimeForFrame;
-			else {
-				dspsilence = 0;
-				ast_dsp_silence(silenceDetector, f, &dspsilence);
-			}
+/* Read what spitd sent, its progress reports go out as SPITProgress events */
+static int spit_remote_poll(struct ast_channel *chan, struct spit_remote *remote, struct spit_remote_verdict *verdict)
+{
+	struct spit_remote_progress progress;
+	int res;
 
-			if (dspsilence > 0) {
-				silenceDuration = dspsilence;
-				
-				if (silenceDuration >= betweenWordsSilence) {
-					if (currentState != STATE_IN_SILENCE ) {
-						previousState = currentState;
-						if (option_verbose > 2)
-							ast_verbose(VERBOSE_PREFIX_3 "SPIT: Changed state to STATE_IN_SILENCE\n");
-					}
-					currentState  = STATE_IN_SILENCE;
-					consecutiveVoiceDuration = 0;
-				}
-				
-				if (inInitialSilence == 1  && silenceDuration >= initialSilence) {
-					if (option_verbose > 2)
-						ast_verbose(VERBOSE_PREFIX_3 "SPIT: ANSWERING MACHINE: silenceDuration:%d initialSilence:%d\n",
-							    silenceDuration, initialSilence);
-					ast_frfree(f);
-					strcpy(spitStatus , "HUMAN");
-					sprintf(spitCause , "INITIALSILENCE-%d-%d", silenceDuration, initialSilence);
-					res = 1;
-					break;
-				}
-				
-				if (silenceDuration >= afterGreetingSilence  &&  inGreeting == 1) {
-					if (option_verbose > 2)
-						ast_verbose(VERBOSE_PREFIX_3 "SPIT: HUMAN: silenceDuration:%d afterGreetingSilence:%d\n",
-							    silenceDuration, afterGreetingSilence);
-					ast_frfree(f);
-					strcpy(spitStatus , "HUMAN");
-					sprintf(spitCause , "AFTERGREET-%d-%d", silenceDuration, afterGreetingSilence);
-					res = 1;
-					break;
-				}
-				
-			} else {
-				consecutiveVoiceDuration += framelength;
-				voiceDuration += framelength;
-				
-				/* If I have enough consecutive voice to say that I am in a Word, I can only increment the
-				   number of words if my previous state was Silence, which means that I moved into a word. */
-				if (consecutiveVoiceDuration >= minimumWordLength && currentState == STATE_IN_SILENCE) {
-					iWordsCount++;
-					if (option_verbose > 2)
-						ast_verbose(VERBOSE_PREFIX_3 "SPIT: Word detected. iWordsCount:%d\n", iWordsCount);
-					previousState = currentState;
-					currentState = STATE_IN_WORD;
-				}
-				
-				if (iWordsCount >= maximumNumberOfWords) {
-					if (option_verbose > 2)
-						ast_verbose(VERBOSE_PREFIX_3 "SPIT: ANSWERING MACHINE: iWordsCount:%d\n", iWordsCount);
-					ast_frfree(f);
-					strcpy(spitStatus , "MACHINE");
-					sprintf(spitCause , "MAXWORDS-%d-%d", iWordsCount, maximumNumberOfWords);
-					res = 1;
-					break;
-				}
-				
-				if (inGreeting == 1 && voiceDuration >= greeting) {
-					if (option_verbose > 2)
-						ast_verbose(VERBOSE_PREFIX_3 "SPIT: ANSWERING MACHINE: voiceDuration:%d greeting:%d\n", voiceDuration, greeting);
-					ast_frfree(f);
-					strcpy(spitStatus , "MACHINE");
-					sprintf(spitCause , "LONGGREETING-%d-%d", voiceDuration, greeting);
-					res = 1;
-					break;
-				}
-				
-				if (voiceDuration >= minimumWordLength ) {
-					silenceDuration = 0;
-					inInitialSilence = 0;
-					inGreeting = 1;
-				}
-				
-			}
+	while ((res = spit_remote_read(remote, verdict, &progress)) == 2) {
+		spit_progress_event(chan, &progress.progress, progress.cause, progress.greetingEnd,
+			progress.greetingEndCause);
+	}
+
+	return res;
+}
+
+/*
+ * Have spitd analyze the call, we only pass the audio on.
+ * Returns 0 when done and the channel variables are set, -1 when spitd
+ * did not take the call and it is to be analyzed here.
+ */
+static int spit_analyze_remote(struct ast_channel *chan, const struct spit_engine *engine, struct timeval start,
+	const char *trunk)
+{
+	struct spit_remote_config config;
+	struct spit_remote remote;
+	struct spit_remote_verdict verdict;
+	struct spit_frame_info info;
+	struct ast_frame *f;
+	struct ast_channel *ready;
+	int res = 0, ms, outfd, readFormat;
+	int64_t deadline;
+
+	spit_remote_get_config(&config);
+	if (spit_remote_start(&remote, chan->uniqueid, &engine->params, engine->answered, chan->cid.cid_ani)) {
+		if (config.fallback) {
+			ast_log(LOG_WARNING, "SPIT: Channel [%s]. spitd at %s:%d did not take the call, analyzing here\n",
+				chan->name, config.host, config.port);
+			return -1;
 		}
-		ast_frfree(f);
+		ast_log(LOG_WARNING, "SPIT: Channel [%s]. spitd at %s:%d did not take the call\n",
+			chan->name, config.host, config.port);
+		pbx_builtin_setvar_helper(chan, "SPITSTATUS", "NOTSURE");
+		pbx_builtin_setvar_helper(chan, "SPITCAUSE", "REMOTE");
+		return 0;
 	}
-	
-	if (!res) {
-		/* It took too long to get a frame back. Giving up. */
-		if (option_verbose > 2)
-			ast_verbose(VERBOSE_PREFIX_3 "SPIT: Channel [%s]. Too long...\n", chan->name);
-		strcpy(spitStatus , "MACHINE");
-		sprintf(spitCause , "NOFRAMES-%d", iTotalTime);
+	spit_clear_state(chan);
+
+	readFormat = chan->readformat;
+	if (ast_set_read_format(chan, AST_FORMAT_SLINEAR) < 0 ) {
+		ast_log(LOG_WARNING, "SPIT: Channel [%s]. Unable to set to linear mode, giving up\n", chan->name );
+		spit_remote_stop(&remote);
+		pbx_builtin_setvar_helper(chan , "SPITSTATUS", "NOTSLIN");
+		pbx_builtin_setvar_helper(chan , "SPITCAUSE", "INVALIDFORMAT");
+		return 0;
 	}
 
-	/* Set the status and cause on the channel */
-	pbx_builtin_setvar_helper(chan , "SPITSTATUS" , spitStatus);
-	pbx_builtin_setvar_helper(chan , "SPITCAUSE" , spitCause);
+	if (option_verbose > 2)
+		ast_verbose(VERBOSE_PREFIX_3 "SPIT: Channel [%s]. Analyzing on spitd at %s:%d\n", chan->name, config.host, config.port);
+
+	/* spitd keeps time by the audio, we only make sure a verdict that never comes does not hold the call */
+	deadline = spit_now() + engine->params.totalAnalysisTime + config.timeout
+		+ (engine->params.trackGreetingEnd ? engine->params.greetingEndTimeout : 0);
+
+	while ((ms = deadline - spit_now()) > 0) {
+		outfd = -1;
+		ready = ast_waitfor_nandfds(&chan, 1, &remote.control, 1, NULL, &outfd, &ms);
+		if (!ready) {
+			if ((res = spit_remote_poll(chan, &remote, &verdict)))
+				break;
+			continue;
+		}
+
+		if (!(f = ast_read(chan))) {
+			/* spitd settles on HANGUP, or on greeting end HANGUP after a verdict */
+			if (option_debug)
+				ast_log(LOG_DEBUG, "Got hangup\n");
+			spit_remote_hangup(&remote);
+			for (ms = config.timeout; !res && ast_wait_for_input(remote.control, ms) > 0; )
+				res = spit_remote_poll(chan, &remote, &verdict);
+			break;
+		}
+
+		switch (f->frametype) {
+		case AST_FRAME_DTMF_END:
+			/* spitd takes every DTMF as a digit, the begin would send it twice */
+			spit_remote_dtmf(&remote, f->subclass);
+			break;
+		case AST_FRAME_VOICE:
+			/* 1.4 has no separate flag for the sequence number, it comes with the timing info */
+			info.hasTimestamp = info.hasSeqno = ast_test_flag(f, AST_FRFLAG_HAS_TIMING_INFO) ? 1 : 0;
+			info.seqno = f->seqno;
+			info.ts = f->ts;
+			spit_remote_audio(&remote, f->data, f->samples, &info);
+			break;
+		default:
+			break;
+		}
+		ast_frfree(f);
+	}
+
+	spit_remote_stop(&remote);
 
-	/* Restore channel read format */
 	if (readFormat && ast_set_read_format(chan, readFormat))
 		ast_log(LOG_WARNING, "SPIT: Unable to restore read format on '%s'\n", chan->name);
 
-	/* Free the DSP used to detect silence */
-	ast_dsp_free(silenceDetector);
+	if (res != 1) {
+		ast_log(LOG_WARNING, "SPIT: Channel [%s]. %s\n", chan->name,
+			res < 0 ? "Lost spitd before the verdict" : "No verdict from spitd in time");
+		pbx_builtin_setvar_helper(chan, "SPITSTATUS", "NOTSURE");
+		pbx_builtin_setvar_helper(chan, "SPITCAUSE", "REMOTE");
+		return 0;
+	}
 
-	return;
+	spit_set_remote_verdict(chan, &verdict, start, trunk);
+
+	return 0;
+}
+
+/* Set the status and cause on the channel */
+static void spit_set_verdict(struct spit_call *call)
+{
+	struct ast_channel *chan = call->chan;
+	const struct spit_engine *engine = &call->engine;
+
+	pbx_builtin_setvar_helper(chan , "SPITSTATUS" , call->status);
+	pbx_builtin_setvar_helper(chan , "SPITCAUSE" , call->cause);
+	pbx_builtin_setvar_helper(chan , "SPITPHASE" , engine->answered ? "ANSWERED" : "EARLY");
+	if (engine->greetingEndCause) {
+		char greetingEnd[16];
+
+		snprintf(greetingEnd, sizeof(greetingEnd), "%d", engine->greetingEnd);
+		pbx_builtin_setvar_helper(chan, "SPITGREETINGEND", greetingEnd);
+		pbx_builtin_setvar_helper(chan, "SPITGREETINGENDCAUSE", spit_greeting_end_name(engine->greetingEndCause));
+	}
+}
+
+/* What the analysis found stays on the channel for SPIT_FEATURES(), SPIT(...,r) and SPIT_FEEDBACK() */
+static void spit_store(struct spit_call *call)
+{
+	spit_store_features(call->chan, &call->features);
+	spit_save_state(call->chan, &call->engine);
+	if (spit_tuning_enabled())
+		spit_store_sample(call->chan, call->trunk, call->engine.status, call->cause);
+}
+
+static const struct spit_call_ops spit_call_ops = {
+	.set_verdict = spit_set_verdict,
+	.progress = spit_publish_progress,
+	.store = spit_store,
+};
+
+static void isAutomatedDialer(struct ast_channel *chan, void *data, const struct spit_burst_hit *burst)
+{
+	struct ast_flags options = { 0 };
+	char *opts[OPT_ARG_ARRAY_SIZE] = { NULL, };
+	struct spit_call call = { .ops = &spit_call_ops, .chan = chan, .log = spit_log };
+	struct spit_engine state;
+	struct timeval start = ast_tvnow();
+	int answered, resumed;
+	char *parse = ast_strdupa(data);
+
+	/* Lets set the initial values of the variables that will control the algorithm.
+	   The initial values are the default ones. If they are passed as arguments
+	   when invoking the application, then the default values will be overwritten
+	   by the ones passed as parameters. */
+	struct spit_params params = dfltParams;
+
+	AST_DECLARE_APP_ARGS(args,
+			     AST_APP_ARG(argInitialSilence);
+			     AST_APP_ARG(argGreeting);
+			     AST_APP_ARG(argAfterGreetingSilence);
+			     AST_APP_ARG(argTotalAnalysisTime);
+			     AST_APP_ARG(argMinimumWordLength);
+			     AST_APP_ARG(argBetweenWordsSilence);
+			     AST_APP_ARG(argMaximumNumberOfWords);
+			     AST_APP_ARG(argSilenceThreshold);
+			     AST_APP_ARG(argMaximumWordLength);
+			     AST_APP_ARG(argOptions);
+	);
+
+	if (option_verbose > 2)
+		ast_verbose(VERBOSE_PREFIX_3 "SPIT: %s %s %s (Fmt: %d)\n", chan->name ,chan->cid.cid_ani, chan->cid.cid_rdnis, chan->readformat);
+
+	/* What the trunk learned from feedback goes under the arguments */
+	if (spit_tuning_enabled()) {
+		spit_trunk_name(chan, call.trunk, sizeof(call.trunk));
+		if (!spit_tuning_apply(call.trunk, &params) && option_verbose > 2)
+			ast_verbose(VERBOSE_PREFIX_3 "SPIT: Channel [%s]. Tuned for trunk [%s]\n", chan->name, call.trunk);
+	}
+
+	/* Lets parse the arguments. */
+	if (!ast_strlen_zero(parse)) {
+		/* Some arguments have been passed. Lets parse them and overwrite the defaults. */
+		AST_STANDARD_APP_ARGS(args, parse);
+		if (!ast_strlen_zero(args.argInitialSilence))
+			params.initialSilence = atoi(args.argInitialSilence);
+		if (!ast_strlen_zero(args.argGreeting))
+			params.greeting = atoi(args.argGreeting);
+		if (!ast_strlen_zero(args.argAfterGreetingSilence))
+			params.afterGreetingSilence = atoi(args.argAfterGreetingSilence);
+		if (!ast_strlen_zero(args.argTotalAnalysisTime))
+			params.totalAnalysisTime = atoi(args.argTotalAnalysisTime);
+		if (!ast_strlen_zero(args.argMinimumWordLength))
+			params.minimumWordLength = atoi(args.argMinimumWordLength);
+		if (!ast_strlen_zero(args.argBetweenWordsSilence))
+			params.betweenWordsSilence = atoi(args.argBetweenWordsSilence);
+		if (!ast_strlen_zero(args.argMaximumNumberOfWords))
+			params.maximumNumberOfWords = atoi(args.argMaximumNumberOfWords);
+		if (!ast_strlen_zero(args.argSilenceThreshold))
+			params.silenceThreshold = atoi(args.argSilenceThreshold);
+		if (!ast_strlen_zero(args.argMaximumWordLength))
+			params.maximumWordLength = atoi(args.argMaximumWordLength);
+		if (!ast_strlen_zero(args.argOptions))
+			ast_app_parse_options(spit_opts, &options, opts, args.argOptions);
+		if (ast_test_flag(&options, OPT_GREETING_END)) {
+			params.trackGreetingEnd = 1;
+			if (!ast_strlen_zero(opts[OPT_ARG_GREETING_END]))
+				params.greetingEndTimeout = atoi(opts[OPT_ARG_GREETING_END]);
+		}
+	} else if (option_debug)
+		ast_log(LOG_DEBUG, "SPIT using the default parameters.\n");
+
+	answered = !ast_test_flag(&options, OPT_EARLY_MEDIA) || chan->_state == AST_STATE_UP;
+	resumed = ast_test_flag(&options, OPT_RESUME) && !spit_load_state(chan, &state);
+	call.ani = chan->cid.cid_ani;
+	call.start = (int64_t) start.tv_sec * 1000 + start.tv_usec / 1000;
+	call.logLevel = option_debug ? SPIT_LOG_DEBUG : option_verbose > 2 ? SPIT_LOG_VERBOSE : SPIT_LOG_NONE;
+
+	switch (spit_call_start(&call, &params, answered, resumed ? &state : NULL, burst)) {
+	case SPIT_CALL_DONE:
+		return;
+	case SPIT_CALL_ANALYZE:
+		/* spitd gets answered calls without a prompt, early media and barge-in need the channel here */
+		if (spit_remote_enabled() && call.engine.answered && !resumed && !ast_test_flag(&options, OPT_BARGE_IN)
+			&& !spit_analyze_remote(chan, &call.engine, start, call.trunk))
+			return;
+		if (spit_analyze(chan, &call, ast_test_flag(&options, OPT_BARGE_IN) ? opts[OPT_ARG_BARGE_IN] : NULL))
+			return;
+		break;
+	case SPIT_CALL_GREETING:
+		/* Decided on the burst alone, the whole greeting is still to come */
+		if (spit_analyze(chan, &call, NULL))
+			return;
+		break;
+	case SPIT_CALL_FINISH:
+		break;
+	}
+
+	spit_call_finish(&call, spit_now());
 }
 
 
 static int spit_exec(struct ast_channel *chan, void *data)
 {
 	struct ast_module_user *u = NULL;
+	struct spit_burst_hit burst = { "", 0 };
+	struct spit_engine state;
 
 	u = ast_module_user_add(chan);
-	isAutomatedDialer(chan, data);
+	/* A call that has been through SPIT before was counted then, go by what that run found */
+	if (!spit_load_state(chan, &state))
+		burst = state.burst;
+	else
+		spit_burst_record(chan->cid.cid_ani, spit_now(), &burst);
+	isAutomatedDialer(chan, data, &burst);
 	ast_module_user_remove(u);
 
 	return 0;
@@ -369,6 +850,20 @@ static void load_config(void)
 	struct ast_config *cfg = NULL;
 	char *cat = NULL;
 	struct ast_variable *var = NULL;
+	struct spit_params params;
+	struct spit_burst_config burst;
+	struct spit_analytics_config analytics;
+	struct spit_remote_config remote;
+	struct spit_tuning_config tuning;
+	struct spit_pipeline pipeline;
+	char stages[128];
+
+	spit_params_defaults(&params);
+	spit_burst_defaults(&burst);
+	spit_analytics_defaults(&analytics);
+	spit_remote_defaults(&remote);
+	spit_tuning_defaults(&tuning);
+	spit_pipeline_defaults(&pipeline);
 
 	if (!(cfg = ast_config_load("spit.conf"))) {
 		ast_log(LOG_ERROR, "Configuration file spit.conf missing.\n");
@@ -378,55 +873,389 @@ static void load_config(void)
 	cat = ast_category_browse(cfg, NULL);
 
 	while (cat) {
-		if (!strcasecmp(cat, "general") ) {
+		if (!strcasecmp(cat, "general") || !strcasecmp(cat, "burst")) {
 			var = ast_variable_browse(cfg, cat);
 			while (var) {
-				if (!strcasecmp(var->name, "initial_silence")) {
-					dfltInitialSilence = atoi(var->value);
-				} else if (!strcasecmp(var->name, "greeting")) {
-					dfltGreeting = atoi(var->value);
-				} else if (!strcasecmp(var->name, "after_greeting_silence")) {
-					dfltAfterGreetingSilence = atoi(var->value);
-				} else if (!strcasecmp(var->name, "silence_threshold")) {
-					dfltSilenceThreshold = atoi(var->value);
-				} else if (!strcasecmp(var->name, "total_analysis_time")) {
-					dfltTotalAnalysisTime = atoi(var->value);
-				} else if (!strcasecmp(var->name, "min_word_length")) {
-					dfltMinimumWordLength = atoi(var->value);
-				} else if (!strcasecmp(var->name, "between_words_silence")) {
-					dfltBetweenWordsSilence = atoi(var->value);
-				} else if (!strcasecmp(var->name, "maximum_number_of_words")) {
-					dfltMaximumNumberOfWords = atoi(var->value);
-				} else {
-					ast_log(LOG_WARNING, "%s: Cat:%s. Unknown keyword %s at line %d of spit.conf\n",
+				if (!strcasecmp(cat, "general") && !strcasecmp(var->name, "progress_zone")) {
+					ast_copy_string(dfltProgressZone, var->value, sizeof(dfltProgressZone));
+				} else if (spit_config_apply(&params, &burst, cat, var->name, var->value)) {
+					ast_log(LOG_WARNING, "%s: Cat:%s. Unknown keyword or bad value %s at line %d of spit.conf\n",
 						app, cat, var->name, var->lineno);
 				}
 				var = var->next;
 			}
+		} else if (!strcasecmp(cat, "analytics")) {
+			for (var = ast_variable_browse(cfg, cat); var; var = var->next) {
+				if (spit_analytics_config_apply(&analytics, var->name, var->value)) {
+					ast_log(LOG_WARNING, "%s: Cat:%s. Unknown keyword %s at line %d of spit.conf\n",
+						app, cat, var->name, var->lineno);
+				}
+			}
+		} else if (!strcasecmp(cat, "remote")) {
+			for (var = ast_variable_browse(cfg, cat); var; var = var->next) {
+				if (spit_remote_config_apply(&remote, var->name, var->value)) {
+					ast_log(LOG_WARNING, "%s: Cat:%s. Unknown keyword %s at line %d of spit.conf\n",
+						app, cat, var->name, var->lineno);
+				}
+			}
+		} else if (!strcasecmp(cat, "tuning")) {
+			for (var = ast_variable_browse(cfg, cat); var; var = var->next) {
+				if (spit_tuning_config_apply(&tuning, var->name, var->value)) {
+					ast_log(LOG_WARNING, "%s: Cat:%s. Unknown keyword or bad value %s at line %d of spit.conf\n",
+						app, cat, var->name, var->lineno);
+				}
+			}
+		} else if (!strcasecmp(cat, "pipeline")) {
+			for (var = ast_variable_browse(cfg, cat); var; var = var->next) {
+				if (spit_pipeline_config_apply(&pipeline, var->name, var->value)) {
+					ast_log(LOG_WARNING, "%s: Cat:%s. Unknown keyword or bad value %s at line %d of spit.conf\n",
+						app, cat, var->name, var->lineno);
+				}
+			}
 		}
 		cat = ast_category_browse(cfg, cat);
 	}
 
 	ast_config_destroy(cfg);
 
+	dfltParams = params;
+	spit_burst_configure(&burst);
+	spit_analytics_configure(&analytics);
+	spit_remote_configure(&remote);
+	spit_tuning_configure(&tuning, &params);
+	spit_pipeline_configure(&pipeline);
+
 	if (option_verbose > 2)
 		ast_verbose(VERBOSE_PREFIX_3 "SPIT defaults: initialSilence [%d] greeting [%d] afterGreetingSilence [%d] "
-		"totalAnalysisTime [%d] minimumWordLength [%d] betweenWordsSilence [%d] maximumNumberOfWords [%d] silenceThreshold [%d] \n",
-				dfltInitialSilence, dfltGreeting, dfltAfterGreetingSilence, dfltTotalAnalysisTime,
-				dfltMinimumWordLength, dfltBetweenWordsSilence, dfltMaximumNumberOfWords, dfltSilenceThreshold );
+		"totalAnalysisTime [%d] minimumWordLength [%d] betweenWordsSilence [%d] maximumNumberOfWords [%d] silenceThreshold [%d] maximumWordLength [%d]\n",
+				params.initialSilence, params.greeting, params.afterGreetingSilence, params.totalAnalysisTime,
+				params.minimumWordLength, params.betweenWordsSilence, params.maximumNumberOfWords, params.silenceThreshold, params.maximumWordLength);
+
+	spit_pipeline_format(&pipeline, stages, sizeof(stages));
+	if (option_verbose > 2)
+		ast_verbose(VERBOSE_PREFIX_3 "SPIT pipeline: %s\n", stages);
+
+	if (analytics.enabled && option_verbose > 2)
+		ast_verbose(VERBOSE_PREFIX_3 "SPIT analytics: directory [%s] rotate_size [%d] rotate_interval [%d] flush_interval [%d]\n",
+				analytics.directory, analytics.rotateSize, analytics.rotateInterval, analytics.flushInterval);
+
+	if (remote.enabled && option_verbose > 2)
+		ast_verbose(VERBOSE_PREFIX_3 "SPIT remote analysis: spitd [%s:%d] timeout [%d] fallback [%s]\n",
+				remote.host, remote.port, remote.timeout, remote.fallback ? "yes" : "no");
+
+	if (tuning.enabled && option_verbose > 2)
+		ast_verbose(VERBOSE_PREFIX_3 "SPIT tuning: target [%d%%] window [%d] silenceThreshold [%d-%d] "
+			"betweenWordsSilence [%d-%d] totalAnalysisTime [%d-%d]\n", tuning.target, tuning.window,
+				tuning.min[SPIT_TUNED_SILENCE_THRESHOLD], tuning.max[SPIT_TUNED_SILENCE_THRESHOLD],
+				tuning.min[SPIT_TUNED_BETWEEN_WORDS_SILENCE], tuning.max[SPIT_TUNED_BETWEEN_WORDS_SILENCE],
+				tuning.min[SPIT_TUNED_TOTAL_ANALYSIS_TIME], tuning.max[SPIT_TUNED_TOTAL_ANALYSIS_TIME]);
 
 	return;
 }
 
+static int spit_features_read(struct ast_channel *chan, char *cmd, char *data, char *buf, size_t len)
+{
+	struct ast_datastore *datastore;
+	struct spit_features features;
+	int i;
+
+	if (ast_strlen_zero(data)) {
+		ast_log(LOG_WARNING, "%s requires a field name.\n", cmd);
+		return -1;
+	}
+
+	for (i = 0; i < (int) (sizeof(spit_feature_fields) / sizeof(spit_feature_fields[0])); i++) {
+		if (!strcasecmp(spit_feature_fields[i].name, data))
+			break;
+	}
+	if (i == sizeof(spit_feature_fields) / sizeof(spit_feature_fields[0])) {
+		ast_log(LOG_WARNING, "%s: Unknown field '%s'.\n", cmd, data);
+		return -1;
+	}
+
+	ast_channel_lock(chan);
+	if (!(datastore = ast_channel_datastore_find(chan, &spit_features_info, NULL))) {
+		ast_channel_unlock(chan);
+		return -1;
+	}
+	memcpy(&features, datastore->data, sizeof(features));
+	ast_channel_unlock(chan);
+
+	snprintf(buf, len, "%d", *(int *) ((char *) &features + spit_feature_fields[i].offset));
+
+	return 0;
+}
+
+static struct ast_custom_function spit_features_function = {
+	.name = "SPIT_FEATURES",
+	.synopsis = "Read the measurements of the last SPIT analysis on the channel",
+	.syntax = "SPIT_FEATURES(field)",
+	.desc = "Fields: voiceduration, words, shortwords, longestword, initialsilence,\n"
+	"longestsilence, gaps, analysistime, earlytime, decisiontime, lost, lossgaps,\n"
+	"burstcalls, answered, bargein, echo, modulation, pitchjitter. All values\n"
+"are in ms or counts, modulation is a percent and pitchjitter in 1/1000.\n",
+	.read = spit_features_read,
+};
+
+static int spit_feedback_write(struct ast_channel *chan, char *cmd, char *data, const char *value)
+{
+	struct ast_datastore *datastore;
+	struct spit_tuning_sample sample;
+	enum spit_status truth;
+
+	if (!strcasecmp(value, "HUMAN")) {
+		truth = SPIT_HUMAN;
+	} else if (!strcasecmp(value, "MACHINE")) {
+		truth = SPIT_MACHINE;
+	} else {
+		ast_log(LOG_WARNING, "%s: Unknown outcome '%s', use HUMAN or MACHINE.\n", cmd, value);
+		return -1;
+	}
+
+	/* Each verdict is reported on once */
+	ast_channel_lock(chan);
+	if (!(datastore = ast_channel_datastore_find(chan, &spit_sample_info, NULL))) {
+		ast_channel_unlock(chan);
+		if (option_debug)
+			ast_log(LOG_DEBUG, "%s: No SPIT verdict on %s to report on.\n", cmd, chan->name);
+		return 0;
+	}
+	memcpy(&sample, datastore->data, sizeof(sample));
+	ast_channel_datastore_remove(chan, datastore);
+	ast_channel_unlock(chan);
+	ast_channel_datastore_free(datastore);
+
+	if (!spit_tuning_feedback(&sample, truth) && option_debug) {
+		ast_log(LOG_DEBUG, "%s: %s on trunk %s was %s.\n", cmd, spit_status_name(sample.status), sample.trunk,
+			spit_status_name(truth));
+	}
+
+	return 0;
+}
+
+static struct ast_custom_function spit_feedback_function = {
+	.name = "SPIT_FEEDBACK",
+	.synopsis = "Tell SPIT what the call it analyzed really was",
+	.syntax = "Set(SPIT_FEEDBACK()=HUMAN|MACHINE)",
+	.desc = "The outcome is counted once against the verdict of the last SPIT on the\n"
+	"channel, for its trunk. Every window reports of a trunk its silenceThreshold,\n"
+	"betweenWordsSilence and totalAnalysisTime move one step within the bounds of\n"
+	"the [tuning] section of spit.conf.\n",
+	.write = spit_feedback_write,
+};
+
+static char show_bursts_usage[] =
+"Usage: spit show bursts\n"
+"       Lists the ANI prefixes with the highest call rate in the\n"
+"       current burst window.\n";
+
+static int spit_show_bursts(int fd, int argc, char *argv[])
+{
+	struct spit_burst_heavy_hitter hitters[BURST_HEAVY_HITTERS];
+	struct spit_burst_config burst;
+	int i, shown;
+
+	if (argc != 3)
+		return RESULT_SHOWUSAGE;
+
+	spit_burst_get_config(&burst);
+	if (!burst.enabled) {
+		ast_cli(fd, "Burst detection is disabled.\n");
+		return RESULT_SUCCESS;
+	}
+
+	shown = spit_burst_heavy_hitters(spit_now(), hitters, BURST_HEAVY_HITTERS);
+
+	ast_cli(fd, "%-16s %-8s %s\n", "Prefix", "Calls", "Status");
+	for (i = 0; i < shown; i++) {
+		ast_cli(fd, "%-16s %-8u %s\n", hitters[i].prefix, hitters[i].count,
+			hitters[i].count >= (unsigned int) burst.threshold ? "BURST" : "watching");
+	}
+	ast_cli(fd, "%d prefix%s over %d calls per %d ms\n", shown, shown == 1 ? "" : "es",
+		burst.threshold / 2, burst.window);
+
+	return RESULT_SUCCESS;
+}
+
+static char show_perf_usage[] =
+"Usage: spit show perf\n"
+"       Shows the cycles spent in each stage of the analysis since the\n"
+"       module was loaded. Needs perf_counters = yes in spit.conf.\n";
+
+static int spit_show_perf(int fd, int argc, char *argv[])
+{
+	struct spit_perf_stage stages[SPIT_STAGES];
+	uint64_t analyses;
+	int i;
+
+	if (argc != 3)
+		return RESULT_SHOWUSAGE;
+
+	if (!dfltParams.perfCounters)
+		ast_cli(fd, "Performance counters are disabled, cycles are from when they were on.\n");
+
+	analyses = spit_perf_get(stages);
+
+	ast_cli(fd, "%-10s %-12s %-14s %-14s %s\n", "Stage", "Calls", "Samples", "Cycles/call", "Cycles/sample");
+	for (i = 0; i < SPIT_STAGES; i++) {
+		ast_cli(fd, "%-10s %-12llu %-14llu %-14llu %.2f\n", spit_stage_name(i),
+			(unsigned long long) stages[i].calls, (unsigned long long) stages[i].samples,
+			(unsigned long long) (stages[i].calls ? stages[i].cycles / stages[i].calls : 0),
+			stages[i].samples ? (double) stages[i].cycles / stages[i].samples : 0.0);
+	}
+	ast_cli(fd, "%llu analys%s\n", (unsigned long long) analyses, analyses == 1 ? "is" : "es");
+
+	return RESULT_SUCCESS;
+}
+
+static char show_pipeline_usage[] =
+"Usage: spit show pipeline\n"
+"       Shows the detection stages in the order they run, how often\n"
+"       each one decided and what it costs.\n";
+
+static int spit_show_pipeline(int fd, int argc, char *argv[])
+{
+	struct spit_perf_stage stages[SPIT_STAGES];
+	struct spit_pipeline pipeline;
+	struct spit_perf_stage *s;
+	char budget[16];
+	int i;
+
+	if (argc != 3)
+		return RESULT_SHOWUSAGE;
+
+	spit_pipeline_get(&pipeline);
+	spit_perf_get(stages);
+
+	ast_cli(fd, "%-10s %-8s %-10s %-10s %-7s %-14s %s\n", "Stage", "Budget", "Analyses", "Verdicts", "Hit%",
+		"Cycles/sample", "Over budget");
+	for (i = 0; i < pipeline.numStages; i++) {
+		s = &stages[pipeline.stages[i]];
+		if (pipeline.budget[pipeline.stages[i]])
+			snprintf(budget, sizeof(budget), "%d", pipeline.budget[pipeline.stages[i]]);
+		else
+			ast_copy_string(budget, "-", sizeof(budget));
+		ast_cli(fd, "%-10s %-8s %-10llu %-10llu %-7.1f %-14.2f %llu\n", spit_stage_name(pipeline.stages[i]), budget,
+			(unsigned long long) s->analyses, (unsigned long long) s->verdicts,
+			s->analyses ? (double) s->verdicts * 100 / s->analyses : 0.0,
+			s->samples ? (double) s->cycles / s->samples : 0.0, (unsigned long long) s->overBudget);
+	}
+	if (!dfltParams.perfCounters)
+		ast_cli(fd, "Cycles are only counted with perf_counters = yes or for stages with a budget.\n");
+
+	return RESULT_SUCCESS;
+}
+
+static char show_analytics_usage[] =
+"Usage: spit show analytics\n"
+"       Shows how many analyses went to the analytics log and the\n"
+"       file they are written to.\n";
+
+static int spit_show_analytics(int fd, int argc, char *argv[])
+{
+	struct spit_analytics_stats stats;
+
+	if (argc != 3)
+		return RESULT_SHOWUSAGE;
+
+	if (!spit_analytics_enabled())
+		ast_cli(fd, "The analytics log is disabled, counters are from when it was on.\n");
+
+	spit_analytics_get_stats(&stats);
+
+	ast_cli(fd, "Records logged:  %llu\n", (unsigned long long) stats.records);
+	ast_cli(fd, "Records written: %llu\n", (unsigned long long) stats.written);
+	ast_cli(fd, "Records dropped: %llu\n", (unsigned long long) stats.dropped);
+	ast_cli(fd, "Write errors:    %llu\n", (unsigned long long) stats.errors);
+	ast_cli(fd, "Bytes written:   %llu\n", (unsigned long long) stats.bytes);
+	ast_cli(fd, "Files opened:    %u\n", stats.files);
+	ast_cli(fd, "Current file:    %s\n", stats.file[0] ? stats.file : "(none)");
+
+	return RESULT_SUCCESS;
+}
+
+static char show_tuning_usage[] =
+"Usage: spit show tuning\n"
+"       Lists the trunks SPIT_FEEDBACK() reported on, how often their\n"
+"       verdicts were right and the values they are analyzed with.\n";
+
+static int spit_show_tuning(int fd, int argc, char *argv[])
+{
+	struct spit_tuning_trunk *trunks;
+	char right[8], window[24];
+	int i, shown;
+
+	if (argc != 3)
+		return RESULT_SHOWUSAGE;
+
+	if (!spit_tuning_enabled())
+		ast_cli(fd, "Tuning is disabled, trunks keep the values they were tuned to.\n");
+
+	if (!(trunks = ast_calloc(SPIT_TUNING_TRUNKS, sizeof(*trunks))))
+		return RESULT_FAILURE;
+	shown = spit_tuning_get_trunks(trunks, SPIT_TUNING_TRUNKS);
+
+	ast_cli(fd, "%-24s %-9s %-9s %-9s %-10s %-10s %-10s %s\n", "Trunk", "Reports", "Right", "Window",
+		"Threshold", "Between", "Total", "Adjusted");
+	for (i = 0; i < shown; i++) {
+		snprintf(right, sizeof(right), "%d%%", (int) (trunks[i].correct * 100 / trunks[i].reports));
+		snprintf(window, sizeof(window), "%d/%d", trunks[i].windowCorrect, trunks[i].windowReports);
+		ast_cli(fd, "%-24s %-9llu %-9s %-9s %-10d %-10d %-10d %u\n", trunks[i].name,
+			(unsigned long long) trunks[i].reports, right, window, trunks[i].values[SPIT_TUNED_SILENCE_THRESHOLD],
+			trunks[i].values[SPIT_TUNED_BETWEEN_WORDS_SILENCE], trunks[i].values[SPIT_TUNED_TOTAL_ANALYSIS_TIME],
+			trunks[i].adjustments);
+	}
+	ast_cli(fd, "%d trunk%s\n", shown, shown == 1 ? "" : "s");
+	free(trunks);
+
+	return RESULT_SUCCESS;
+}
+
+static struct ast_cli_entry cli_spit[] = {
+	{ { "spit", "show", "bursts", NULL },
+	spit_show_bursts, "Show ANI prefixes with the highest call rate",
+	show_bursts_usage },
+
+	{ { "spit", "show", "perf", NULL },
+	spit_show_perf, "Show the cycles spent in each stage of SPIT",
+	show_perf_usage },
+
+	{ { "spit", "show", "pipeline", NULL },
+	spit_show_pipeline, "Show the hit rate and cost of the SPIT detection stages",
+	show_pipeline_usage },
+
+	{ { "spit", "show", "analytics", NULL },
+	spit_show_analytics, "Show the counters of the SPIT analytics log",
+	show_analytics_usage },
+
+	{ { "spit", "show", "tuning", NULL },
+	spit_show_tuning, "Show the trunks SPIT tuned from feedback",
+	show_tuning_usage },
+};
+
 static int unload_module(void)
 {
+	int res;
+
 	ast_module_user_hangup_all();
-	return ast_unregister_application(app);
+	ast_cli_unregister_multiple(cli_spit, sizeof(cli_spit) / sizeof(struct ast_cli_entry));
+	res = ast_custom_function_unregister(&spit_features_function);
+	res |= ast_custom_function_unregister(&spit_feedback_function);
+	res |= ast_unregister_application(app);
+	spit_analytics_shutdown();
+	return res;
 }
 
 static int load_module(void)
 {
 	load_config();
+	if (ast_custom_function_register(&spit_features_function))
+		return AST_MODULE_LOAD_DECLINE;
+	if (ast_custom_function_register(&spit_feedback_function)) {
+		ast_custom_function_unregister(&spit_features_function);
+		return AST_MODULE_LOAD_DECLINE;
+	}
+	ast_cli_register_multiple(cli_spit, sizeof(cli_spit) / sizeof(struct ast_cli_entry));
 	return ast_register_application(app, spit_exec, synopsis, descrip);
 }
 
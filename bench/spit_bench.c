@@ -0,0 +1,656 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2003 - 2006, Aheeva Technology.
+ *
+ * Claude Klimos (claude.klimos@aheeva.com)
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Micro benchmarks for the stages of a SPIT analysis
+ *
+ * Runs each stage of the analysis on its own over fixed audio fixtures:
+ *
+ * - ingest:  u-law to signed linear conversion of a frame, what ast_read()
+ *            does for us on a G.711 trunk, plus the frame timing bookkeeping
+ * - energy:  silence detection
+ * - step:    the detection state machine, restarted at every verdict
+ * - synthetic: modulation spectrum and pitch of the synthetic speech detector
+ * - verdict: formatting SPITSTATUS, SPITCAUSE and the features
+ * - analytics: handing the record of an analysis to the analytics log, the
+ *            writer thread runs against a scratch directory meanwhile
+ * - call:    a whole analysis from the first frame to the verdict
+ *
+ * The engine is included rather than linked so its static stages can be
+ * called directly. Build and run from the top of the tree with
+ *
+ *   gcc -O2 -o bench/spit_bench bench/spit_bench.c -lm -lpthread
+ *   bench/spit_bench [--iterations N] [--json] [--fixture file.sln]
+ *                    [--baseline file.json [--tolerance percent]]
+ *
+ * --fixture adds a raw 8kHz signed linear recording to the built in
+ * fixtures. --json prints the results for a later --baseline run, which
+ * compares ns per frame (or per call) stage by stage and exits with 1 when
+ * any stage is slower than the baseline by more than the tolerance.
+ *
+ * Allocations are counted by wrapping malloc() and friends, which needs
+ * glibc. Cycles are TSC cycles on x86 and ns elsewhere, see spit_cycles().
+ */
+
+#include "../spit_engine.c"
+#include "../spit_analytics.c"
+
+#include <errno.h>
+#include <dirent.h>
+#include <math.h>
+
+#define FRAME_SAMPLES   160
+#define MAX_FIXTURES    8
+
+struct fixture {
+	const char *name;
+	int frames;
+	unsigned char *ulaw;	/* FRAME_SAMPLES bytes per frame */
+	int16_t *slin;
+	int *seqno;	/* Sequence number of each frame, jumps where packets were lost */
+};
+
+struct result {
+	const char *stage;
+	const char *unit;	/* What ns is per, frame or call */
+	double ns;
+	double cyclesPerSample;
+	double allocsPerCall;
+};
+
+static struct fixture fixtures[MAX_FIXTURES];
+static int numFixtures;
+
+/* Allocation counting, glibc only */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static uint64_t allocations;
+
+void *malloc(size_t size)
+{
+	allocations++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	allocations++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	allocations++;
+	return __libc_realloc(ptr, size);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* G.711 u-law, the same tables Asterisk builds in ulaw.c */
+static int16_t ulaw2lin[256];
+
+static unsigned char lin2ulaw(int sample)
+{
+	static const int exp_lut[8] = { 0x84, 0x108, 0x210, 0x420, 0x840, 0x1080, 0x2100, 0x4200 };
+	int sign = 0, exponent, mantissa;
+
+	if (sample < 0) {
+		sample = -sample;
+		sign = 0x80;
+	}
+	if (sample > 32635)
+		sample = 32635;
+	sample += 0x84;
+	for (exponent = 7; exponent > 0 && sample < exp_lut[exponent]; exponent--)
+		;
+	mantissa = (sample >> (exponent + 3)) & 0x0f;
+
+	return ~(sign | (exponent << 4) | mantissa);
+}
+
+static void ulaw_init(void)
+{
+	int i, mantissa, exponent, sample;
+	unsigned char u;
+
+	for (i = 0; i < 256; i++) {
+		u = ~i;
+		exponent = (u >> 4) & 0x07;
+		mantissa = u & 0x0f;
+		sample = (((mantissa << 3) + 0x84) << exponent) - 0x84;
+		ulaw2lin[i] = (u & 0x80) ? -sample : sample;
+	}
+}
+
+/* Fixtures are made of speech like bursts: a pitched tone under a syllable envelope
+   over a noise floor. The generator is seeded so every run sees the same audio. */
+static unsigned int seed = 12345;
+
+static int noise(int amplitude)
+{
+	seed = seed * 1103515245 + 12345;
+	return (int) ((seed >> 16) % (2 * amplitude + 1)) - amplitude;
+}
+
+static struct fixture *fixture_new(const char *name, int ms)
+{
+	struct fixture *fx = &fixtures[numFixtures++];
+	int i;
+
+	fx->name = name;
+	fx->frames = ms / 20;
+	fx->ulaw = __libc_calloc(fx->frames, FRAME_SAMPLES);
+	fx->slin = __libc_calloc(fx->frames * FRAME_SAMPLES, sizeof(int16_t));
+	fx->seqno = __libc_calloc(fx->frames, sizeof(int));
+	for (i = 0; i < fx->frames; i++)
+		fx->seqno[i] = i;
+
+	return fx;
+}
+
+static void fixture_speech(struct fixture *fx, int fromMs, int toMs)
+{
+	int i;
+	double t, envelope;
+
+	for (i = fromMs * SPIT_SAMPLES_PER_MS; i < toMs * SPIT_SAMPLES_PER_MS && i < fx->frames * FRAME_SAMPLES; i++) {
+		t = (double) i / 8000;
+		envelope = 0.6 + 0.4 * sin(2 * M_PI * 4 * t);
+		fx->slin[i] = envelope * (4000 * sin(2 * M_PI * 140 * t) + 1500 * sin(2 * M_PI * 280 * t)) + noise(200);
+	}
+}
+
+static void fixture_finish(struct fixture *fx)
+{
+	int i;
+
+	for (i = 0; i < fx->frames * FRAME_SAMPLES; i++) {
+		if (!fx->slin[i])
+			fx->slin[i] = noise(40);
+		fx->ulaw[i] = lin2ulaw(fx->slin[i]);
+	}
+}
+
+static void fixtures_builtin(void)
+{
+	struct fixture *fx;
+	int i;
+
+	/* "Hello?" and then waiting for us */
+	fx = fixture_new("human", 3000);
+	fixture_speech(fx, 300, 800);
+	fixture_finish(fx);
+
+	/* A greeting that goes on and on */
+	fx = fixture_new("machine", 6000);
+	for (i = 0; i < 6000; i += 450)
+		fixture_speech(fx, i, i + 350);
+	fixture_finish(fx);
+
+	/* Nobody says anything */
+	fx = fixture_new("silence", 6000);
+	fixture_finish(fx);
+
+	/* The human fixture over a leg that drops one packet in ten */
+	fx = fixture_new("lossy", 3000);
+	fixture_speech(fx, 300, 800);
+	fixture_finish(fx);
+	for (i = 0; i < fx->frames; i++)
+		fx->seqno[i] = i + i / 9;
+}
+
+static int fixture_load(const char *path)
+{
+	struct fixture *fx;
+	FILE *fp;
+	long size;
+	int i;
+
+	if (numFixtures == MAX_FIXTURES) {
+		fprintf(stderr, "Too many fixtures\n");
+		return -1;
+	}
+	if (!(fp = fopen(path, "rb"))) {
+		fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	rewind(fp);
+
+	fx = fixture_new(path, size / sizeof(int16_t) / SPIT_SAMPLES_PER_MS);
+	if (fread(fx->slin, sizeof(int16_t), fx->frames * FRAME_SAMPLES, fp) != (size_t) (fx->frames * FRAME_SAMPLES)) {
+		fprintf(stderr, "Short read on %s\n", path);
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+	for (i = 0; i < fx->frames * FRAME_SAMPLES; i++)
+		fx->ulaw[i] = lin2ulaw(fx->slin[i]);
+
+	return 0;
+}
+
+static void engine_start(struct spit_engine *e)
+{
+	struct spit_params params;
+
+	spit_params_defaults(&params);
+	spit_engine_init(e, &params, 1);
+}
+
+/* Keeps the compiler from dropping work whose result we don't look at */
+static volatile int sink;
+
+static void bench_ingest(int iterations, struct result *r)
+{
+	int16_t frame[FRAME_SAMPLES];
+	struct spit_frame_info info = { 1, 0, 1, 0 };
+	uint64_t frames = 0, start, cycles, allocs;
+	int it, f, i, n;
+
+	allocs = allocations;
+	start = now_ns();
+	cycles = spit_cycles();
+	for (it = 0; it < iterations; it++) {
+		for (n = 0; n < numFixtures; n++) {
+			for (f = 0; f < fixtures[n].frames; f++) {
+				const unsigned char *u = fixtures[n].ulaw + f * FRAME_SAMPLES;
+
+				for (i = 0; i < FRAME_SAMPLES; i++)
+					frame[i] = ulaw2lin[u[i]];
+				info.seqno = fixtures[n].seqno[f];
+				info.ts = info.seqno * 20;
+				sink += frame[f % FRAME_SAMPLES] + info.ts;
+				frames++;
+			}
+		}
+	}
+	cycles = spit_cycles() - cycles;
+
+	r->stage = "ingest";
+	r->unit = "frame";
+	r->ns = (double) (now_ns() - start) / frames;
+	r->cyclesPerSample = (double) cycles / (frames * FRAME_SAMPLES);
+	r->allocsPerCall = (double) (allocations - allocs) / (iterations * numFixtures);
+}
+
+static void bench_energy(int iterations, struct result *r)
+{
+	struct spit_engine e;
+	uint64_t frames = 0, start, cycles, allocs;
+	int it, f, n;
+
+	engine_start(&e);
+	allocs = allocations;
+	start = now_ns();
+	cycles = spit_cycles();
+	for (it = 0; it < iterations; it++) {
+		for (n = 0; n < numFixtures; n++) {
+			for (f = 0; f < fixtures[n].frames; f++) {
+				sink += spit_silence(&e, fixtures[n].slin + f * FRAME_SAMPLES, FRAME_SAMPLES);
+				frames++;
+			}
+		}
+	}
+	cycles = spit_cycles() - cycles;
+
+	r->stage = "energy";
+	r->unit = "frame";
+	r->ns = (double) (now_ns() - start) / frames;
+	r->cyclesPerSample = (double) cycles / (frames * FRAME_SAMPLES);
+	r->allocsPerCall = (double) (allocations - allocs) / (iterations * numFixtures);
+}
+
+static void bench_step(int iterations, struct result *r)
+{
+	struct spit_engine e;
+	int *silence[MAX_FIXTURES];
+	uint64_t frames = 0, start, cycles, allocs;
+	int it, f, n;
+
+	/* The silence detector runs up front, this stage only times the state machine */
+	for (n = 0; n < numFixtures; n++) {
+		silence[n] = __libc_calloc(fixtures[n].frames, sizeof(int));
+		engine_start(&e);
+		for (f = 0; f < fixtures[n].frames; f++)
+			silence[n][f] = spit_silence(&e, fixtures[n].slin + f * FRAME_SAMPLES, FRAME_SAMPLES);
+	}
+
+	allocs = allocations;
+	start = now_ns();
+	cycles = spit_cycles();
+	for (it = 0; it < iterations; it++) {
+		for (n = 0; n < numFixtures; n++) {
+			engine_start(&e);
+			for (f = 0; f < fixtures[n].frames; f++) {
+				frames++;
+				if (spit_step(&e, FRAME_VOICE, 20, 0, 0, silence[n][f]))
+					engine_start(&e);
+			}
+		}
+	}
+	cycles = spit_cycles() - cycles;
+
+	r->stage = "step";
+	r->unit = "frame";
+	r->ns = (double) (now_ns() - start) / frames;
+	r->cyclesPerSample = (double) cycles / (frames * FRAME_SAMPLES);
+	r->allocsPerCall = (double) (allocations - allocs) / (iterations * numFixtures);
+
+	for (n = 0; n < numFixtures; n++)
+		free(silence[n]);
+}
+
+static void bench_synthetic(int iterations, struct result *r)
+{
+	struct spit_engine e;
+	uint64_t frames = 0, start, cycles, allocs;
+	int it, f, n;
+
+	allocs = allocations;
+	start = now_ns();
+	cycles = spit_cycles();
+	for (it = 0; it < iterations; it++) {
+		for (n = 0; n < numFixtures; n++) {
+			engine_start(&e);
+			e.params.synthetic = 1;
+			/* Feed the whole fixture, a verdict would cut the measured work short */
+			e.params.syntheticMinVoice = INT_MAX;
+			for (f = 0; f < fixtures[n].frames; f++) {
+				spit_synthetic(&e, fixtures[n].slin + f * FRAME_SAMPLES, FRAME_SAMPLES, 0);
+				sink += spit_synthetic_check(&e);
+				frames++;
+			}
+		}
+	}
+	cycles = spit_cycles() - cycles;
+
+	r->stage = "synthetic";
+	r->unit = "frame";
+	r->ns = (double) (now_ns() - start) / frames;
+	r->cyclesPerSample = (double) cycles / (frames * FRAME_SAMPLES);
+	r->allocsPerCall = (double) (allocations - allocs) / (iterations * numFixtures);
+}
+
+static void bench_verdict(int iterations, struct result *r)
+{
+	struct spit_engine e;
+	struct spit_features features;
+	char status[256], cause[256];
+	uint64_t calls = 0, start, allocs;
+	int it;
+
+	engine_start(&e);
+	e.lostTime = 120;
+	e.lossGaps = 3;
+	spit_verdict(&e, SPIT_HUMAN, SPIT_CAUSE_SILENCEAFTERNOISE, 800, 800);
+
+	allocs = allocations;
+	start = now_ns();
+	for (it = 0; it < iterations * 100; it++) {
+		spit_engine_format(&e, status, sizeof(status), cause, sizeof(cause));
+		spit_engine_features(&e, &features);
+		sink += status[0] + cause[it % 8] + features.words;
+		calls++;
+	}
+
+	/* No audio goes through this stage, there is nothing to divide cycles by */
+	r->stage = "verdict";
+	r->unit = "call";
+	r->ns = (double) (now_ns() - start) / calls;
+	r->cyclesPerSample = 0;
+	r->allocsPerCall = (double) (allocations - allocs) / calls;
+}
+
+static void bench_analytics(int iterations, struct result *r)
+{
+	struct spit_analytics_config config;
+	struct spit_engine e;
+	struct spit_features features;
+	char dir[] = "/tmp/spit_bench.XXXXXX", path[sizeof(dir) + 256];
+	uint64_t calls = 0, start, elapsed = 0, allocs;
+	struct dirent *entry;
+	DIR *d;
+	int it;
+
+	r->stage = "analytics";
+	r->unit = "call";
+	r->ns = 0;
+	r->cyclesPerSample = 0;
+	r->allocsPerCall = 0;
+	if (!mkdtemp(dir))
+		return;
+
+	spit_analytics_defaults(&config);
+	config.enabled = 1;
+	config.flushInterval = 100;
+	config.maxPending = INT_MAX;
+	snprintf(config.directory, sizeof(config.directory), "%s", dir);
+	spit_analytics_configure(&config);
+
+	engine_start(&e);
+	spit_verdict(&e, SPIT_MACHINE, SPIT_CAUSE_MAXWORDS, 4, 3);
+	spit_engine_features(&e, &features);
+
+	/* Warm up, the first record starts the writer on the file */
+	spit_analytics_log(&e, &features, "5551234567", 0, 0);
+
+	allocs = allocations;
+	for (it = 0; it < iterations * 100; it++) {
+		start = now_ns();
+		spit_analytics_log(&e, &features, "5551234567", it, 100);
+		elapsed += now_ns() - start;
+		calls++;
+	}
+	r->ns = (double) elapsed / calls;
+	r->allocsPerCall = (double) (allocations - allocs) / calls;
+
+	spit_analytics_shutdown();
+	if ((d = opendir(dir))) {
+		while ((entry = readdir(d))) {
+			if (entry->d_name[0] == '.')
+				continue;
+			snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+			unlink(path);
+		}
+		closedir(d);
+	}
+	rmdir(dir);
+}
+
+static void bench_call(int iterations, struct result *r)
+{
+	struct spit_engine e;
+	struct spit_frame_info info = { 1, 0, 1, 0 };
+	int16_t frame[FRAME_SAMPLES];
+	char status[256], cause[256];
+	uint64_t calls = 0, samples = 0, start, cycles, allocs;
+	int it, f, i, n;
+
+	allocs = allocations;
+	start = now_ns();
+	cycles = spit_cycles();
+	for (it = 0; it < iterations; it++) {
+		for (n = 0; n < numFixtures; n++) {
+			engine_start(&e);
+			for (f = 0; f < fixtures[n].frames && !e.status; f++) {
+				const unsigned char *u = fixtures[n].ulaw + f * FRAME_SAMPLES;
+
+				for (i = 0; i < FRAME_SAMPLES; i++)
+					frame[i] = ulaw2lin[u[i]];
+				info.seqno = fixtures[n].seqno[f];
+				info.ts = info.seqno * 20;
+				spit_engine_audio(&e, frame, FRAME_SAMPLES, &info);
+				samples += FRAME_SAMPLES;
+			}
+			spit_engine_noframes(&e);
+			spit_engine_format(&e, status, sizeof(status), cause, sizeof(cause));
+			sink += status[0];
+			calls++;
+		}
+	}
+	cycles = spit_cycles() - cycles;
+
+	r->stage = "call";
+	r->unit = "call";
+	r->ns = (double) (now_ns() - start) / calls;
+	r->cyclesPerSample = (double) cycles / samples;
+	r->allocsPerCall = (double) (allocations - allocs) / calls;
+}
+
+static void print_verdicts(FILE *out)
+{
+	struct spit_engine e;
+	struct spit_frame_info info = { 1, 0, 1, 0 };
+	char status[256], cause[256];
+	int f, n;
+
+	for (n = 0; n < numFixtures; n++) {
+		engine_start(&e);
+		for (f = 0; f < fixtures[n].frames && !e.status; f++) {
+			info.seqno = fixtures[n].seqno[f];
+			info.ts = info.seqno * 20;
+			spit_engine_audio(&e, fixtures[n].slin + f * FRAME_SAMPLES, FRAME_SAMPLES, &info);
+		}
+		spit_engine_noframes(&e);
+		spit_engine_format(&e, status, sizeof(status), cause, sizeof(cause));
+		fprintf(out, "  %-12s %s %s\n", fixtures[n].name, status, cause);
+	}
+}
+
+/* Finds the ns of a stage in a file written with --json */
+static int baseline_ns(const char *json, const char *stage, double *ns)
+{
+	char key[64];
+	const char *p;
+
+	snprintf(key, sizeof(key), "\"stage\": \"%s\"", stage);
+	if (!(p = strstr(json, key)) || !(p = strstr(p, "\"ns\":")))
+		return -1;
+
+	return sscanf(p + 5, "%lf", ns) == 1 ? 0 : -1;
+}
+
+static int compare_baseline(const char *path, const struct result *results, int count, double tolerance)
+{
+	char json[8192];
+	size_t len;
+	FILE *fp;
+	double ns, delta;
+	int i, regressed = 0;
+
+	if (!(fp = fopen(path, "r"))) {
+		fprintf(stderr, "Unable to open baseline %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	len = fread(json, 1, sizeof(json) - 1, fp);
+	json[len] = '\0';
+	fclose(fp);
+
+	printf("\nAgainst %s (tolerance %.1f%%)\n", path, tolerance);
+	printf("%-10s %12s %12s %9s\n", "Stage", "Baseline ns", "Now ns", "Change");
+	for (i = 0; i < count; i++) {
+		if (baseline_ns(json, results[i].stage, &ns) || ns <= 0) {
+			printf("%-10s %12s %12.1f %9s\n", results[i].stage, "-", results[i].ns, "new");
+			continue;
+		}
+		delta = (results[i].ns - ns) * 100 / ns;
+		printf("%-10s %12.1f %12.1f %+8.1f%%%s\n", results[i].stage, ns, results[i].ns, delta,
+			delta > tolerance ? " SLOWER" : "");
+		if (delta > tolerance)
+			regressed = 1;
+	}
+
+	return regressed;
+}
+
+int main(int argc, char *argv[])
+{
+	struct result results[7];
+	const char *baseline = NULL;
+	double tolerance = 10;
+	int iterations = 200, json = 0, count = 0, i, res;
+
+	ulaw_init();
+	fixtures_builtin();
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--iterations") && i + 1 < argc) {
+			iterations = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--json")) {
+			json = 1;
+		} else if (!strcmp(argv[i], "--baseline") && i + 1 < argc) {
+			baseline = argv[++i];
+		} else if (!strcmp(argv[i], "--tolerance") && i + 1 < argc) {
+			tolerance = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--fixture") && i + 1 < argc) {
+			if (fixture_load(argv[++i]))
+				return 2;
+		} else {
+			fprintf(stderr, "Usage: %s [--iterations N] [--json] [--fixture file.sln]\n"
+				"       [--baseline file.json [--tolerance percent]]\n", argv[0]);
+			return 2;
+		}
+	}
+	if (iterations < 1)
+		iterations = 1;
+
+	bench_ingest(iterations, &results[count++]);
+	bench_energy(iterations, &results[count++]);
+	bench_step(iterations, &results[count++]);
+	bench_synthetic(iterations, &results[count++]);
+	bench_verdict(iterations, &results[count++]);
+	bench_analytics(iterations, &results[count++]);
+	bench_call(iterations, &results[count++]);
+
+	if (json) {
+		printf("{\n  \"benchmark\": \"spit\",\n  \"iterations\": %d,\n  \"results\": [\n", iterations);
+		for (i = 0; i < count; i++) {
+			printf("    { \"stage\": \"%s\", \"unit\": \"%s\", \"ns\": %.2f, \"cycles_per_sample\": %.3f, \"allocs_per_call\": %.2f }%s\n",
+				results[i].stage, results[i].unit, results[i].ns, results[i].cyclesPerSample,
+				results[i].allocsPerCall, i + 1 < count ? "," : "");
+		}
+		printf("  ]\n}\n");
+	} else {
+		printf("SPIT benchmark, %d iterations over %d fixtures\n", iterations, numFixtures);
+		print_verdicts(stdout);
+		printf("\n%-10s %12s %14s %12s\n", "Stage", "ns", "Cycles/sample", "Allocs/call");
+		for (i = 0; i < count; i++) {
+			printf("%-10s %8.1f/%-5s %14.3f %12.2f\n", results[i].stage, results[i].ns, results[i].unit,
+				results[i].cyclesPerSample, results[i].allocsPerCall);
+		}
+	}
+
+	if (baseline) {
+		if ((res = compare_baseline(baseline, results, count, tolerance)) < 0)
+			return 2;
+		return res;
+	}
+
+	return 0;
+}
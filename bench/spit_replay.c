@@ -0,0 +1,374 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Replays calls through spit_call.c the way each module drives it
+ *
+ * app_spit.c and app_spit14.c read frames from the channel and hand them
+ * to spit_call_frame(), each with its own API for the frame flags. This
+ * replays the fixtures of bench/spit_bench.c and spitd/spit_sim.c, and a few
+ * calls made of the events around the audio (DTMF, ringback, answer, legs
+ * that stop sending), as the reads each module turns its frames into.
+ * Every call has to come out with the verdict below from both.
+ * Build and run from the top of the tree with
+ *
+ *   gcc -O2 -o bench/spit_replay bench/spit_replay.c spit_call.c spit_engine.c spit_analytics.c -lm -lpthread
+ *   bench/spit_replay
+ *
+ * Exits with 1 when a verdict differs. A change that means to change a
+ * verdict changes the table too.
+ *
+ * \author Justin Zimmer (jzimmer@leasehawk.com)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "../spit_call.h"
+
+#define FRAME_SAMPLES   160
+#define MAX_FIXTURES    16
+
+/* What happens in each 20ms of a call */
+#define EV_VOICE        0	/* A frame of audio */
+#define EV_LOST         1	/* The frame was lost on the way, its sequence number is skipped */
+#define EV_QUIET        2	/* The far end sent nothing, DTX or VAD */
+#define EV_CNG          3	/* Comfort noise */
+
+struct fixture {
+	const char *name;
+	int frames;
+	int16_t *slin;
+	unsigned char *events;
+	int dtmfFrame;		/* Frame a DTMF digit comes in with, -1 for none */
+	int ringingFrame;	/* Frame a RINGING control comes in with, -1 for none */
+	int answerFrame;	/* Frame the call is answered at, 0 for answered from the start */
+	int hangup;		/* The caller hangs up when the audio runs out */
+	int greetingEnd;	/* Run with the g option */
+	int resume;		/* SPIT(...,r) right after a timeout, on the rest of the audio */
+	/* The verdict both modules have to come up with */
+	const char *status;
+	const char *cause;
+	const char *greetingEndCause;	/* With g, "" when the call returns on the verdict */
+	int heard;		/* With g, frames heard before the call returns */
+};
+
+struct adapter {
+	const char *name;
+	/* The read flags the module makes of the flags on an RTP frame */
+	int (*read_flags)(void);
+};
+
+static struct fixture fixtures[MAX_FIXTURES];
+static int numFixtures;
+
+/* app_spit.c has a flag for each, both are set on RTP frames */
+static int read_flags_modern(void)
+{
+	return SPIT_READ_SEQNO | SPIT_READ_TIMING;
+}
+
+/* 1.4 has no separate flag for the sequence number, it comes with the timing info */
+static int read_flags_14(void)
+{
+	return SPIT_READ_SEQNO | SPIT_READ_TIMING;
+}
+
+static const struct adapter adapters[] = {
+	{ "app_spit", read_flags_modern },
+	{ "app_spit14", read_flags_14 },
+};
+
+/* Of what the modules keep on the channel the replay only needs the engine, for SPIT(...,r) */
+static struct spit_engine saved;
+
+static void replay_store(struct spit_call *call)
+{
+	saved = call->engine;
+}
+
+static const struct spit_call_ops replay_ops = {
+	.store = replay_store,
+};
+
+/* Same speech like bursts as the bench and the simulator */
+static unsigned int seed = 12345;
+
+static int noise(int amplitude)
+{
+	seed = seed * 1103515245 + 12345;
+	return (int) ((seed >> 16) % (2 * amplitude + 1)) - amplitude;
+}
+
+static struct fixture *fixture_new(const char *name, int ms, const char *status, const char *cause)
+{
+	struct fixture *fx = &fixtures[numFixtures++];
+
+	fx->name = name;
+	fx->frames = ms / 20;
+	fx->slin = calloc(fx->frames * FRAME_SAMPLES, sizeof(int16_t));
+	fx->events = calloc(fx->frames, 1);
+	fx->dtmfFrame = -1;
+	fx->ringingFrame = -1;
+	fx->status = status;
+	fx->cause = cause;
+	fx->greetingEndCause = "";
+
+	return fx;
+}
+
+static void fixture_speech(struct fixture *fx, int fromMs, int toMs)
+{
+	int i;
+	double t, envelope;
+
+	for (i = fromMs * SPIT_SAMPLES_PER_MS; i < toMs * SPIT_SAMPLES_PER_MS && i < fx->frames * FRAME_SAMPLES; i++) {
+		t = (double) i / 8000;
+		envelope = 0.6 + 0.4 * sin(2 * M_PI * 4 * t);
+		fx->slin[i] = envelope * (4000 * sin(2 * M_PI * 140 * t) + 1500 * sin(2 * M_PI * 280 * t)) + noise(200);
+	}
+}
+
+static void fixture_events(struct fixture *fx, int fromMs, int toMs, int event)
+{
+	int f;
+
+	for (f = fromMs / 20; f < toMs / 20 && f < fx->frames; f++)
+		fx->events[f] = event;
+}
+
+static void fixture_finish(struct fixture *fx)
+{
+	int i;
+
+	for (i = 0; i < fx->frames * FRAME_SAMPLES; i++) {
+		if (!fx->slin[i])
+			fx->slin[i] = noise(40);
+	}
+}
+
+static void fixtures_builtin(void)
+{
+	struct fixture *fx;
+	int i;
+
+	/* "Hello?" and then waiting for us */
+	fx = fixture_new("human", 3000, "HUMAN", "SILENCEAFTERNOISE-800-800");
+	fixture_speech(fx, 300, 800);
+	fixture_finish(fx);
+
+	/* A greeting that goes on and on */
+	fx = fixture_new("machine", 6000, "MACHINE", "MAXWORDS-3-3");
+	for (i = 0; i < 6000; i += 450)
+		fixture_speech(fx, i, i + 350);
+	fixture_finish(fx);
+
+	/* Nobody says anything */
+	fx = fixture_new("silence", 6000, "HUMAN", "INITIALSILENCE-2500-2500");
+	fixture_finish(fx);
+
+	/* The human fixture over a leg that drops one packet in ten */
+	fx = fixture_new("lossy", 3000, "HUMAN", "SILENCEAFTERNOISE-800-800-LOSS-160-8");
+	fixture_speech(fx, 300, 800);
+	fixture_finish(fx);
+	for (i = 9; i < fx->frames; i += 10)
+		fx->events[i] = EV_LOST;
+
+	/* A dialer that answers with a tone, the cause is the digit on both modules */
+	fx = fixture_new("dtmf", 2000, "MACHINE", "DTMF-5");
+	fixture_speech(fx, 200, 400);
+	fixture_finish(fx);
+	fx->dtmfFrame = 25;
+
+	/* "Hello?" on a leg that stops sending while the caller is quiet, quiet is not loss */
+	fx = fixture_new("dtx", 3000, "HUMAN", "SILENCEAFTERNOISE-800-800");
+	fixture_speech(fx, 300, 800);
+	fixture_finish(fx);
+	fixture_events(fx, 800, 3000, EV_QUIET);
+
+	/* "Hello?" and comfort noise */
+	fx = fixture_new("cng", 3000, "HUMAN", "SILENCEAFTERNOISE-800-800");
+	fixture_speech(fx, 300, 800);
+	fixture_finish(fx);
+	fixture_events(fx, 800, 3000, EV_CNG);
+
+	/* Words too short to count, nothing definitive before the analysis time runs out */
+	fx = fixture_new("timeout", 7000, "MACHINE", "TIMEOUT-5000");
+	for (i = 300; i < 7000; i += 400)
+		fixture_speech(fx, i, i + 60);
+	fixture_finish(fx);
+
+	/* The same with g, a timeout heard no greeting and returns right away */
+	fx = fixture_new("timeout-g", 7000, "MACHINE", "TIMEOUT-5000");
+	for (i = 300; i < 7000; i += 400)
+		fixture_speech(fx, i, i + 60);
+	fixture_finish(fx);
+	fx->greetingEnd = 1;
+	fx->heard = 250;
+
+	/* A greeting with g, listened to until it goes quiet */
+	fx = fixture_new("machine-g", 8000, "MACHINE", "MAXWORDS-3-3");
+	for (i = 0; i < 4000; i += 450)
+		fixture_speech(fx, i, i + 350);
+	fixture_finish(fx);
+	fx->greetingEnd = 1;
+	fx->greetingEndCause = "SILENCE";
+	fx->heard = 273;
+
+	/* The same resumed after the timeout, the second run has its own analysis time */
+	fx = fixture_new("resume", 12000, "MACHINE", "TIMEOUT-10000");
+	for (i = 300; i < 12000; i += 400)
+		fixture_speech(fx, i, i + 60);
+	fixture_finish(fx);
+	fx->resume = 1;
+
+	/* Quiet early media, answered in a pause of the ringback, then "Hello?" */
+	fx = fixture_new("early", 6000, "HUMAN", "SILENCEAFTERNOISE-800-800");
+	fixture_speech(fx, 3300, 3800);
+	fixture_finish(fx);
+	fx->ringingFrame = 10;
+	fx->answerFrame = 150;
+
+	/* The caller hangs up on the greeting */
+	fx = fixture_new("hangup", 1000, "HANGUP", "");
+	fixture_speech(fx, 200, 1000);
+	fixture_finish(fx);
+	fx->hangup = 1;
+}
+
+/* Read the frames of the fixture from frame f on, as the frame loop of the module turns them into reads */
+static int replay_frames(const struct adapter *a, const struct fixture *fx, struct spit_call *call, int f)
+{
+	struct spit_engine *e = &call->engine;
+	struct spit_read frame;
+	int waited = 0;
+
+	for (; f < fx->frames; f++) {
+		if (!e->answered && f >= fx->answerFrame)
+			spit_engine_answer(e);
+		memset(&frame, 0, sizeof(frame));
+		if (f == fx->ringingFrame) {
+			frame.kind = SPIT_READ_RINGING;
+			if (spit_call_frame(call, &frame))
+				return f;
+		}
+		if (f == fx->dtmfFrame) {
+			/* AST_FRAME_DTMF_BEGIN and AST_FRAME_DTMF_END */
+			frame.kind = SPIT_READ_DTMF;
+			frame.digit = '5';
+			if (spit_call_frame(call, &frame) || spit_call_frame(call, &frame))
+				return f;
+		}
+
+		memset(&frame, 0, sizeof(frame));
+		switch (fx->events[f]) {
+		case EV_VOICE:
+			waited = 0;
+			frame.kind = SPIT_READ_VOICE;
+			frame.samples = fx->slin + f * FRAME_SAMPLES;
+			frame.nsamples = FRAME_SAMPLES;
+			frame.flags = a->read_flags();
+			frame.seqno = f & 0xffff;
+			frame.ts = f * 20;
+			break;
+		case EV_QUIET:
+			/* ast_waitfor() gives up and the null frame stands for the wait */
+			if ((waited += 20) >= 2 * e->maxWaitTimeForFrame) {
+				waited = 0;
+				frame.kind = SPIT_READ_NULL;
+				frame.waited = 1;
+			}
+			break;
+		case EV_CNG:
+			waited = 0;
+			frame.kind = SPIT_READ_CNG;
+			break;
+		}
+		if (spit_call_frame(call, &frame))
+			return f + 1;
+	}
+
+	if (fx->hangup) {
+		memset(&frame, 0, sizeof(frame));
+		frame.kind = SPIT_READ_HANGUP;
+		spit_call_frame(call, &frame);
+	}
+
+	return f;
+}
+
+/* One call, and a SPIT(...,r) on the rest of the audio for a resume fixture */
+static int replay(const struct adapter *a, const struct fixture *fx, char *status, int statuslen, char *cause,
+	int causelen, const char **greetingEndCause)
+{
+	struct spit_call call = { .ops = &replay_ops };
+	struct spit_params params;
+	struct spit_burst_hit burst = { "", 0 };
+	int f = 0;
+
+	spit_params_defaults(&params);
+	params.trackGreetingEnd = fx->greetingEnd;
+
+	if (spit_call_start(&call, &params, fx->answerFrame == 0, NULL, &burst) == SPIT_CALL_ANALYZE)
+		f = replay_frames(a, fx, &call, 0);
+	spit_call_finish(&call, 0);
+
+	if (fx->resume && call.engine.cause == SPIT_CAUSE_TIMEOUT) {
+		memset(&call, 0, sizeof(call));
+		call.ops = &replay_ops;
+		if (spit_call_start(&call, &params, 1, &saved, &burst) == SPIT_CALL_ANALYZE) {
+			f = replay_frames(a, fx, &call, f);
+			spit_call_finish(&call, 0);
+		}
+	}
+
+	snprintf(status, statuslen, "%s", call.status);
+	snprintf(cause, causelen, "%s", call.cause);
+	*greetingEndCause = spit_greeting_end_name(call.engine.greetingEndCause);
+
+	return f;
+}
+
+int main(void)
+{
+	char status[32], cause[256];
+	const char *end;
+	int n, i, heard, failed = 0;
+
+	fixtures_builtin();
+
+	printf("%-10s %-12s %-8s %s\n", "Fixture", "Module", "Status", "Cause");
+	for (n = 0; n < numFixtures; n++) {
+		for (i = 0; i < (int) (sizeof(adapters) / sizeof(adapters[0])); i++) {
+			heard = replay(&adapters[i], &fixtures[n], status, sizeof(status), cause, sizeof(cause), &end);
+			printf("%-10s %-12s %-8s %s%s%s\n", fixtures[n].name, adapters[i].name, status, cause,
+				*end ? " greeting end " : "", end);
+			if (strcmp(status, fixtures[n].status) || strcmp(cause, fixtures[n].cause)) {
+				fprintf(stderr, "%s on %s: expected %s %s\n", fixtures[n].name, adapters[i].name,
+					fixtures[n].status, fixtures[n].cause);
+				failed = 1;
+			}
+			if (fixtures[n].greetingEnd && (strcmp(end, fixtures[n].greetingEndCause) || heard != fixtures[n].heard)) {
+				fprintf(stderr, "%s on %s: greeting end %s after %d frames, expected %s after %d\n",
+					fixtures[n].name, adapters[i].name, end, heard, fixtures[n].greetingEndCause, fixtures[n].heard);
+				failed = 1;
+			}
+		}
+	}
+
+	return failed;
+}
@@ -0,0 +1,459 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Columnar analytics log of SPIT analyses
+ *
+ * Like the engine this file does not include any Asterisk header. Link it
+ * next to spit_engine.c, see there.
+ *
+ * \author Justin Zimmer (jzimmer@leasehawk.com)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "spit_analytics.h"
+
+/* A slot of the ring. seq is the position the slot is free for, one past it once the record is in. */
+struct analytics_slot {
+	unsigned int seq;
+	struct spit_record record;
+};
+
+struct spit_column {
+	const char *name;
+	uint16_t offset;
+	uint16_t width;
+};
+
+#define COLUMN(name, field) { name, offsetof(struct spit_record, field), sizeof(((struct spit_record *) 0)->field) }
+
+/* The file format, ids are the index in this table. Only ever add to the end. */
+static const struct spit_column columns[] = {
+	COLUMN("start", start),
+	COLUMN("latency", latency),
+	COLUMN("cpu", cpu),
+	COLUMN("profile", profile),
+	COLUMN("status", status),
+	COLUMN("cause", cause),
+	COLUMN("cause_arg0", causeArgs[0]),
+	COLUMN("cause_arg1", causeArgs[1]),
+	COLUMN("answered", answered),
+	COLUMN("ani", ani),
+	COLUMN("voiceduration", features.voiceDuration),
+	COLUMN("words", features.words),
+	COLUMN("shortwords", features.shortWords),
+	COLUMN("longestword", features.longestWord),
+	COLUMN("initialsilence", features.initialSilence),
+	COLUMN("longestsilence", features.longestSilence),
+	COLUMN("gaps", features.gaps),
+	COLUMN("analysistime", features.analysisTime),
+	COLUMN("earlytime", features.earlyTime),
+	COLUMN("lost", features.lost),
+	COLUMN("lossgaps", features.lossGaps),
+	COLUMN("burstcalls", features.burstCalls),
+	COLUMN("bargein", features.bargeIn),
+	COLUMN("echo", features.echoTime),
+	COLUMN("modulation", features.modulation),
+	COLUMN("pitchjitter", features.pitchJitter),
+	COLUMN("timeline", timeline),
+};
+
+#define NUM_COLUMNS         (sizeof(columns) / sizeof(columns[0]))
+#define BLOCK_HEADER        (8 + 4 + 4 + NUM_COLUMNS * (4 + SPIT_ANALYTICS_NAME_LEN))
+
+static struct spit_analytics_config analyticsConfig;
+static int analyticsEnabled;
+
+static pthread_mutex_t analyticsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t analyticsCond = PTHREAD_COND_INITIALIZER;
+
+/* Records waiting for the writer. Channel threads take a slot at ringHead without a lock,
+   the writer alone takes them off at ringTail. Allocated when the log is first turned on. */
+static struct analytics_slot *ring;
+static unsigned int ringHead;
+static unsigned int ringTail;
+
+static pthread_t writerThread;
+static int writerRunning;
+static int writerStop;
+static int writerReopen;
+
+static struct spit_analytics_stats analyticsStats;
+
+static int64_t analytics_now(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (int64_t) now.tv_sec * 1000 + now.tv_usec / 1000;
+}
+
+void spit_analytics_defaults(struct spit_analytics_config *config)
+{
+	memset(config, 0, sizeof(*config));
+	strcpy(config->directory, "/var/log/asterisk/spit");
+	config->rotateSize = 64;
+	config->rotateInterval = 3600;
+	config->flushInterval = 1000;
+	config->maxPending = 4096;
+}
+
+int spit_analytics_config_apply(struct spit_analytics_config *config, const char *name, const char *value)
+{
+	if (!strcasecmp(name, "enabled")) {
+		config->enabled = spit_true(value);
+	} else if (!strcasecmp(name, "directory")) {
+		snprintf(config->directory, sizeof(config->directory), "%s", value);
+	} else if (!strcasecmp(name, "rotate_size")) {
+		config->rotateSize = atoi(value);
+	} else if (!strcasecmp(name, "rotate_interval")) {
+		config->rotateInterval = atoi(value);
+	} else if (!strcasecmp(name, "flush_interval")) {
+		config->flushInterval = atoi(value);
+	} else if (!strcasecmp(name, "max_pending")) {
+		config->maxPending = atoi(value);
+	} else {
+		return -1;
+	}
+
+	return 0;
+}
+
+int spit_analytics_enabled(void)
+{
+	return __atomic_load_n(&analyticsEnabled, __ATOMIC_RELAXED);
+}
+
+int64_t spit_analytics_cpu(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts))
+		return 0;
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* FNV-1a over the parameters a word at a time, they are all ints. Analyses that ran
+   with the same settings share a profile. */
+static uint32_t analytics_profile(const struct spit_params *params)
+{
+	const int *p = (const int *) params;
+	uint32_t hash = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < sizeof(*params) / sizeof(int); i++) {
+		hash ^= (uint32_t) p[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+void spit_analytics_log(const struct spit_engine *e, const struct spit_features *features,
+	const char *ani, int64_t start, int cpu)
+{
+	struct analytics_slot *slot;
+	struct spit_record *r;
+	unsigned int pos, seq;
+	int i;
+
+	if (!spit_analytics_enabled())
+		return;
+	__atomic_fetch_add(&analyticsStats.records, 1, __ATOMIC_RELAXED);
+
+	/* Take the slot at the head, unless the writer is max_pending records behind */
+	pos = __atomic_load_n(&ringHead, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &ring[pos % SPIT_ANALYTICS_RING];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq != pos || (int) (pos - __atomic_load_n(&ringTail, __ATOMIC_RELAXED))
+			>= __atomic_load_n(&analyticsConfig.maxPending, __ATOMIC_RELAXED)) {
+			if ((int) (seq - pos) > 0) {
+				/* Another thread took it first */
+				pos = __atomic_load_n(&ringHead, __ATOMIC_RELAXED);
+				continue;
+			}
+			__atomic_fetch_add(&analyticsStats.dropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		if (__atomic_compare_exchange_n(&ringHead, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+	}
+
+	r = &slot->record;
+	r->start = start;
+	r->latency = features->decisionTime;
+	r->cpu = cpu;
+	r->profile = analytics_profile(&e->params);
+	r->status = e->status;
+	r->cause = e->cause;
+	r->causeArgs[0] = e->causeArgs[0];
+	r->causeArgs[1] = e->causeArgs[1];
+	r->answered = e->answered;
+	strncpy(r->ani, ani ? ani : "", sizeof(r->ani));
+	r->features = *features;
+	for (i = 0; i < SPIT_TIMELINE; i++) {
+		r->timeline[i * 2] = i < e->timelineCount || (i == e->timelineCount && e->timelineOpen) ? e->timelineStart[i] : 0;
+		r->timeline[i * 2 + 1] = i < e->timelineCount ? e->timelineLength[i] : 0;
+	}
+	/* A word still going on when the verdict came is as long as we heard it */
+	if (e->timelineOpen && e->timelineCount < SPIT_TIMELINE)
+		r->timeline[e->timelineCount * 2 + 1] = e->consecutiveVoiceDuration / 10;
+
+	/* The record is there for the writer */
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+/* What the writer keeps between blocks */
+struct analytics_file {
+	int fd;
+	int reopen;
+	int64_t opened;
+	off_t size;
+	char path[sizeof(((struct spit_analytics_stats *) 0)->file)];
+};
+
+/* Open the next file when there is none, it got too big or too old */
+static int analytics_rotate(struct analytics_file *file, const struct spit_analytics_config *config, int64_t now)
+{
+	char name[64];
+	struct tm tm;
+	time_t t = now / 1000;
+
+	if (file->fd >= 0 && !file->reopen
+		&& (config->rotateSize <= 0 || file->size < (off_t) config->rotateSize * 1024 * 1024)
+		&& (config->rotateInterval <= 0 || now - file->opened < (int64_t) config->rotateInterval * 1000))
+		return 0;
+
+	if (file->fd >= 0)
+		close(file->fd);
+	file->reopen = 0;
+	file->opened = now;
+	file->size = 0;
+	file->path[0] = '\0';
+
+	if (mkdir(config->directory, 0755) && errno != EEXIST)
+		return -1;
+
+	localtime_r(&t, &tm);
+	strftime(name, sizeof(name), "spit-%Y%m%d-%H%M%S.col", &tm);
+	snprintf(file->path, sizeof(file->path), "%s/%s", config->directory, name);
+	if ((file->fd = open(file->path, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0) {
+		file->path[0] = '\0';
+		return -1;
+	}
+
+	return 1;
+}
+
+/* Take the records that are in off the ring, in order. A slot still being filled in
+   stops the writer there, the rest waits for the next round. Writer only. */
+static uint32_t analytics_take(struct spit_record *records)
+{
+	struct analytics_slot *slot;
+	uint32_t count = 0;
+	unsigned int pos = ringTail;
+
+	for (;;) {
+		slot = &ring[pos % SPIT_ANALYTICS_RING];
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1)
+			break;
+		records[count++] = slot->record;
+		/* Free for the producer one time around the ring later */
+		__atomic_store_n(&slot->seq, pos + SPIT_ANALYTICS_RING, __ATOMIC_RELEASE);
+		pos++;
+	}
+	__atomic_store_n(&ringTail, pos, __ATOMIC_RELAXED);
+
+	return count;
+}
+
+/* Turn the records into one block of columns */
+static size_t analytics_block(unsigned char *block, const struct spit_record *records, uint32_t count)
+{
+	unsigned char *p = block;
+	uint32_t numColumns = NUM_COLUMNS, j;
+	uint16_t id, width;
+	size_t i;
+
+	memcpy(p, SPIT_ANALYTICS_MAGIC, 8);
+	memcpy(p + 8, &count, 4);
+	memcpy(p + 12, &numColumns, 4);
+	p += 16;
+	for (i = 0; i < NUM_COLUMNS; i++) {
+		id = i;
+		width = columns[i].width;
+		memcpy(p, &id, 2);
+		memcpy(p + 2, &width, 2);
+		memset(p + 4, 0, SPIT_ANALYTICS_NAME_LEN);
+		strncpy((char *) p + 4, columns[i].name, SPIT_ANALYTICS_NAME_LEN - 1);
+		p += 4 + SPIT_ANALYTICS_NAME_LEN;
+	}
+
+	for (i = 0; i < NUM_COLUMNS; i++) {
+		for (j = 0; j < count; j++) {
+			memcpy(p, (const char *) &records[j] + columns[i].offset, columns[i].width);
+			p += columns[i].width;
+		}
+	}
+
+	return p - block;
+}
+
+static void *analytics_writer(void *data __attribute__((unused)))
+{
+	struct spit_analytics_config config;
+	struct analytics_file file = { .fd = -1 };
+	struct spit_record *records;
+	unsigned char *block;
+	size_t len = 0;
+	struct timespec ts;
+	int64_t deadline;
+	uint32_t count;
+	int stop, opened, written;
+
+	records = malloc(SPIT_ANALYTICS_RING * sizeof(*records));
+	block = malloc(BLOCK_HEADER + SPIT_ANALYTICS_RING * sizeof(*records));
+
+	pthread_mutex_lock(&analyticsLock);
+	for (;;) {
+		deadline = analytics_now() + (analyticsConfig.flushInterval > 0 ? analyticsConfig.flushInterval : 1000);
+		ts.tv_sec = deadline / 1000;
+		ts.tv_nsec = (deadline % 1000) * 1000000;
+		while (!writerStop && analytics_now() < deadline)
+			pthread_cond_timedwait(&analyticsCond, &analyticsLock, &ts);
+
+		stop = writerStop;
+		config = analyticsConfig;
+		file.reopen |= writerReopen;
+		writerReopen = 0;
+		pthread_mutex_unlock(&analyticsLock);
+
+		/* On the way out too, what the channels logged before the log was turned off is written */
+		opened = written = 0;
+		count = records && block ? analytics_take(records) : 0;
+		if (count && (opened = analytics_rotate(&file, &config, analytics_now())) >= 0) {
+			len = analytics_block(block, records, count);
+			/* One write per block keeps blocks whole for readers of a file still growing */
+			if (write(file.fd, block, len) == (ssize_t) len) {
+				file.size += len;
+				written = 1;
+			} else {
+				file.reopen = 1;
+			}
+		}
+
+		pthread_mutex_lock(&analyticsLock);
+		if (opened > 0)
+			analyticsStats.files++;
+		if (count && written) {
+			analyticsStats.written += count;
+			analyticsStats.bytes += len;
+		} else if (count) {
+			analyticsStats.errors += count;
+		}
+		strcpy(analyticsStats.file, file.path);
+		if (stop)
+			break;
+	}
+	pthread_mutex_unlock(&analyticsLock);
+
+	if (file.fd >= 0)
+		close(file.fd);
+	free(records);
+	free(block);
+
+	return NULL;
+}
+
+static void analytics_stop(void)
+{
+	pthread_mutex_lock(&analyticsLock);
+	if (!writerRunning) {
+		pthread_mutex_unlock(&analyticsLock);
+		return;
+	}
+	writerStop = 1;
+	pthread_cond_signal(&analyticsCond);
+	pthread_mutex_unlock(&analyticsLock);
+
+	pthread_join(writerThread, NULL);
+
+	pthread_mutex_lock(&analyticsLock);
+	writerRunning = 0;
+	writerStop = 0;
+	analyticsStats.file[0] = '\0';
+	pthread_mutex_unlock(&analyticsLock);
+}
+
+void spit_analytics_configure(const struct spit_analytics_config *config)
+{
+	unsigned int i;
+
+	if (config->enabled && !ring && (ring = malloc(SPIT_ANALYTICS_RING * sizeof(*ring)))) {
+		for (i = 0; i < SPIT_ANALYTICS_RING; i++)
+			ring[i].seq = i;
+	}
+
+	if (!config->enabled || !ring) {
+		__atomic_store_n(&analyticsEnabled, 0, __ATOMIC_RELAXED);
+		analytics_stop();
+		pthread_mutex_lock(&analyticsLock);
+		analyticsConfig = *config;
+		pthread_mutex_unlock(&analyticsLock);
+		return;
+	}
+
+	pthread_mutex_lock(&analyticsLock);
+	if (strcmp(analyticsConfig.directory, config->directory))
+		writerReopen = 1;
+	analyticsConfig = *config;
+	if (!writerRunning && !pthread_create(&writerThread, NULL, analytics_writer, NULL))
+		writerRunning = 1;
+	pthread_mutex_unlock(&analyticsLock);
+
+	__atomic_store_n(&analyticsEnabled, writerRunning, __ATOMIC_RELAXED);
+}
+
+void spit_analytics_get_stats(struct spit_analytics_stats *stats)
+{
+	pthread_mutex_lock(&analyticsLock);
+	*stats = analyticsStats;
+	stats->records = __atomic_load_n(&analyticsStats.records, __ATOMIC_RELAXED);
+	stats->dropped = __atomic_load_n(&analyticsStats.dropped, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&analyticsLock);
+}
+
+void spit_analytics_shutdown(void)
+{
+	/* The writer empties the ring before it stops, no channel logs any more by now */
+	__atomic_store_n(&analyticsEnabled, 0, __ATOMIC_RELAXED);
+	analytics_stop();
+
+	free(ring);
+	ring = NULL;
+	ringHead = ringTail = 0;
+}
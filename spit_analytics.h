@@ -0,0 +1,118 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Columnar analytics log of SPIT analyses
+ *
+ * Every analysis can leave one fixed size record behind. Records go into
+ * a ring shared by all channel threads without a lock, and a writer thread
+ * takes what is in every flush_interval, turns it into a block of columns
+ * and appends it to the current file. The channel thread never touches
+ * the disk and never waits for the writer.
+ *
+ * A file is a sequence of blocks. Each block starts with the magic
+ * "SPITCOL1", a uint32 record count and a uint32 column count, followed by
+ * one header per column (uint16 id, uint16 width, 24 byte name) and then
+ * the values of each column for all records of the block, column after
+ * column. Values are in host byte order.
+ *
+ * \author Justin Zimmer (jzimmer@leasehawk.com)
+ */
+
+#ifndef _SPIT_ANALYTICS_H
+#define _SPIT_ANALYTICS_H
+
+#include <stdint.h>
+
+#include "spit_engine.h"
+
+#define SPIT_ANALYTICS_MAGIC        "SPITCOL1"
+#define SPIT_ANALYTICS_NAME_LEN     24
+#define SPIT_ANALYTICS_ANI_LEN      16
+
+/* Records the ring holds for the writer, max_pending can only be lower */
+#define SPIT_ANALYTICS_RING         4096
+
+struct spit_analytics_config {
+	int enabled;
+	char directory[256];
+	int rotateSize;		/* MB per file */
+	int rotateInterval;	/* Seconds per file */
+	int flushInterval;	/* ms between writes */
+	int maxPending;		/* Records waiting for the writer before new ones are dropped */
+};
+
+/* One analysis, the columns of the file */
+struct spit_record {
+	int64_t start;		/* ms since the epoch SPIT started */
+	int32_t latency;	/* ms from the start to the verdict */
+	int32_t cpu;		/* us of CPU the analysis took */
+	uint32_t profile;	/* Hash of the parameters the analysis ran with */
+	int32_t causeArgs[2];
+	uint8_t status;
+	uint8_t cause;
+	uint8_t answered;
+	char ani[SPIT_ANALYTICS_ANI_LEN];
+	struct spit_features features;
+	uint16_t timeline[SPIT_TIMELINE * 2];	/* Start and length of the first words in 10ms */
+};
+
+struct spit_analytics_stats {
+	uint64_t records;	/* Logged since the module was loaded */
+	uint64_t written;
+	uint64_t dropped;
+	uint64_t errors;	/* Failed writes, their records are lost */
+	uint64_t bytes;
+	unsigned int files;
+	char file[512];		/* File currently written to, empty when none is open */
+};
+
+/*! \brief Fill in the built in defaults */
+void spit_analytics_defaults(struct spit_analytics_config *config);
+
+/*!
+ * \brief Apply one setting of the [analytics] section of spit.conf
+ * \retval 0 the setting was known and applied
+ * \retval -1 unknown keyword
+ */
+int spit_analytics_config_apply(struct spit_analytics_config *config, const char *name, const char *value);
+
+/*! \brief Use a new configuration, starts or stops the writer thread as needed */
+void spit_analytics_configure(const struct spit_analytics_config *config);
+
+/*! \brief Whether records are being logged */
+int spit_analytics_enabled(void);
+
+/*! \brief CPU time used by the calling thread in us, for the cpu column */
+int64_t spit_analytics_cpu(void);
+
+/*!
+ * \brief Log the analysis of an engine that reached its verdict
+ * \param e the engine
+ * \param features what the analysis measured, decisionTime is the latency
+ * \param ani caller ANI, can be NULL
+ * \param start ms since the epoch SPIT started
+ * \param cpu us of CPU the analysis took
+ */
+void spit_analytics_log(const struct spit_engine *e, const struct spit_features *features,
+	const char *ani, int64_t start, int cpu);
+
+/*! \brief Copy out the counters of the analytics log */
+void spit_analytics_get_stats(struct spit_analytics_stats *stats);
+
+/*! \brief Write what is queued and stop the writer thread */
+void spit_analytics_shutdown(void);
+
+#endif /* _SPIT_ANALYTICS_H */
@@ -0,0 +1,141 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief The course of a SPIT() call, shared by app_spit and app_spit14
+ *
+ * Like the engine this file does not include any Asterisk header. Link it
+ * next to spit_engine.c, see there.
+ *
+ * \author Justin Zimmer (jzimmer@leasehawk.com)
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "spit_call.h"
+#include "spit_analytics.h"
+
+enum spit_call_next spit_call_start(struct spit_call *call, const struct spit_params *params, int answered,
+	const struct spit_engine *state, const struct spit_burst_hit *burst)
+{
+	struct spit_engine *e = &call->engine;
+	const struct spit_params *p = &e->params;
+
+	call->cpu = spit_analytics_enabled() ? spit_analytics_cpu() : 0;
+	call->resumed = state != NULL;
+	if (state)
+		*e = *state;
+	else
+		spit_engine_init(e, params, answered);
+	e->log = call->log;
+	e->logData = call->chan;
+	e->logLevel = call->logLevel;
+
+	if (call->resumed && spit_engine_resume(e, params, answered)) {
+		/* The earlier run decided, its verdict was counted, logged and kept for SPIT_FEEDBACK() then */
+		spit_engine_format(e, call->status, sizeof(call->status), call->cause, sizeof(call->cause));
+		if (call->ops->set_verdict)
+			call->ops->set_verdict(call);
+		return SPIT_CALL_DONE;
+	}
+
+	/* Calls from a prefix that is bursting get decided right away or analyzed with the strict profile.
+	   A resumed analysis had its burst check in the first run and keeps its profile. */
+	if (!call->resumed && spit_engine_burst(e, burst))
+		return e->endTracking ? SPIT_CALL_GREETING : SPIT_CALL_FINISH;
+
+	/* Now we're ready to roll! */
+	if (e->logLevel >= SPIT_LOG_VERBOSE && e->log) {
+		e->log(e->logData, "initialSilence [%d] greeting [%d] afterGreetingSilence [%d] totalAnalysisTime [%d] "
+			"minimumWordLength [%d] betweenWordsSilence [%d] maximumNumberOfWords [%d] silenceThreshold [%d] "
+			"maximumWordLength [%d]", p->initialSilence, p->greeting, p->afterGreetingSilence, p->totalAnalysisTime,
+			p->minimumWordLength, p->betweenWordsSilence, p->maximumNumberOfWords, p->silenceThreshold,
+			p->maximumWordLength);
+	}
+
+	return SPIT_CALL_ANALYZE;
+}
+
+int spit_call_frame(struct spit_call *call, const struct spit_read *frame)
+{
+	struct spit_engine *e = &call->engine;
+	struct spit_frame_info info;
+	struct spit_progress progress;
+
+	switch (frame->kind) {
+	case SPIT_READ_VOICE:
+		/* Reading the frame includes translating it to signed linear */
+		if (frame->ingest)
+			spit_engine_perf(e, SPIT_STAGE_INGEST, spit_cycles() - frame->ingest, frame->nsamples);
+		info.hasSeqno = frame->flags & SPIT_READ_SEQNO ? 1 : 0;
+		info.seqno = frame->seqno;
+		info.hasTimestamp = frame->flags & SPIT_READ_TIMING ? 1 : 0;
+		info.ts = frame->ts;
+		spit_engine_audio(e, frame->samples, frame->nsamples, &info);
+		break;
+	case SPIT_READ_CNG:
+		spit_engine_comfort_noise(e);
+		break;
+	case SPIT_READ_DTMF:
+		spit_engine_dtmf(e, frame->digit);
+		break;
+	case SPIT_READ_RINGING:
+		spit_engine_ringback(e);
+		break;
+	case SPIT_READ_NULL:
+		/* A null frame only stands for time if we gave up waiting for media */
+		if (frame->waited)
+			spit_engine_timeout(e);
+		break;
+	case SPIT_READ_HANGUP:
+		spit_engine_hangup(e);
+		break;
+	default:
+		break;
+	}
+
+	if (e->params.progressEvents && call->ops->progress && spit_engine_progress(e, &progress))
+		call->ops->progress(call, &progress);
+
+	return frame->kind == SPIT_READ_HANGUP || (e->status && !e->endTracking);
+}
+
+void spit_call_finish(struct spit_call *call, int64_t now)
+{
+	struct spit_engine *e = &call->engine;
+	struct spit_progress progress;
+	uint64_t verdict;
+
+	spit_engine_noframes(e);
+
+	verdict = spit_cycles();
+	spit_engine_format(e, call->status, sizeof(call->status), call->cause, sizeof(call->cause));
+	if (call->ops->set_verdict)
+		call->ops->set_verdict(call);
+	if (e->params.progressEvents && call->ops->progress && spit_engine_progress(e, &progress))
+		call->ops->progress(call, &progress);
+	if (e->params.perfCounters)
+		spit_engine_perf(e, SPIT_STAGE_VERDICT, spit_cycles() - verdict, 0);
+	spit_perf_commit(e);
+
+	/* Keep the measurements around, they are only formatted if SPIT_FEATURES() asks for them */
+	spit_engine_features(e, &call->features);
+	call->features.decisionTime = now - call->start;
+	call->ops->store(call);
+
+	if (spit_analytics_enabled())
+		spit_analytics_log(e, &call->features, call->ani, call->start, spit_analytics_cpu() - call->cpu);
+}
@@ -0,0 +1,125 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief The course of a SPIT() call, shared by app_spit and app_spit14
+ *
+ * Everything a module does for an analysis that does not need the channel:
+ * starting or resuming it, the burst check, what each frame read from the
+ * channel means to the engine, and the verdict, counters, features and
+ * analytics record at the end. The module reads the frames, converts them
+ * to signed linear and keeps the results on the channel through struct
+ * spit_call_ops. Like the engine this file does not include any Asterisk
+ * header, link it next to spit_engine.c.
+ *
+ * \author Justin Zimmer (jzimmer@leasehawk.com)
+ */
+
+#ifndef _SPIT_CALL_H
+#define _SPIT_CALL_H
+
+#include <stdint.h>
+
+#include "spit_engine.h"
+#include "spit_tuning.h"
+
+/* What a frame read from the channel is to the engine */
+enum spit_read_kind {
+	SPIT_READ_OTHER = 0,	/* Nothing the engine looks at */
+	SPIT_READ_VOICE,	/* Signed linear audio */
+	SPIT_READ_CNG,		/* Comfort noise */
+	SPIT_READ_DTMF,		/* Begin or end of a digit */
+	SPIT_READ_RINGING,	/* Ringback control */
+	SPIT_READ_NULL,		/* A null frame, time only when the wait for media gave up */
+	SPIT_READ_HANGUP,	/* No frame, the channel hung up */
+};
+
+/* What the channel driver set on a voice frame */
+#define SPIT_READ_SEQNO         (1 << 0)	/* seqno is the RTP sequence number */
+#define SPIT_READ_TIMING        (1 << 1)	/* ts is the RTP timestamp in ms */
+
+struct spit_read {
+	enum spit_read_kind kind;
+	const int16_t *samples;
+	int nsamples;
+	int flags;
+	int seqno;
+	long ts;
+	int digit;
+	int waited;		/* The null frame came because the wait for media gave up */
+	uint64_t ingest;	/* spit_cycles() before the frame was read, 0 when not measured */
+};
+
+struct spit_call;
+
+/* The channel side of a call, each module has its own */
+struct spit_call_ops {
+	/*! Set SPITSTATUS, SPITCAUSE, SPITPHASE and the greeting end from the engine and call->status and cause, NULL for none */
+	void (*set_verdict)(struct spit_call *call);
+	/*! Send a SPITProgress event, NULL for none */
+	void (*progress)(struct spit_call *call, const struct spit_progress *progress);
+	/*! Keep call->features, the engine for a later resume and the sample for SPIT_FEEDBACK() on the channel */
+	void (*store)(struct spit_call *call);
+};
+
+struct spit_call {
+	struct spit_engine engine;
+	const struct spit_call_ops *ops;
+	void *chan;		/* Handed to the engine log, the ops find it in the call */
+	void (*log)(void *data, const char *fmt, ...);
+	int logLevel;
+	const char *ani;	/* For the analytics log, can be NULL */
+	char trunk[SPIT_TUNING_NAME_LEN];	/* Tuned and counted for this trunk, empty for none */
+	int64_t start;		/* ms since the epoch SPIT started */
+	int64_t cpu;		/* CPU time used by the thread when it started, with analytics */
+	int resumed;
+	char status[32];	/* The verdict as set on the channel */
+	char cause[256];
+	struct spit_features features;	/* What the analysis measured, filled in by spit_call_finish() */
+};
+
+/* What the module does after spit_call_start() */
+enum spit_call_next {
+	SPIT_CALL_DONE,		/* The verdict of an earlier run is set again, nothing more to do */
+	SPIT_CALL_ANALYZE,	/* Read frames */
+	SPIT_CALL_GREETING,	/* Decided on the burst, read frames for the end of the greeting only */
+	SPIT_CALL_FINISH,	/* Decided on the burst, spit_call_finish() right away */
+};
+
+/*!
+ * \brief Start the analysis of a call, or resume the one an earlier run left
+ * \param call ops, chan, log, logLevel, ani, trunk and start filled in
+ * \param params parameters of this run
+ * \param answered whether the channel is answered
+ * \param state engine the earlier run left on the channel, NULL to start over
+ * \param burst where the caller's prefix stands in the burst window
+ */
+enum spit_call_next spit_call_start(struct spit_call *call, const struct spit_params *params, int answered,
+	const struct spit_engine *state, const struct spit_burst_hit *burst);
+
+/*!
+ * \brief Hand the engine a frame read from the channel
+ * \retval 1 the module stops reading, the verdict is in and the greeting end is not awaited
+ * \retval 0 read on
+ */
+int spit_call_frame(struct spit_call *call, const struct spit_read *frame);
+
+/*!
+ * \brief The frames stopped, set the verdict and keep what the analysis found
+ * \param now ms since the epoch
+ */
+void spit_call_finish(struct spit_call *call, int64_t now);
+
+#endif /* _SPIT_CALL_H */
@@ -0,0 +1,1840 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2003 - 2006, Aheeva Technology.
+ *
+ * Claude Klimos (claude.klimos@aheeva.com)
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ *
+ * A license has been granted to Digium (via disclaimer) for the use of
+ * this code.
+ */
+
+/*! \file
+ *
+ * \brief Automated Dialer detection engine shared by app_spit and app_spit14
+ *
+ * This file does not include any Asterisk header so the same object can be
+ * linked into the module for every Asterisk version. In the Asterisk tree add
+ * it to the module with
+ * $(call MOD_ADD_C,app_spit,spit_engine.c spit_call.c spit_analytics.c spit_remote.c spit_tuning.c)
+ * in apps/Makefile, for Asterisk 1.4 list spit_engine.o, spit_call.o,
+ * spit_analytics.o, spit_remote.o and spit_tuning.o as dependencies of
+ * app_spit14.so.
+ *
+ * \author Claude Klimos (claude.klimos@aheeva.com)
+ * \author Justin Zimmer (jzimmer@leasehawk.com)
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "spit_engine.h"
+
+/* Upper bound for the time we wait for a frame, lowered to the smallest ms parameter */
+#define SPIT_MAX_WAIT_FOR_FRAME     50
+
+/* Pitch lags we search at 4kHz, 400 Hz down to 75 Hz */
+#define PITCH_MIN_LAG               10
+#define PITCH_MAX_LAG               53
+/* Samples compared at each lag */
+#define PITCH_WINDOW                80
+
+/* 2cos(w) in 1/4096 for the tones we take for a beep, 300 Hz down to 3000 Hz, and
+   how far it may drift from frame to frame, about 20 Hz around 1 kHz */
+#define BEEP_MAX_COEFF              7966
+#define BEEP_MIN_COEFF              -5793
+#define BEEP_DRIFT                  100
+
+/* Analysis time needed before we judge the loss percentage */
+#define LOSS_MIN_ANALYSIS_TIME      1000
+
+/* Size of the burst sketches, see spit_burst_record() */
+#define BURST_DEPTH                 4
+#define BURST_WIDTH                 512
+#define BURST_SLOTS                 8
+
+#define spit_verb(e, ...) do { \
+	if ((e)->logLevel >= SPIT_LOG_VERBOSE && (e)->log) \
+		(e)->log((e)->logData, __VA_ARGS__); \
+} while (0)
+
+#define spit_debug(e, ...) do { \
+	if ((e)->logLevel >= SPIT_LOG_DEBUG && (e)->log) \
+		(e)->log((e)->logData, __VA_ARGS__); \
+} while (0)
+
+void spit_params_defaults(struct spit_params *params)
+{
+	params->initialSilence       = 2500;
+	params->greeting             = 1500;
+	params->afterGreetingSilence = 800;
+	params->totalAnalysisTime    = 5000;
+	params->minimumWordLength    = 100;
+	params->betweenWordsSilence  = 50;
+	params->maximumNumberOfWords = 3;
+	params->silenceThreshold     = 256;
+	params->maximumWordLength    = 5000; /* Setting this to a large default so it is not used unless specify it in the configs or command line */
+	params->earlyMediaTimeout    = 30000;
+	params->lossTolerance        = 200;
+	params->maxLossPercent       = 30;
+	params->echoReturnLoss       = 12;
+	params->bargeInSilence       = 400;
+	params->perfCounters         = 0;
+	params->synthetic            = 0;
+	params->syntheticMinVoice    = 600;
+	params->syntheticModulation  = 55;
+	params->syntheticPitchJitter = 25;
+	params->trackGreetingEnd     = 0;
+	params->greetingEndSilence   = 1500;
+	params->greetingEndTimeout   = 20000;
+	params->beepMinLength        = 100;
+	params->progressEvents       = 0;
+	params->progressInterval     = 250;
+}
+
+int spit_true(const char *value)
+{
+	return !strcasecmp(value, "yes") || !strcasecmp(value, "true") || !strcasecmp(value, "y")
+		|| !strcasecmp(value, "t") || !strcasecmp(value, "1") || !strcasecmp(value, "on");
+}
+
+/* Parse a comma separated list of ANI prefix lengths for the burst sketches, bad lengths are skipped */
+static int spit_burst_parse_prefixes(struct spit_burst_config *burst, const char *value)
+{
+	const char *item = value;
+	int len, res = 0;
+
+	burst->numPrefixes = 0;
+	while (item && *item && burst->numPrefixes < BURST_MAX_PREFIXES) {
+		len = atoi(item);
+		if (len >= 1 && len <= BURST_MAX_PREFIX_LEN)
+			burst->prefixes[burst->numPrefixes++] = len;
+		else
+			res = -1;
+		if ((item = strchr(item, ',')))
+			item++;
+	}
+
+	return res;
+}
+
+/* The [general] settings of spit.conf. spitd gets its parameters under the same names. */
+static const struct {
+	const char *name;
+	size_t offset;
+	int boolean;
+} spit_param_keys[] = {
+	{ "initial_silence",         offsetof(struct spit_params, initialSilence), 0 },
+	{ "greeting",                offsetof(struct spit_params, greeting), 0 },
+	{ "after_greeting_silence",  offsetof(struct spit_params, afterGreetingSilence), 0 },
+	{ "silence_threshold",       offsetof(struct spit_params, silenceThreshold), 0 },
+	{ "total_analysis_time",     offsetof(struct spit_params, totalAnalysisTime), 0 },
+	{ "min_word_length",         offsetof(struct spit_params, minimumWordLength), 0 },
+	{ "between_words_silence",   offsetof(struct spit_params, betweenWordsSilence), 0 },
+	{ "maximum_number_of_words", offsetof(struct spit_params, maximumNumberOfWords), 0 },
+	{ "maximum_word_length",     offsetof(struct spit_params, maximumWordLength), 0 },
+	{ "early_media_timeout",     offsetof(struct spit_params, earlyMediaTimeout), 0 },
+	{ "loss_tolerance",          offsetof(struct spit_params, lossTolerance), 0 },
+	{ "max_loss_percent",        offsetof(struct spit_params, maxLossPercent), 0 },
+	{ "echo_return_loss",        offsetof(struct spit_params, echoReturnLoss), 0 },
+	{ "barge_in_silence",        offsetof(struct spit_params, bargeInSilence), 0 },
+	{ "perf_counters",           offsetof(struct spit_params, perfCounters), 1 },
+	{ "synthetic",               offsetof(struct spit_params, synthetic), 1 },
+	{ "synthetic_min_voice",     offsetof(struct spit_params, syntheticMinVoice), 0 },
+	{ "synthetic_modulation",    offsetof(struct spit_params, syntheticModulation), 0 },
+	{ "synthetic_pitch_jitter",  offsetof(struct spit_params, syntheticPitchJitter), 0 },
+	{ "greeting_end_silence",    offsetof(struct spit_params, greetingEndSilence), 0 },
+	{ "greeting_end_timeout",    offsetof(struct spit_params, greetingEndTimeout), 0 },
+	{ "beep_min_length",         offsetof(struct spit_params, beepMinLength), 0 },
+	{ "progress_events",         offsetof(struct spit_params, progressEvents), 1 },
+	{ "progress_interval",       offsetof(struct spit_params, progressInterval), 0 },
+};
+
+#define SPIT_PARAM(params, i) ((int *) ((char *) (params) + spit_param_keys[i].offset))
+
+int spit_config_apply(struct spit_params *params, struct spit_burst_config *burst,
+	const char *category, const char *name, const char *value)
+{
+	int i;
+
+	if (!strcasecmp(category, "general")) {
+		for (i = 0; i < (int) (sizeof(spit_param_keys) / sizeof(spit_param_keys[0])); i++) {
+			if (!strcasecmp(name, spit_param_keys[i].name)) {
+				*SPIT_PARAM(params, i) = spit_param_keys[i].boolean ? spit_true(value) : atoi(value);
+				return 0;
+			}
+		}
+		return -1;
+	} else if (!strcasecmp(category, "burst")) {
+		if (!strcasecmp(name, "enabled")) {
+			burst->enabled = spit_true(value);
+		} else if (!strcasecmp(name, "window")) {
+			burst->window = atoi(value);
+		} else if (!strcasecmp(name, "threshold")) {
+			burst->threshold = atoi(value);
+		} else if (!strcasecmp(name, "prefixes")) {
+			return spit_burst_parse_prefixes(burst, value);
+		} else if (!strcasecmp(name, "action")) {
+			if (!strcasecmp(value, "machine"))
+				burst->action = BURST_ACTION_MACHINE;
+			else if (!strcasecmp(value, "strict"))
+				burst->action = BURST_ACTION_STRICT;
+			else
+				return -1;
+		} else if (!strcasecmp(name, "greeting")) {
+			burst->greeting = atoi(value);
+		} else if (!strcasecmp(name, "maximum_number_of_words")) {
+			burst->maximumNumberOfWords = atoi(value);
+		} else if (!strcasecmp(name, "total_analysis_time")) {
+			burst->totalAnalysisTime = atoi(value);
+		} else if (!strcasecmp(name, "maximum_word_length")) {
+			burst->maximumWordLength = atoi(value);
+		} else {
+			return -1;
+		}
+	} else {
+		return -1;
+	}
+
+	return 0;
+}
+
+int spit_params_format(const struct spit_params *params, char *buf, int len)
+{
+	int i, used = 0;
+
+	*buf = '\0';
+	for (i = 0; i < (int) (sizeof(spit_param_keys) / sizeof(spit_param_keys[0])) && used < len; i++) {
+		used += snprintf(buf + used, len - used, "%s%s=%d", used ? " " : "",
+			spit_param_keys[i].name, *SPIT_PARAM(params, i));
+	}
+
+	return used < len ? 0 : -1;
+}
+
+/*
+ * The pipeline and the burst configuration are read by every call without a
+ * lock and replaced by a reload, the same way spit_tuning.c hands out the
+ * tuned values. The writer makes seq odd while it copies and even when it is
+ * done, a reader that saw it odd or changed copies again. Both structs are
+ * made of ints only. Writers hold configLock.
+ */
+static pthread_mutex_t configLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void config_publish(unsigned int *seq, void *dst, const void *src, size_t size)
+{
+	const int *from = src;
+	int *to = dst;
+	size_t i;
+
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	for (i = 0; i < size / sizeof(int); i++)
+		__atomic_store_n(&to[i], from[i], __ATOMIC_RELAXED);
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+static void config_read(unsigned int *seq, void *dst, const void *src, size_t size)
+{
+	const int *from = src;
+	int *to = dst;
+	unsigned int start;
+	size_t i;
+
+	do {
+		start = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+		for (i = 0; i < size / sizeof(int); i++)
+			to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((start & 1) || start != __atomic_load_n(seq, __ATOMIC_RELAXED));
+}
+
+/* The pipeline new analyses get, spit_pipeline_defaults() until one is configured */
+static struct spit_pipeline pipelineConfig;
+static unsigned int pipelineSeq;
+static pthread_once_t pipelineOnce = PTHREAD_ONCE_INIT;
+
+static void spit_pipeline_init(void)
+{
+	spit_pipeline_defaults(&pipelineConfig);
+}
+
+/* Find lowest ms value, that will be max wait time for a frame */
+static void spit_engine_wait_time(struct spit_engine *e)
+{
+	const struct spit_params *p = &e->params;
+
+	e->maxWaitTimeForFrame = SPIT_MAX_WAIT_FOR_FRAME;
+	if (e->maxWaitTimeForFrame > p->initialSilence)
+		e->maxWaitTimeForFrame = p->initialSilence;
+	if (e->maxWaitTimeForFrame > p->greeting)
+		e->maxWaitTimeForFrame = p->greeting;
+	if (e->maxWaitTimeForFrame > p->afterGreetingSilence)
+		e->maxWaitTimeForFrame = p->afterGreetingSilence;
+	if (e->maxWaitTimeForFrame > p->totalAnalysisTime)
+		e->maxWaitTimeForFrame = p->totalAnalysisTime;
+	if (e->maxWaitTimeForFrame > p->minimumWordLength)
+		e->maxWaitTimeForFrame = p->minimumWordLength;
+	if (e->maxWaitTimeForFrame > p->betweenWordsSilence)
+		e->maxWaitTimeForFrame = p->betweenWordsSilence;
+}
+
+/* What follows from the parameters */
+static void spit_engine_setup(struct spit_engine *e)
+{
+	double gain = 4096;
+	int i;
+
+	/* Our prompt comes back at least echoReturnLoss dB down, 1 dB at a time keeps us off libm */
+	for (i = 0; i < e->params.echoReturnLoss; i++)
+		gain *= 0.891251;
+	e->echoGain = gain;
+	spit_engine_wait_time(e);
+
+	/* The synthetic speech detector only runs when it is asked for, wherever it sits in the pipeline */
+	e->stagesOff = (e->params.synthetic ? 0 : 1 << SPIT_STAGE_SYNTHETIC) | e->budgetOff;
+}
+
+void spit_engine_init(struct spit_engine *e, const struct spit_params *params, int answered)
+{
+	memset(e, 0, sizeof(*e));
+	e->params = *params;
+	spit_pipeline_get(&e->pipeline);
+	e->inInitialSilence = 1;
+	e->currentState = STATE_IN_WORD;
+	e->answered = answered;
+	e->lastSeqno = -1;
+	e->lastFrameLength = 20;
+	e->lastTs = -1;
+	e->greetingStart = -1;
+	e->bargeIn = -1;
+	e->modulation = -1;
+	e->pitchJitter = -1;
+	e->greetingEnd = -1;
+	spit_engine_setup(e);
+}
+
+/* The strict profile of [burst] on top of the parameters of the call */
+static void spit_burst_strict(struct spit_engine *e)
+{
+	struct spit_burst_config burst;
+	struct spit_params *p = &e->params;
+
+	spit_burst_get_config(&burst);
+	if (burst.greeting >= 0 && burst.greeting < p->greeting)
+		p->greeting = burst.greeting;
+	if (burst.maximumNumberOfWords >= 0 && burst.maximumNumberOfWords < p->maximumNumberOfWords)
+		p->maximumNumberOfWords = burst.maximumNumberOfWords;
+	if (burst.totalAnalysisTime >= 0 && burst.totalAnalysisTime < p->totalAnalysisTime)
+		p->totalAnalysisTime = burst.totalAnalysisTime;
+	if (burst.maximumWordLength >= 0 && burst.maximumWordLength < p->maximumWordLength)
+		p->maximumWordLength = burst.maximumWordLength;
+	e->burstStrict = 1;
+}
+
+enum spit_status spit_engine_resume(struct spit_engine *e, const struct spit_params *params, int answered)
+{
+	/* Only running out of time leaves an analysis unfinished, any other verdict stands */
+	if (e->status && e->cause != SPIT_CAUSE_TIMEOUT && e->cause != SPIT_CAUSE_EARLYTIMEOUT)
+		return e->status;
+
+	spit_verb(e, "Resuming after %d ms of audio, %d words", e->iTotalTime + e->earlyTime, e->iWordsCount);
+	e->params = *params;
+	if (e->burstStrict)
+		spit_burst_strict(e);
+	e->answered |= answered;
+	e->status = SPIT_UNDECIDED;
+	e->cause = SPIT_CAUSE_NONE;
+	e->causeArgs[0] = e->causeArgs[1] = 0;
+	e->events = 0;
+	e->resumedTime = e->iTotalTime;
+	e->resumedEarlyTime = e->earlyTime;
+	e->endTracking = 0;
+	e->endClock = 0;
+	e->greetingEnd = -1;
+	e->greetingEndCause = SPIT_END_NONE;
+
+	/* We did not listen in between, that time is neither loss nor silence */
+	e->lastSeqno = -1;
+	e->lastTs = -1;
+	e->waitedTime = 0;
+	e->unknownRun = 0;
+
+	/* A prompt of the earlier run is over, its counters went to the totals already */
+	e->promptPlaying = 0;
+	e->promptPending = 0;
+	memset(e->promptEnergy, 0, sizeof(e->promptEnergy));
+	memset(e->perf, 0, sizeof(e->perf));
+	spit_engine_setup(e);
+
+	return e->status;
+}
+
+static enum spit_status spit_verdict(struct spit_engine *e, enum spit_status status, enum spit_cause cause, int arg0, int arg1)
+{
+	e->status = status;
+	e->cause = cause;
+	e->causeArgs[0] = arg0;
+	e->causeArgs[1] = arg1;
+	e->events |= SPIT_EVENT_VERDICT;
+
+	/* The machine is still talking, the state we have tells us when it stops. Only causes that
+	   heard a greeting have one to end, a timeout or a digit gives the answer right away. */
+	if (status == SPIT_MACHINE && e->params.trackGreetingEnd
+		&& (cause == SPIT_CAUSE_MAXWORDS || cause == SPIT_CAUSE_LONGGREETING || cause == SPIT_CAUSE_MAXWORDLENGTH
+			|| cause == SPIT_CAUSE_SYNTHETIC || cause == SPIT_CAUSE_BURST)) {
+		spit_verb(e, "Listening for the end of the greeting");
+		e->endTracking = 1;
+		e->endClock = e->iTotalTime + e->earlyTime;
+		e->endStart = e->endClock;
+		e->toneTime = 0;
+	}
+
+	return status;
+}
+
+static enum spit_status spit_greeting_ended(struct spit_engine *e, enum spit_greeting_end end, int at)
+{
+	e->endTracking = 0;
+	e->events |= SPIT_EVENT_GREETINGEND;
+	e->greetingEndCause = end;
+	e->greetingEnd = at;
+
+	return e->status;
+}
+
+/* A beep is a pure tone, each sample follows from the two before it as
+   x[n+1] = c*x[n] - x[n-1] with c = 2cos(w). Fit c over the frame and see how much
+   of the audio the fit leaves over, speech leaves a lot. */
+static int spit_tone(const int16_t *samples, int nsamples, int *coeff)
+{
+	int64_t xx = 0, xy = 0, yy = 0;
+	double c;
+	int i, y;
+
+	for (i = 1; i < nsamples - 1; i++) {
+		y = samples[i - 1] + samples[i + 1];
+		xx += samples[i] * samples[i];
+		xy += (int64_t) samples[i] * y;
+		yy += (int64_t) y * y;
+	}
+	if (!xx)
+		return 0;
+
+	c = (double) xy / xx;
+	*coeff = c * 4096;
+
+	/* Less than 1% of the energy left over, a voiced vowel leaves 4% and more */
+	return (yy - c * xy) * 100 < xx && *coeff <= BEEP_MAX_COEFF && *coeff >= BEEP_MIN_COEFF;
+}
+
+/* After a MACHINE verdict, the greeting ends with a beep or with silence */
+static enum spit_status spit_greeting_end(struct spit_engine *e, int framelength, int silence, int tone, int coeff)
+{
+	const struct spit_params *p = &e->params;
+
+	e->endClock += framelength;
+
+	if (tone && e->toneTime && abs(coeff - e->toneCoeff) < BEEP_DRIFT) {
+		e->toneTime += framelength;
+	} else {
+		if (e->toneTime >= p->beepMinLength) {
+			spit_verb(e, "Greeting ended with a %d ms beep", e->toneTime);
+			return spit_greeting_ended(e, SPIT_END_BEEP, e->endClock - framelength);
+		}
+		e->toneTime = tone ? framelength : 0;
+	}
+	e->toneCoeff = coeff;
+
+	if (silence >= p->greetingEndSilence) {
+		spit_verb(e, "Greeting ended, %d ms of silence", silence);
+		return spit_greeting_ended(e, SPIT_END_SILENCE, e->endClock - silence);
+	}
+
+	if (e->endClock - e->endStart >= p->greetingEndTimeout) {
+		spit_verb(e, "The greeting did not end within %d ms", p->greetingEndTimeout);
+		return spit_greeting_ended(e, SPIT_END_TIMEOUT, -1);
+	}
+
+	return e->status;
+}
+
+/* Calls from a prefix that is bursting get decided right away or analyzed with the strict profile */
+static enum spit_status spit_stage_burst(struct spit_engine *e)
+{
+	struct spit_burst_config burst;
+	const struct spit_burst_hit *hit = &e->burst;
+
+	if (!hit->count)
+		return e->status;
+	spit_burst_get_config(&burst);
+	if (hit->count < (unsigned int) burst.threshold)
+		return e->status;
+
+	if (burst.action == BURST_ACTION_MACHINE) {
+		spit_verb(e, "AUTOMATED DIALER: prefix %s has %u calls in the burst window", hit->prefix, hit->count);
+		return spit_verdict(e, SPIT_MACHINE, SPIT_CAUSE_BURST, 0, 0);
+	}
+
+	spit_verb(e, "Prefix %s has %u calls in the burst window, using the strict profile", hit->prefix, hit->count);
+	spit_burst_strict(e);
+	spit_engine_wait_time(e);
+
+	return e->status;
+}
+
+/* Loudest our prompt could be coming back at us right now */
+static int spit_echo_level(const struct spit_engine *e)
+{
+	int i, loudest = 0;
+
+	for (i = 0; i < SPIT_ECHO_TAIL; i++) {
+		if (e->promptEnergy[i] > loudest)
+			loudest = e->promptEnergy[i];
+	}
+
+	return loudest * e->echoGain / 4096;
+}
+
+/* Same measure as the Asterisk DSP silence detector: a frame is silent when its
+   average magnitude is under the threshold, silence adds up until a loud frame.
+   While our prompt plays, audio no louder than its echo counts as silence too. */
+static int spit_silence(struct spit_engine *e, const int16_t *samples, int nsamples)
+{
+	int accum = 0;
+	int i, echo;
+
+	if (!nsamples)
+		return 0;
+
+	for (i = 0; i < nsamples; i++)
+		accum += abs(samples[i]);
+	accum /= nsamples;
+	e->energy = accum;
+
+	if (accum < e->params.silenceThreshold) {
+		e->detectorSilence += nsamples / SPIT_SAMPLES_PER_MS;
+	} else if (accum < (echo = spit_echo_level(e))) {
+		spit_debug(e, "Energy %d is under the prompt echo level %d", accum, echo);
+		e->echoTime += nsamples / SPIT_SAMPLES_PER_MS;
+		e->detectorSilence += nsamples / SPIT_SAMPLES_PER_MS;
+	} else {
+		e->detectorSilence = 0;
+	}
+
+	return e->detectorSilence;
+}
+
+/* Synthetic speech detector. TTS and studio recorded greetings keep a steadier
+   syllable rate and pitch than live speech does. The envelope of the audio in 10ms
+   steps goes through a sliding DFT, so the 2-8 Hz modulation bins are current after
+   every frame for the cost of a few multiplies, and voiced frames get a pitch
+   estimate from the AMDF of the audio decimated to 4kHz. All of it lives in the
+   engine, an analysis allocates nothing. */
+
+/* e^(j*2*pi*k/SPIT_MOD_WINDOW) for the bins we keep */
+static const double modTwiddle[SPIT_MOD_BINS][2] = {
+	{ 0.992114701, 0.125333234 },	/* 2 Hz */
+	{ 0.982287251, 0.187381315 },	/* 3 Hz */
+	{ 0.968583161, 0.248689887 },	/* 4 Hz */
+	{ 0.951056516, 0.309016994 },	/* 5 Hz */
+	{ 0.929776486, 0.368124553 },	/* 6 Hz */
+	{ 0.904827052, 0.425779292 },	/* 7 Hz */
+	{ 0.876306680, 0.481753674 },	/* 8 Hz */
+};
+
+static void spit_envelope(struct spit_engine *e, int value)
+{
+	double re, im;
+	int i, x, old;
+
+	/* Take out the slow level changes, we are after the syllable rate */
+	if (!e->envFilled)
+		e->envMean = value * 16;
+	e->envMean += value - e->envMean / 16;
+	x = value - e->envMean / 16;
+
+	old = e->envHistory[e->envPos];
+	e->envHistory[e->envPos] = x;
+	e->envPos = (e->envPos + 1) % SPIT_MOD_WINDOW;
+	if (e->envFilled < SPIT_MOD_WINDOW)
+		e->envFilled++;
+
+	for (i = 0; i < SPIT_MOD_BINS; i++) {
+		re = e->modRe[i] - old + x;
+		im = e->modIm[i];
+		e->modRe[i] = re * modTwiddle[i][0] - im * modTwiddle[i][1];
+		e->modIm[i] = re * modTwiddle[i][1] + im * modTwiddle[i][0];
+	}
+}
+
+/* Lag of the AMDF minimum over the last 40ms at 4kHz, 0 when the frame has no clear pitch */
+static int spit_pitch_lag(const struct spit_engine *e)
+{
+	const int16_t *x = e->pitchBuf + SPIT_PITCH_BUF - PITCH_WINDOW - PITCH_MAX_LAG;
+	int lag, i, sum, best = INT_MAX, bestLag = 0, total = 0;
+
+	for (lag = PITCH_MIN_LAG; lag <= PITCH_MAX_LAG; lag++) {
+		/* Plain loop over fixed sizes, the compiler vectorizes it */
+		sum = 0;
+		for (i = 0; i < PITCH_WINDOW; i++)
+			sum += abs(x[i + PITCH_MAX_LAG] - x[i + PITCH_MAX_LAG - lag]);
+		total += sum;
+		if (sum < best) {
+			best = sum;
+			bestLag = lag;
+		}
+	}
+
+	/* Voiced audio has a dip well under the average, noise doesn't */
+	if (best * 3 * (PITCH_MAX_LAG - PITCH_MIN_LAG + 1) > total)
+		return 0;
+
+	return bestLag;
+}
+
+static void spit_synthetic(struct spit_engine *e, const int16_t *samples, int nsamples, int silence)
+{
+	int i, j, n, accum, lag, delta;
+
+	/* Ringback is as steady as a tone gets, it is no greeting */
+	if (e->inRingback)
+		return;
+
+	/* The window starts with the first voice, initial silence says nothing about the speaker */
+	if (!e->envFilled && silence)
+		return;
+
+	/* Sum up to each envelope boundary with a branch free loop the compiler can vectorize */
+	for (i = 0; i < nsamples; i += n) {
+		n = SPIT_ENV_SAMPLES - e->envCount;
+		if (n > nsamples - i)
+			n = nsamples - i;
+		accum = 0;
+		for (j = 0; j < n; j++)
+			accum += abs(samples[i + j]);
+		e->envAccum += accum;
+		e->envCount += n;
+		if (e->envCount == SPIT_ENV_SAMPLES) {
+			spit_envelope(e, e->envAccum / SPIT_ENV_SAMPLES);
+			e->envAccum = 0;
+			e->envCount = 0;
+		}
+	}
+
+	/* Decimate to 4kHz into the pitch buffer */
+	n = nsamples / 2;
+	if (n > SPIT_PITCH_BUF)
+		n = SPIT_PITCH_BUF;
+	memmove(e->pitchBuf, e->pitchBuf + n, (SPIT_PITCH_BUF - n) * sizeof(e->pitchBuf[0]));
+	for (i = 0; i < n; i++)
+		e->pitchBuf[SPIT_PITCH_BUF - n + i] = (samples[2 * i] + samples[2 * i + 1]) / 2;
+
+	if (silence) {
+		e->lastPitchLag = 0;
+		return;
+	}
+
+	if (!(lag = spit_pitch_lag(e))) {
+		e->lastPitchLag = 0;
+		return;
+	}
+	if (e->lastPitchLag) {
+		delta = abs(lag - e->lastPitchLag);
+		/* An octave jump is the estimate failing, not the speaker */
+		if (delta * 2 < lag) {
+			e->pitchDeltaSum += delta;
+			e->pitchLagSum += lag;
+			e->pitchFrames++;
+		}
+	}
+	e->lastPitchLag = lag;
+}
+
+static enum spit_status spit_synthetic_check(struct spit_engine *e)
+{
+	const struct spit_params *p = &e->params;
+	double power, peak = 0, total = 0;
+	int i;
+
+	if (e->envFilled < SPIT_MOD_WINDOW / 2 || !e->pitchLagSum)
+		return e->status;
+
+	for (i = 0; i < SPIT_MOD_BINS; i++) {
+		power = e->modRe[i] * e->modRe[i] + e->modIm[i] * e->modIm[i];
+		total += power;
+		if (power > peak)
+			peak = power;
+	}
+	/* How much of the syllable rate modulation sits in its strongest bin */
+	e->modulation = total > 0 ? peak * 100 / total : 0;
+	/* Mean pitch change between voiced frames in 1/1000 of the pitch period */
+	e->pitchJitter = e->pitchDeltaSum * 1000 / e->pitchLagSum;
+
+	if (e->voiceDuration < p->syntheticMinVoice || e->pitchFrames < 10)
+		return e->status;
+
+	if (e->modulation >= p->syntheticModulation && e->pitchJitter <= p->syntheticPitchJitter) {
+		spit_verb(e, "ANSWERING MACHINE: synthetic speech, modulation peak %d%% pitch jitter %d", e->modulation, e->pitchJitter);
+		return spit_verdict(e, SPIT_MACHINE, SPIT_CAUSE_SYNTHETIC, e->modulation, e->pitchJitter);
+	}
+
+	return e->status;
+}
+
+/* Words as the state machine sees them, in 10ms steps */
+static void spit_timeline_open(struct spit_engine *e)
+{
+	if (e->timelineOpen || e->timelineCount == SPIT_TIMELINE)
+		return;
+
+	e->timelineStart[e->timelineCount] = (e->iTotalTime + e->earlyTime - e->consecutiveVoiceDuration) / 10;
+	e->timelineOpen = 1;
+}
+
+static void spit_timeline_close(struct spit_engine *e)
+{
+	if (!e->timelineOpen)
+		return;
+
+	e->timelineLength[e->timelineCount++] = e->consecutiveVoiceDuration / 10;
+	e->timelineOpen = 0;
+}
+
+#define FRAME_VOICE     0
+#define FRAME_CNG       1
+#define FRAME_NONE      2
+
+/* One step of the detection state machine. The frame stands for framelength ms of
+   audio, unknown ms we have no audio for and gapSilence ms the far end was quiet.
+   For voice frames silence is what spit_silence() made of the audio. */
+static enum spit_status spit_step(struct spit_engine *e, int kind, int framelength, int unknown, int gapSilence,
+	int silence)
+{
+	const struct spit_params *p = &e->params;
+	int elapsed = framelength + unknown + gapSilence;
+	int excess;
+
+	if (unknown > 0) {
+		e->unknownRun += unknown;
+		/* Too long to bridge, past the tolerance the gap is treated as silence after all */
+		if (e->unknownRun > p->lossTolerance) {
+			excess = e->unknownRun - p->lossTolerance;
+			gapSilence += excess < unknown ? excess : unknown;
+		}
+	}
+	/* Real audio ends the run of unknown time */
+	if (kind != FRAME_NONE)
+		e->unknownRun = 0;
+
+	if (!e->answered) {
+		/* Time before answer is not billed, it has its own limit */
+		e->earlyTime += elapsed;
+		if (e->earlyTime - e->resumedEarlyTime >= p->earlyMediaTimeout) {
+			spit_verb(e, "Not answered after %d ms of early media", e->earlyTime);
+			return spit_verdict(e, SPIT_NOTSURE, SPIT_CAUSE_EARLYTIMEOUT, e->earlyTime, 0);
+		}
+	} else {
+		e->iTotalTime += elapsed;
+	}
+	if (e->promptPlaying)
+		e->promptTime += elapsed;
+	/* If the total time exceeds the analysis time then give up as we are not too sure */
+	if (e->iTotalTime - e->resumedTime >= p->totalAnalysisTime) {
+		spit_verb(e, "Nothing definitive before timeout, erring on the side of MACHINE...");
+		return spit_verdict(e, SPIT_MACHINE, SPIT_CAUSE_TIMEOUT, e->iTotalTime, 0);
+	}
+
+	/* A leg that loses this much audio can't be judged on its word gaps */
+	if (p->maxLossPercent > 0 && e->iTotalTime + e->earlyTime >= LOSS_MIN_ANALYSIS_TIME
+		&& e->lostTime * 100 > p->maxLossPercent * (e->iTotalTime + e->earlyTime)) {
+		spit_verb(e, "Lost %d ms of audio in %d gaps, giving up", e->lostTime, e->lossGaps);
+		return spit_verdict(e, SPIT_NOTSURE, SPIT_CAUSE_LOSS, e->lostTime, e->lossGaps);
+	}
+
+	/* Feed the frame of audio into the silence detector and see if we get a result */
+	if (kind == FRAME_CNG) {
+		e->dspSilence += framelength;
+	} else if (kind == FRAME_NONE) {
+		/* Still within the loss tolerance, leave the word and silence state alone */
+		if (!gapSilence)
+			return e->status;
+		e->dspSilence += gapSilence;
+	} else {
+		if (gapSilence >= p->betweenWordsSilence && e->currentState == STATE_IN_WORD) {
+			/* The caller went quiet between this frame and the last one, the word is over */
+			spit_debug(e, "%d ms without audio ends the word", gapSilence);
+			spit_timeline_close(e);
+			e->currentState = STATE_IN_SILENCE;
+			e->consecutiveVoiceDuration = 0;
+		}
+		e->dspSilence = silence;
+	}
+
+	if (e->inRingback) {
+		/* Wait for the ringback cadence to pause before we analyze again */
+		if (e->dspSilence > 0)
+			e->inRingback = 0;
+		return e->status;
+	}
+
+	if (e->dspSilence > 0) {
+		e->silenceDuration = e->dspSilence;
+		if (e->silenceDuration > e->longestSilence)
+			e->longestSilence = e->silenceDuration;
+
+		if (e->silenceDuration >= p->betweenWordsSilence) {
+			if (e->currentState != STATE_IN_SILENCE) {
+				spit_verb(e, "Changed state to STATE_IN_SILENCE");
+				if (e->inGreeting) {
+					e->wordGaps++;
+					e->events |= SPIT_EVENT_SILENCE;
+				}
+			}
+			/* Find words less than word duration */
+			if (e->consecutiveVoiceDuration < p->minimumWordLength && e->consecutiveVoiceDuration > 0) {
+				spit_verb(e, "Short Word Duration: %d", e->consecutiveVoiceDuration);
+				e->shortWords++;
+			}
+			spit_timeline_close(e);
+			e->currentState = STATE_IN_SILENCE;
+			e->consecutiveVoiceDuration = 0;
+		}
+
+		/* Talking over our prompt and then stopping to listen is something machines don't do */
+		if (e->bargeIn >= 0 && e->promptPlaying && e->silenceDuration >= p->bargeInSilence && e->answered) {
+			spit_verb(e, "HUMAN: talked over the prompt %d ms into it, then %d ms of silence", e->bargeIn, e->silenceDuration);
+			return spit_verdict(e, SPIT_HUMAN, SPIT_CAUSE_BARGEIN, e->bargeIn, e->silenceDuration);
+		}
+
+		if (e->inInitialSilence == 1 && e->silenceDuration >= p->initialSilence && e->answered) {
+			spit_verb(e, "AUTOMATED DIALER: silenceDuration:%d initialSilence:%d", e->silenceDuration, p->initialSilence);
+			return spit_verdict(e, SPIT_HUMAN, SPIT_CAUSE_INITIALSILENCE, e->silenceDuration, p->initialSilence);
+		}
+
+		if (e->silenceDuration >= p->afterGreetingSilence && e->inGreeting == 1 && e->answered) {
+			spit_verb(e, "HUMAN: silenceDuration:%d afterGreetingSilence:%d", e->silenceDuration, p->afterGreetingSilence);
+			return spit_verdict(e, SPIT_HUMAN, SPIT_CAUSE_SILENCEAFTERNOISE, e->silenceDuration, p->afterGreetingSilence);
+		}
+	} else {
+		e->consecutiveVoiceDuration += framelength;
+		e->voiceDuration += framelength;
+		if (e->consecutiveVoiceDuration > e->longestWord)
+			e->longestWord = e->consecutiveVoiceDuration;
+		if (e->consecutiveVoiceDuration >= p->minimumWordLength)
+			spit_timeline_open(e);
+
+		/* If I have enough consecutive voice to say that I am in a Word, I can only increment the
+		   number of words if my previous state was Silence, which means that I moved into a word. */
+		if (e->consecutiveVoiceDuration >= p->minimumWordLength && e->currentState == STATE_IN_SILENCE) {
+			e->iWordsCount++;
+			e->events |= SPIT_EVENT_WORD;
+			spit_verb(e, "Word detected. iWordsCount:%d", e->iWordsCount);
+			e->currentState = STATE_IN_WORD;
+		}
+		/* Only a word that started after the prompt did is a reaction to it */
+		if (e->promptPlaying && e->bargeIn < 0 && e->consecutiveVoiceDuration >= p->minimumWordLength
+			&& e->promptTime >= e->consecutiveVoiceDuration) {
+			e->bargeIn = e->promptTime - e->consecutiveVoiceDuration;
+			spit_verb(e, "Caller talked over the prompt %d ms into it", e->bargeIn);
+		}
+		if (e->consecutiveVoiceDuration >= p->maximumWordLength) {
+			spit_verb(e, "Maximum Word Length detected. [%d]", e->consecutiveVoiceDuration);
+			return spit_verdict(e, SPIT_MACHINE, SPIT_CAUSE_MAXWORDLENGTH, e->consecutiveVoiceDuration, 0);
+		}
+		if (e->iWordsCount >= p->maximumNumberOfWords) {
+			spit_verb(e, "ANSWERING MACHINE: iWordsCount:%d", e->iWordsCount);
+			return spit_verdict(e, SPIT_MACHINE, SPIT_CAUSE_MAXWORDS, e->iWordsCount, p->maximumNumberOfWords);
+		}
+
+		if (e->inGreeting == 1 && e->voiceDuration >= p->greeting) {
+			spit_verb(e, "ANSWERING MACHINE: voiceDuration:%d greeting:%d", e->voiceDuration, p->greeting);
+			return spit_verdict(e, SPIT_MACHINE, SPIT_CAUSE_LONGGREETING, e->voiceDuration, p->greeting);
+		}
+
+		if (e->voiceDuration >= p->minimumWordLength) {
+			if (e->silenceDuration > 0)
+				spit_verb(e, "Detected Talk, previous silence duration: %d, current voice duration: %d", e->silenceDuration, e->voiceDuration);
+			e->silenceDuration = 0;
+		}
+		if (e->consecutiveVoiceDuration >= p->minimumWordLength && e->inGreeting == 0) {
+			/* Only go in here once to change the greeting flag when we detect the 1st word */
+			if (e->silenceDuration > 0)
+				spit_verb(e, "Before Greeting Time:  silenceDuration: %d voiceDuration: %d", e->silenceDuration, e->voiceDuration);
+			e->inInitialSilence = 0;
+			e->inGreeting = 1;
+			e->events |= SPIT_EVENT_FIRSTWORD;
+			e->greetingStart = e->iTotalTime + e->earlyTime - e->consecutiveVoiceDuration;
+		}
+	}
+
+	spit_debug(e, "silenceDuration [%d] voiceDuration [%d] consecutiveVoiceDuration [%d]"
+		" iWordsCount [%d] currentState [%d] inInitialSilence [%d] inGreeting [%d]",
+		e->silenceDuration, e->voiceDuration, e->consecutiveVoiceDuration,
+		e->iWordsCount, e->currentState, e->inInitialSilence, e->inGreeting);
+
+	return e->status;
+}
+
+/*
+ * The detection pipeline. A stage is a set of hooks: start runs once before
+ * the audio, audio on every frame and dtmf on every digit. Comfort noise and
+ * waits that timed out are audio frames too, without samples. The stages of the
+ * pipeline run in order on each of those events until one of them decides,
+ * the ones after it never see the event. A new detector is a new stage in
+ * enum spit_stage and an entry in stageOps.
+ */
+#define HOOK_START      0
+#define HOOK_AUDIO      1
+#define HOOK_DTMF       2
+
+/* What the audio stages know about a frame, earlier stages fill in for later ones */
+struct spit_frame {
+	int kind;	/* FRAME_VOICE, or FRAME_CNG and FRAME_NONE with no samples */
+	const int16_t *samples;
+	int nsamples;
+	int framelength;
+	int unknown;
+	int gapSilence;
+	int silence;	/* ms of silence up to this frame, from the energy stage */
+};
+
+static enum spit_status spit_stage_dtmf(struct spit_engine *e, int digit)
+{
+	spit_verb(e, "Incoming DTMF, Digit received: [%d]", digit);
+
+	return spit_verdict(e, SPIT_MACHINE, SPIT_CAUSE_DTMF, digit - '0', 0);
+}
+
+static enum spit_status spit_stage_energy(struct spit_engine *e, struct spit_frame *frame)
+{
+	if (frame->kind != FRAME_VOICE)
+		return e->status;
+	frame->silence = spit_silence(e, frame->samples, frame->nsamples);
+
+	return e->status;
+}
+
+static enum spit_status spit_stage_words(struct spit_engine *e, struct spit_frame *frame)
+{
+	return spit_step(e, frame->kind, frame->framelength, frame->unknown, frame->gapSilence, frame->silence);
+}
+
+static enum spit_status spit_stage_synthetic(struct spit_engine *e, struct spit_frame *frame)
+{
+	if (frame->kind != FRAME_VOICE)
+		return e->status;
+	spit_synthetic(e, frame->samples, frame->nsamples, frame->silence);
+
+	return spit_synthetic_check(e);
+}
+
+static const struct {
+	enum spit_status (*start)(struct spit_engine *e);
+	enum spit_status (*audio)(struct spit_engine *e, struct spit_frame *frame);
+	enum spit_status (*dtmf)(struct spit_engine *e, int digit);
+	unsigned int requires;	/* Stages that have to come before this one */
+	int optional;	/* Can be left out of the pipeline, and given a budget when it takes audio */
+} stageOps[SPIT_STAGES] = {
+	[SPIT_STAGE_BURST] = { .start = spit_stage_burst, .optional = 1 },
+	[SPIT_STAGE_DTMF] = { .dtmf = spit_stage_dtmf, .optional = 1 },
+	/* The words stage keeps the time of the analysis, there is no verdict without it */
+	[SPIT_STAGE_ENERGY] = { .audio = spit_stage_energy },
+	[SPIT_STAGE_STEP] = { .audio = spit_stage_words, .requires = 1 << SPIT_STAGE_ENERGY },
+	[SPIT_STAGE_SYNTHETIC] = { .audio = spit_stage_synthetic, .requires = 1 << SPIT_STAGE_ENERGY, .optional = 1 },
+};
+
+#define STAGE_IN_PIPELINE(stage) (stageOps[stage].start || stageOps[stage].audio || stageOps[stage].dtmf)
+
+static enum spit_status spit_pipeline_run(struct spit_engine *e, int hook, struct spit_frame *frame, int digit)
+{
+	struct spit_perf_stage *perf;
+	int i, stage, budget;
+	uint64_t start = 0;
+
+	for (i = 0; i < e->pipeline.numStages && !e->status; i++) {
+		stage = e->pipeline.stages[i];
+		if (e->stagesOff & (1 << stage))
+			continue;
+		if (hook == HOOK_START ? !stageOps[stage].start : hook == HOOK_AUDIO ? !stageOps[stage].audio : !stageOps[stage].dtmf)
+			continue;
+
+		perf = &e->perf[stage];
+		budget = e->pipeline.budget[stage];
+		if (e->params.perfCounters || budget)
+			start = spit_cycles();
+
+		if (hook == HOOK_START)
+			stageOps[stage].start(e);
+		else if (hook == HOOK_AUDIO)
+			stageOps[stage].audio(e, frame);
+		else
+			stageOps[stage].dtmf(e, digit);
+
+		if (e->params.perfCounters || budget)
+			perf->cycles += spit_cycles() - start;
+		perf->calls++;
+		if (frame)
+			perf->samples += frame->nsamples;
+		if (e->status)
+			perf->verdicts++;
+
+		/* A stage that costs more than it may sits out the rest of the analysis */
+		if (budget && perf->samples >= SPIT_BUDGET_MIN_SAMPLES && perf->cycles > (uint64_t) budget * perf->samples) {
+			spit_verb(e, "The %s stage takes %d cycles per sample, over its budget of %d. Skipping it.",
+				spit_stage_name(stage), (int) (perf->cycles / perf->samples), budget);
+			e->stagesOff |= 1 << stage;
+			e->budgetOff |= 1 << stage;
+			perf->overBudget = 1;
+		}
+	}
+
+	return e->status;
+}
+
+void spit_pipeline_defaults(struct spit_pipeline *pipeline)
+{
+	memset(pipeline, 0, sizeof(*pipeline));
+	pipeline->numStages = 5;
+	pipeline->stages[0] = SPIT_STAGE_BURST;
+	pipeline->stages[1] = SPIT_STAGE_DTMF;
+	pipeline->stages[2] = SPIT_STAGE_ENERGY;
+	pipeline->stages[3] = SPIT_STAGE_STEP;
+	pipeline->stages[4] = SPIT_STAGE_SYNTHETIC;
+}
+
+static int spit_stage_find(const char *name, int len)
+{
+	int i;
+
+	for (i = 0; i < SPIT_STAGES; i++) {
+		if (STAGE_IN_PIPELINE(i) && (int) strlen(spit_stage_name(i)) == len && !strncasecmp(spit_stage_name(i), name, len))
+			return i;
+	}
+
+	return -1;
+}
+
+/* A comma separated list of stages. Every stage that is not optional has to be there,
+   after the stages it requires. */
+static int spit_pipeline_parse(struct spit_pipeline *pipeline, const char *value)
+{
+	struct spit_pipeline parsed = *pipeline;
+	const char *item = value, *end;
+	unsigned int seen = 0;
+	int i, stage, len;
+
+	parsed.numStages = 0;
+	while (item && *item) {
+		while (*item == ' ' || *item == '\t')
+			item++;
+		end = strchr(item, ',');
+		len = end ? end - item : (int) strlen(item);
+		while (len > 0 && (item[len - 1] == ' ' || item[len - 1] == '\t'))
+			len--;
+		if ((stage = spit_stage_find(item, len)) < 0 || (seen & (1 << stage))
+			|| (stageOps[stage].requires & ~seen))
+			return -1;
+		parsed.stages[parsed.numStages++] = stage;
+		seen |= 1 << stage;
+		item = end ? end + 1 : NULL;
+	}
+
+	for (i = 0; i < SPIT_STAGES; i++) {
+		if (STAGE_IN_PIPELINE(i) && !stageOps[i].optional && !(seen & (1 << i)))
+			return -1;
+	}
+
+	*pipeline = parsed;
+
+	return 0;
+}
+
+int spit_pipeline_config_apply(struct spit_pipeline *pipeline, const char *name, const char *value)
+{
+	int len = strlen(name), stage;
+
+	if (!strcasecmp(name, "stages"))
+		return spit_pipeline_parse(pipeline, value);
+
+	/* <stage>_budget, for the optional stages that take audio */
+	if (len > 7 && !strcasecmp(name + len - 7, "_budget")) {
+		stage = spit_stage_find(name, len - 7);
+		if (stage < 0 || !stageOps[stage].optional || !stageOps[stage].audio || atoi(value) < 0)
+			return -1;
+		pipeline->budget[stage] = atoi(value);
+		return 0;
+	}
+
+	return -1;
+}
+
+void spit_pipeline_configure(const struct spit_pipeline *pipeline)
+{
+	pthread_once(&pipelineOnce, spit_pipeline_init);
+	pthread_mutex_lock(&configLock);
+	config_publish(&pipelineSeq, &pipelineConfig, pipeline, sizeof(pipelineConfig));
+	pthread_mutex_unlock(&configLock);
+}
+
+void spit_pipeline_get(struct spit_pipeline *pipeline)
+{
+	pthread_once(&pipelineOnce, spit_pipeline_init);
+	config_read(&pipelineSeq, pipeline, &pipelineConfig, sizeof(*pipeline));
+}
+
+void spit_pipeline_format(const struct spit_pipeline *pipeline, char *buf, int len)
+{
+	int i, used = 0;
+
+	*buf = '\0';
+	for (i = 0; i < pipeline->numStages && used < len; i++)
+		used += snprintf(buf + used, len - used, "%s%s", i ? "," : "", spit_stage_name(pipeline->stages[i]));
+}
+
+enum spit_status spit_engine_audio(struct spit_engine *e, const int16_t *samples, int nsamples,
+	const struct spit_frame_info *info)
+{
+	int framelength = nsamples / SPIT_SAMPLES_PER_MS;
+	int unknown = 0, gapSilence = 0, seqDelta = 0, lost = 0, gap, silence;
+	struct spit_frame frame;
+
+	if (e->endTracking) {
+		int coeff = 0, tone;
+
+		silence = spit_silence(e, samples, nsamples);
+		tone = !silence && spit_tone(samples, nsamples, &coeff);
+		return spit_greeting_end(e, framelength, silence, tone, coeff);
+	}
+
+	if (e->status)
+		return e->status;
+
+	/* Work out how much time this frame stands for. Time we have no audio for is unknown,
+	   not silence: packets lost on the way must not split words or end a greeting. */
+	if (info && info->hasSeqno && e->lastSeqno >= 0)
+		seqDelta = (info->seqno - e->lastSeqno) & 0xffff;
+
+	if (info && info->hasTimestamp && e->lastTs >= 0 && info->ts > e->lastTs + e->lastFrameLength) {
+		/* Part of the gap may already be charged by waits that timed out */
+		gap = info->ts - e->lastTs - e->lastFrameLength;
+		if (seqDelta != 1)
+			lost = gap;
+		if ((gap -= e->waitedTime) > 0) {
+			if (seqDelta == 1)
+				gapSilence = gap;	/* Nothing lost, the far end stopped sending while quiet */
+			else
+				unknown = gap;
+		}
+	} else if (seqDelta > 1 && seqDelta < 0x8000) {
+		gap = (seqDelta - 1) * e->lastFrameLength;
+		lost = gap;
+		if ((gap -= e->waitedTime) > 0)
+			unknown = gap;
+	}
+
+	/* Only gaps in the sequence numbers or timestamps are loss. A wait that timed out
+	   may be a leg that stops sending while quiet, it is unknown time but not lost audio. */
+	if (lost > 0) {
+		e->lostTime += lost;
+		e->lossGaps++;
+	}
+
+	if (info && info->hasSeqno)
+		e->lastSeqno = info->seqno;
+	if (info && info->hasTimestamp)
+		e->lastTs = info->ts;
+	if (framelength > 0)
+		e->lastFrameLength = framelength;
+	e->waitedTime = 0;
+
+	/* Line the prompt energy up with the caller audio for the echo gate */
+	e->promptEnergy[e->promptPos] = e->promptPending;
+	e->promptPos = (e->promptPos + 1) % SPIT_ECHO_TAIL;
+	e->promptPending = 0;
+
+	frame.kind = FRAME_VOICE;
+	frame.samples = samples;
+	frame.nsamples = nsamples;
+	frame.framelength = framelength;
+	frame.unknown = unknown;
+	frame.gapSilence = gapSilence;
+	frame.silence = 0;
+
+	return spit_pipeline_run(e, HOOK_AUDIO, &frame, 0);
+}
+
+enum spit_status spit_engine_comfort_noise(struct spit_engine *e)
+{
+	int framelength = 2 * e->maxWaitTimeForFrame;
+	struct spit_frame frame = { .kind = FRAME_CNG, .framelength = framelength };
+
+	if (e->endTracking) {
+		e->detectorSilence += framelength;
+		return spit_greeting_end(e, framelength, e->detectorSilence, 0, 0);
+	}
+
+	if (e->status)
+		return e->status;
+
+	return spit_pipeline_run(e, HOOK_AUDIO, &frame, 0);
+}
+
+enum spit_status spit_engine_timeout(struct spit_engine *e)
+{
+	int unknown = 2 * e->maxWaitTimeForFrame;
+	struct spit_frame frame = { .kind = FRAME_NONE, .unknown = unknown };
+
+	/* Time goes on towards greeting_end_timeout, but we heard neither silence nor the beep */
+	if (e->endTracking) {
+		e->endClock += unknown;
+		if (e->endClock - e->endStart >= e->params.greetingEndTimeout)
+			return spit_greeting_ended(e, SPIT_END_TIMEOUT, -1);
+		return e->status;
+	}
+
+	if (e->status)
+		return e->status;
+
+	/* We gave up waiting for media, we don't know what the caller did meanwhile */
+	e->waitedTime += unknown;
+
+	return spit_pipeline_run(e, HOOK_AUDIO, &frame, 0);
+}
+
+enum spit_status spit_engine_burst(struct spit_engine *e, const struct spit_burst_hit *hit)
+{
+	e->burst = *hit;
+
+	return spit_pipeline_run(e, HOOK_START, NULL, 0);
+}
+
+enum spit_status spit_engine_dtmf(struct spit_engine *e, int digit)
+{
+	return spit_pipeline_run(e, HOOK_DTMF, NULL, digit);
+}
+
+enum spit_status spit_engine_hangup(struct spit_engine *e)
+{
+	if (e->endTracking)
+		return spit_greeting_ended(e, SPIT_END_HANGUP, -1);
+
+	if (e->status)
+		return e->status;
+
+	spit_verb(e, "HANGUP");
+
+	return spit_verdict(e, SPIT_HANGUP, SPIT_CAUSE_NONE, 0, 0);
+}
+
+enum spit_status spit_engine_noframes(struct spit_engine *e)
+{
+	if (!e->status) {
+		/* It took too long to get a frame back. Giving up. */
+		spit_verb(e, "No frames detected, erring on the side of MACHINE...");
+		spit_verdict(e, SPIT_MACHINE, SPIT_CAUSE_NOFRAMES, e->iTotalTime, 0);
+	}
+
+	/* No more audio is coming to tell us where the greeting ends */
+	if (e->endTracking)
+		spit_greeting_ended(e, SPIT_END_TIMEOUT, -1);
+
+	return e->status;
+}
+
+void spit_engine_answer(struct spit_engine *e)
+{
+	if (e->answered)
+		return;
+
+	spit_verb(e, "Answered after %d ms of early media, continuing analysis", e->earlyTime);
+	e->answered = 1;
+	e->inRingback = 0;
+	/* Silence before answer is not counted against the caller, start the count again */
+	e->detectorSilence = 0;
+	e->dspSilence = 0;
+	e->silenceDuration = 0;
+}
+
+void spit_engine_ringback(struct spit_engine *e)
+{
+	if (e->answered)
+		return;
+
+	/* Ringback is not a greeting, forget what it made us count and skip it until it pauses */
+	spit_debug(e, "Ringback in early media");
+	e->inInitialSilence = 1;
+	e->inGreeting = 0;
+	e->voiceDuration = 0;
+	e->silenceDuration = 0;
+	e->iWordsCount = 0;
+	e->currentState = STATE_IN_WORD;
+	e->consecutiveVoiceDuration = 0;
+	e->greetingStart = -1;
+	e->inRingback = 1;
+}
+
+void spit_engine_prompt_start(struct spit_engine *e)
+{
+	spit_verb(e, "Prompt started, listening for barge-in");
+	e->promptPlaying = 1;
+	e->promptTime = 0;
+}
+
+void spit_engine_prompt(struct spit_engine *e, const int16_t *samples, int nsamples)
+{
+	int accum = 0;
+	int i;
+
+	if (!nsamples)
+		return;
+
+	for (i = 0; i < nsamples; i++)
+		accum += abs(samples[i]);
+	accum /= nsamples;
+
+	/* Several prompt frames can be written between two caller frames, keep the loudest */
+	if (accum > e->promptPending)
+		e->promptPending = accum;
+}
+
+void spit_engine_prompt_stop(struct spit_engine *e)
+{
+	if (!e->promptPlaying)
+		return;
+
+	/* The echo gate keeps the prompt energy it has for the rest of the echo tail */
+	spit_verb(e, "Prompt stopped after %d ms", e->promptTime);
+	e->promptPlaying = 0;
+}
+
+/* How far the analysis got towards a verdict, short of it */
+static int spit_percent(int value, int limit)
+{
+	if (limit <= 0)
+		return 0;
+	value = value * 100 / limit;
+
+	return value > 99 ? 99 : value;
+}
+
+/* Where the analysis leans: towards MACHINE as the greeting fills up its limits,
+   towards HUMAN as the silence after it or before it grows */
+static void spit_provisional(const struct spit_engine *e, enum spit_status *lean, int *confidence)
+{
+	const struct spit_params *p = &e->params;
+	int machine = 0, human = 0, words;
+
+	if (e->status) {
+		*lean = e->status;
+		*confidence = 100;
+		return;
+	}
+
+	if (e->inGreeting) {
+		machine = spit_percent(e->voiceDuration, p->greeting);
+		if ((words = spit_percent(e->iWordsCount, p->maximumNumberOfWords)) > machine)
+			machine = words;
+		if (e->currentState == STATE_IN_SILENCE)
+			human = spit_percent(e->silenceDuration, p->afterGreetingSilence);
+	} else if (e->inInitialSilence && e->answered) {
+		human = spit_percent(e->silenceDuration, p->initialSilence);
+	}
+
+	if (machine > human) {
+		*lean = SPIT_MACHINE;
+		*confidence = machine;
+	} else if (human) {
+		*lean = SPIT_HUMAN;
+		*confidence = human;
+	} else {
+		*lean = SPIT_UNDECIDED;
+		*confidence = 0;
+	}
+}
+
+int spit_engine_progress(struct spit_engine *e, struct spit_progress *progress)
+{
+	int now = e->iTotalTime + e->earlyTime, confidence;
+	enum spit_status lean;
+
+	if (e->endClock > now)
+		now = e->endClock;
+
+	/* Only a new lean or a step of 25% is news */
+	spit_provisional(e, &lean, &confidence);
+	if (lean != e->provisional || confidence / 25 != e->confidenceStep) {
+		if (lean && !e->status)
+			e->events |= SPIT_EVENT_PROVISIONAL;
+		e->provisional = lean;
+		e->confidenceStep = confidence / 25;
+	}
+
+	if (!e->events)
+		return 0;
+	if (!(e->events & (SPIT_EVENT_VERDICT | SPIT_EVENT_GREETINGEND))
+		&& e->lastProgress && now - e->lastProgress < e->params.progressInterval)
+		return 0;
+
+	progress->events = e->events;
+	progress->time = now;
+	progress->words = e->iWordsCount;
+	progress->voiceDuration = e->voiceDuration;
+	progress->silenceDuration = e->silenceDuration;
+	progress->provisional = lean;
+	progress->confidence = confidence;
+	e->events = 0;
+	e->lastProgress = now;
+
+	return 1;
+}
+
+void spit_event_names(unsigned int events, char *buf, int len)
+{
+	static const char * const names[] = { "FIRSTWORD", "WORD", "SILENCE", "PROVISIONAL", "VERDICT", "GREETINGEND" };
+	int i, used = 0;
+
+	buf[0] = '\0';
+	for (i = 0; i < (int) (sizeof(names) / sizeof(names[0])) && used < len; i++) {
+		if (events & (1 << i))
+			used += snprintf(buf + used, len - used, "%s%s", used ? "," : "", names[i]);
+	}
+}
+
+const char *spit_greeting_end_name(enum spit_greeting_end end)
+{
+	switch (end) {
+	case SPIT_END_BEEP:
+		return "BEEP";
+	case SPIT_END_SILENCE:
+		return "SILENCE";
+	case SPIT_END_TIMEOUT:
+		return "TIMEOUT";
+	case SPIT_END_HANGUP:
+		return "HANGUP";
+	case SPIT_END_NONE:
+		break;
+	}
+
+	return "";
+}
+
+const char *spit_status_name(enum spit_status status)
+{
+	switch (status) {
+	case SPIT_HUMAN:
+		return "HUMAN";
+	case SPIT_MACHINE:
+		return "MACHINE";
+	case SPIT_NOTSURE:
+		return "NOTSURE";
+	case SPIT_HANGUP:
+		return "HANGUP";
+	case SPIT_UNDECIDED:
+		break;
+	}
+
+	return "";
+}
+
+void spit_engine_format(const struct spit_engine *e, char *status, int statuslen, char *cause, int causelen)
+{
+	const int *args = e->causeArgs;
+	int len = 0;
+
+	snprintf(status, statuslen, "%s", spit_status_name(e->status));
+
+	switch (e->cause) {
+	case SPIT_CAUSE_NONE:
+		*cause = '\0';
+		break;
+	case SPIT_CAUSE_TIMEOUT:
+		len = snprintf(cause, causelen, "TIMEOUT-%d", args[0]);
+		break;
+	case SPIT_CAUSE_INITIALSILENCE:
+		len = snprintf(cause, causelen, "INITIALSILENCE-%d-%d", args[0], args[1]);
+		break;
+	case SPIT_CAUSE_SILENCEAFTERNOISE:
+		len = snprintf(cause, causelen, "SILENCEAFTERNOISE-%d-%d", args[0], args[1]);
+		break;
+	case SPIT_CAUSE_MAXWORDLENGTH:
+		len = snprintf(cause, causelen, "MAXWORDLENGTH-%d", args[0]);
+		break;
+	case SPIT_CAUSE_MAXWORDS:
+		len = snprintf(cause, causelen, "MAXWORDS-%d-%d", args[0], args[1]);
+		break;
+	case SPIT_CAUSE_LONGGREETING:
+		len = snprintf(cause, causelen, "LONGGREETING-%d-%d", args[0], args[1]);
+		break;
+	case SPIT_CAUSE_DTMF:
+		len = snprintf(cause, causelen, "DTMF-%d", args[0]);
+		break;
+	case SPIT_CAUSE_NOFRAMES:
+		len = snprintf(cause, causelen, "NOFRAMES-%d", args[0]);
+		break;
+	case SPIT_CAUSE_EARLYTIMEOUT:
+		len = snprintf(cause, causelen, "EARLYTIMEOUT-%d", args[0]);
+		break;
+	case SPIT_CAUSE_LOSS:
+		len = snprintf(cause, causelen, "LOSS-%d-%d", args[0], args[1]);
+		break;
+	case SPIT_CAUSE_BURST:
+		len = snprintf(cause, causelen, "BURST-%s-%u", e->burst.prefix, e->burst.count);
+		break;
+	case SPIT_CAUSE_BARGEIN:
+		len = snprintf(cause, causelen, "BARGEIN-%d-%d", args[0], args[1]);
+		break;
+	case SPIT_CAUSE_SYNTHETIC:
+		len = snprintf(cause, causelen, "SYNTHETIC-%d-%d", args[0], args[1]);
+		break;
+	}
+
+	/* Tell the dialplan how much audio the verdict was made without */
+	if (e->lostTime > 0 && e->cause != SPIT_CAUSE_NONE && e->cause != SPIT_CAUSE_LOSS && len < causelen)
+		snprintf(cause + len, causelen - len, "-LOSS-%d-%d", e->lostTime, e->lossGaps);
+}
+
+void spit_engine_features(const struct spit_engine *e, struct spit_features *features)
+{
+	features->voiceDuration = e->voiceDuration;
+	features->words = e->iWordsCount;
+	features->shortWords = e->shortWords;
+	features->longestWord = e->longestWord;
+	features->initialSilence = e->greetingStart;
+	features->longestSilence = e->longestSilence;
+	features->gaps = e->wordGaps;
+	features->analysisTime = e->iTotalTime;
+	features->earlyTime = e->earlyTime;
+	features->decisionTime = 0;
+	features->lost = e->lostTime;
+	features->lossGaps = e->lossGaps;
+	features->burstCalls = e->burst.count;
+	features->answered = e->answered;
+	features->bargeIn = e->bargeIn;
+	features->echoTime = e->echoTime;
+	features->modulation = e->modulation;
+	features->pitchJitter = e->pitchJitter;
+}
+
+/* Totals of the per stage cycle counters over all analyses since load. Each
+   analysis adds up its own counters and folds them in here once at the end. */
+static struct spit_perf_stage perfTotals[SPIT_STAGES];
+static uint64_t perfAnalyses;
+
+void spit_engine_perf(struct spit_engine *e, enum spit_stage stage, uint64_t cycles, int samples)
+{
+	e->perf[stage].cycles += cycles;
+	e->perf[stage].calls++;
+	e->perf[stage].samples += samples;
+}
+
+void spit_perf_commit(const struct spit_engine *e)
+{
+	int i;
+
+	for (i = 0; i < SPIT_STAGES; i++) {
+		if (!e->perf[i].calls)
+			continue;
+		__atomic_fetch_add(&perfTotals[i].cycles, e->perf[i].cycles, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&perfTotals[i].calls, e->perf[i].calls, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&perfTotals[i].samples, e->perf[i].samples, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&perfTotals[i].analyses, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&perfTotals[i].verdicts, e->perf[i].verdicts, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&perfTotals[i].overBudget, e->perf[i].overBudget, __ATOMIC_RELAXED);
+	}
+	__atomic_fetch_add(&perfAnalyses, 1, __ATOMIC_RELAXED);
+}
+
+uint64_t spit_perf_get(struct spit_perf_stage *stages)
+{
+	int i;
+
+	for (i = 0; i < SPIT_STAGES; i++) {
+		stages[i].cycles = __atomic_load_n(&perfTotals[i].cycles, __ATOMIC_RELAXED);
+		stages[i].calls = __atomic_load_n(&perfTotals[i].calls, __ATOMIC_RELAXED);
+		stages[i].samples = __atomic_load_n(&perfTotals[i].samples, __ATOMIC_RELAXED);
+		stages[i].analyses = __atomic_load_n(&perfTotals[i].analyses, __ATOMIC_RELAXED);
+		stages[i].verdicts = __atomic_load_n(&perfTotals[i].verdicts, __ATOMIC_RELAXED);
+		stages[i].overBudget = __atomic_load_n(&perfTotals[i].overBudget, __ATOMIC_RELAXED);
+	}
+
+	return __atomic_load_n(&perfAnalyses, __ATOMIC_RELAXED);
+}
+
+const char *spit_stage_name(enum spit_stage stage)
+{
+	switch (stage) {
+	case SPIT_STAGE_INGEST:
+		return "ingest";
+	case SPIT_STAGE_BURST:
+		return "burst";
+	case SPIT_STAGE_DTMF:
+		return "dtmf";
+	case SPIT_STAGE_ENERGY:
+		return "energy";
+	case SPIT_STAGE_STEP:
+		return "words";
+	case SPIT_STAGE_SYNTHETIC:
+		return "synthetic";
+	case SPIT_STAGE_VERDICT:
+		return "verdict";
+	case SPIT_STAGES:
+		break;
+	}
+
+	return "";
+}
+
+/* Campaign burst detection. Call arrivals are counted per ANI prefix in a sliding
+   window of count-min sketches, so memory stays fixed no matter how many distinct
+   numbers call us. Updates are lock free, only the heavy hitter list takes a lock
+   and only when it can get it without waiting. */
+struct burst_slot {
+	unsigned int epoch;	/* Window slot number these counters belong to */
+	unsigned int cells[BURST_DEPTH][BURST_WIDTH];
+};
+
+/* spit_burst_defaults() until a configuration is loaded */
+static struct spit_burst_config burstConfig;
+static unsigned int burstSeq;
+static pthread_once_t burstOnce = PTHREAD_ONCE_INIT;
+
+static struct burst_slot burstSketch[BURST_MAX_PREFIXES][BURST_SLOTS];
+static struct spit_burst_heavy_hitter burstHeavyHitters[BURST_HEAVY_HITTERS];
+static pthread_mutex_t burstHeavyLock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int burst_hash(const char *prefix, int len, int row)
+{
+	/* FNV-1a, with the row number mixed into the offset basis */
+	unsigned int hash = 2166136261U ^ (row * 0x9e3779b9U);
+	int i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char) prefix[i];
+		hash *= 16777619U;
+	}
+
+	return hash % BURST_WIDTH;
+}
+
+static unsigned int burst_epoch(const struct spit_burst_config *config, int64_t now)
+{
+	int slotLength = config->window / BURST_SLOTS;
+
+	if (slotLength < 1)
+		slotLength = 1;
+
+	/* Epoch 0 is reserved to mark a slot as empty */
+	return (unsigned int) (now / slotLength) + 1;
+}
+
+static void burst_count(struct burst_slot *slots, const char *prefix, int len, unsigned int epoch)
+{
+	struct burst_slot *slot = &slots[epoch % BURST_SLOTS];
+	unsigned int seen = __atomic_load_n(&slot->epoch, __ATOMIC_ACQUIRE);
+	int row, i;
+
+	if (seen != epoch && __atomic_compare_exchange_n(&slot->epoch, &seen, epoch, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		/* We won the rotation of this slot, clear what it counted one window ago.
+		   A few increments racing with this are lost, which the sketch tolerates. */
+		for (row = 0; row < BURST_DEPTH; row++) {
+			for (i = 0; i < BURST_WIDTH; i++)
+				__atomic_store_n(&slot->cells[row][i], 0, __ATOMIC_RELAXED);
+		}
+	}
+
+	for (row = 0; row < BURST_DEPTH; row++)
+		__atomic_fetch_add(&slot->cells[row][burst_hash(prefix, len, row)], 1, __ATOMIC_RELAXED);
+}
+
+static unsigned int burst_estimate(struct burst_slot *slots, const char *prefix, int len, unsigned int epoch)
+{
+	unsigned int estimate = UINT_MAX;
+	unsigned int hashes[BURST_DEPTH];
+	unsigned int sums[BURST_DEPTH] = { 0, };
+	int row, i;
+
+	for (row = 0; row < BURST_DEPTH; row++)
+		hashes[row] = burst_hash(prefix, len, row);
+
+	for (i = 0; i < BURST_SLOTS; i++) {
+		unsigned int slotEpoch = __atomic_load_n(&slots[i].epoch, __ATOMIC_ACQUIRE);
+
+		/* Only slots inside the sliding window count */
+		if (!slotEpoch || slotEpoch > epoch || epoch - slotEpoch >= BURST_SLOTS)
+			continue;
+		for (row = 0; row < BURST_DEPTH; row++)
+			sums[row] += __atomic_load_n(&slots[i].cells[row][hashes[row]], __ATOMIC_RELAXED);
+	}
+
+	for (row = 0; row < BURST_DEPTH; row++) {
+		if (sums[row] < estimate)
+			estimate = sums[row];
+	}
+
+	return estimate;
+}
+
+static void burst_note_heavy_hitter(int sketch, const char *prefix, int len, unsigned int count, int64_t now)
+{
+	int i, victim = 0;
+
+	/* Never wait for the lock on the call path, the list is only for display */
+	if (pthread_mutex_trylock(&burstHeavyLock))
+		return;
+
+	for (i = 0; i < BURST_HEAVY_HITTERS; i++) {
+		if (burstHeavyHitters[i].sketch == sketch && !strncmp(burstHeavyHitters[i].prefix, prefix, len)
+			&& burstHeavyHitters[i].prefix[len] == '\0') {
+			victim = i;
+			break;
+		}
+		if (burstHeavyHitters[i].count < burstHeavyHitters[victim].count)
+			victim = i;
+	}
+
+	if (i < BURST_HEAVY_HITTERS || count >= burstHeavyHitters[victim].count) {
+		burstHeavyHitters[victim].sketch = sketch;
+		snprintf(burstHeavyHitters[victim].prefix, sizeof(burstHeavyHitters[victim].prefix), "%.*s", len, prefix);
+		burstHeavyHitters[victim].count = count;
+		burstHeavyHitters[victim].last = now;
+	}
+
+	pthread_mutex_unlock(&burstHeavyLock);
+}
+
+void spit_burst_defaults(struct spit_burst_config *config)
+{
+	memset(config, 0, sizeof(*config));
+	config->enabled = 0;
+	config->window = 10000;
+	config->threshold = 20;
+	config->action = BURST_ACTION_STRICT;
+	config->prefixes[0] = 6;
+	config->prefixes[1] = 8;
+	config->numPrefixes = 2;
+	config->greeting = -1;
+	config->maximumNumberOfWords = -1;
+	config->totalAnalysisTime = -1;
+	config->maximumWordLength = -1;
+}
+
+static void spit_burst_init(void)
+{
+	spit_burst_defaults(&burstConfig);
+}
+
+void spit_burst_get_config(struct spit_burst_config *config)
+{
+	pthread_once(&burstOnce, spit_burst_init);
+	config_read(&burstSeq, config, &burstConfig, sizeof(*config));
+}
+
+void spit_burst_configure(const struct spit_burst_config *config)
+{
+	struct spit_burst_config burst = *config;
+	int i, j, recount;
+
+	if (burst.window < BURST_SLOTS)
+		burst.window = BURST_SLOTS;
+	if (burst.threshold < 1)
+		burst.threshold = 1;
+
+	pthread_once(&burstOnce, spit_burst_init);
+	pthread_mutex_lock(&configLock);
+	/* Only writers change burstConfig, with configLock held it can be read as is */
+	recount = burst.window != burstConfig.window || burst.numPrefixes != burstConfig.numPrefixes
+		|| memcmp(burst.prefixes, burstConfig.prefixes, sizeof(burst.prefixes));
+	config_publish(&burstSeq, &burstConfig, &burst, sizeof(burstConfig));
+	pthread_mutex_unlock(&configLock);
+
+	if (!recount)
+		return;
+
+	/* The counts were for another window or other prefix lengths, start counting over */
+	for (i = 0; i < BURST_MAX_PREFIXES; i++) {
+		for (j = 0; j < BURST_SLOTS; j++)
+			__atomic_store_n(&burstSketch[i][j].epoch, 0, __ATOMIC_RELEASE);
+	}
+
+	pthread_mutex_lock(&burstHeavyLock);
+	memset(burstHeavyHitters, 0, sizeof(burstHeavyHitters));
+	pthread_mutex_unlock(&burstHeavyLock);
+}
+
+void spit_burst_record(const char *ani, int64_t now, struct spit_burst_hit *hit)
+{
+	struct spit_burst_config config;
+	char digits[BURST_MAX_PREFIX_LEN + 1];
+	unsigned int epoch, count;
+	int len = 0, i;
+
+	if (!ani || !*ani)
+		return;
+
+	spit_burst_get_config(&config);
+	if (!config.enabled)
+		return;
+	for (; *ani && len < BURST_MAX_PREFIX_LEN; ani++) {
+		if (*ani >= '0' && *ani <= '9')
+			digits[len++] = *ani;
+	}
+	digits[len] = '\0';
+
+	epoch = burst_epoch(&config, now);
+	for (i = 0; i < config.numPrefixes; i++) {
+		if (config.prefixes[i] > len)
+			continue;
+		burst_count(burstSketch[i], digits, config.prefixes[i], epoch);
+		count = burst_estimate(burstSketch[i], digits, config.prefixes[i], epoch);
+		if (count >= (unsigned int) config.threshold / 2)
+			burst_note_heavy_hitter(i, digits, config.prefixes[i], count, now);
+		if (count > hit->count) {
+			hit->count = count;
+			snprintf(hit->prefix, sizeof(hit->prefix), "%.*s", config.prefixes[i], digits);
+		}
+	}
+}
+
+int spit_burst_heavy_hitters(int64_t now, struct spit_burst_heavy_hitter *hitters, int max)
+{
+	struct spit_burst_heavy_hitter copy[BURST_HEAVY_HITTERS];
+	struct spit_burst_config config;
+	unsigned int epoch, count;
+	int i, found = 0;
+
+	spit_burst_get_config(&config);
+	epoch = burst_epoch(&config, now);
+	pthread_mutex_lock(&burstHeavyLock);
+	memcpy(copy, burstHeavyHitters, sizeof(copy));
+	pthread_mutex_unlock(&burstHeavyLock);
+
+	for (i = 0; i < BURST_HEAVY_HITTERS && found < max; i++) {
+		if (!copy[i].prefix[0] || copy[i].sketch >= config.numPrefixes)
+			continue;
+		/* Entries are only refreshed by new calls, so ask the sketch for the live rate */
+		count = burst_estimate(burstSketch[copy[i].sketch], copy[i].prefix, strlen(copy[i].prefix), epoch);
+		if (!count)
+			continue;
+		hitters[found] = copy[i];
+		hitters[found].count = count;
+		found++;
+	}
+
+	return found;
+}
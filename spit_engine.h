@@ -0,0 +1,511 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2003 - 2006, Aheeva Technology.
+ *
+ * Claude Klimos (claude.klimos@aheeva.com)
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Automated Dialer detection engine shared by app_spit and app_spit14
+ *
+ * The engine knows nothing about Asterisk. The modules read frames from the
+ * channel, convert them to signed linear and hand them over together with
+ * the other events of the call (timeouts, DTMF, answer, ringback). The engine
+ * runs the detection state machine and keeps the verdict.
+ *
+ * \author Justin Zimmer (jzimmer@leasehawk.com)
+ */
+
+#ifndef _SPIT_ENGINE_H
+#define _SPIT_ENGINE_H
+
+#include <stdint.h>
+#include <time.h>
+
+/* The engine only works on 8kHz signed linear audio */
+#define SPIT_SAMPLES_PER_MS     8
+
+#define STATE_IN_WORD           1
+#define STATE_IN_SILENCE        2
+
+/* How much the engine tells the log callback */
+#define SPIT_LOG_NONE           0
+#define SPIT_LOG_VERBOSE        1
+#define SPIT_LOG_DEBUG          2
+
+/* Synthetic speech detector: 10ms envelope samples, a 1s window of them for the
+   modulation spectrum and the 2-8 Hz bins we look at in it */
+#define SPIT_ENV_SAMPLES        80
+#define SPIT_MOD_WINDOW         100
+#define SPIT_MOD_LOW            2
+#define SPIT_MOD_HIGH           8
+#define SPIT_MOD_BINS           (SPIT_MOD_HIGH - SPIT_MOD_LOW + 1)
+/* Audio decimated to 4kHz kept for the pitch estimate, 40ms */
+#define SPIT_PITCH_BUF          160
+
+/* Words kept on the timeline of an analysis */
+#define SPIT_TIMELINE           8
+
+/* Prompt energy is remembered this many caller frames back, to cover the echo path delay */
+#define SPIT_ECHO_TAIL          8
+
+/* Stages of an analysis, timed when perf_counters is on. All but ingest and verdict
+   are detection stages the pipeline runs in the order of [pipeline] in spit.conf. */
+enum spit_stage {
+	SPIT_STAGE_INGEST = 0,	/* Reading the frame and converting it to signed linear */
+	SPIT_STAGE_BURST,	/* The caller ANI prefix is part of a call burst */
+	SPIT_STAGE_DTMF,	/* DTMF from the caller */
+	SPIT_STAGE_ENERGY,	/* Silence detection */
+	SPIT_STAGE_STEP,	/* Detection state machine, words and silences */
+	SPIT_STAGE_SYNTHETIC,	/* Modulation spectrum and pitch of the synthetic speech detector */
+	SPIT_STAGE_VERDICT,	/* Formatting the verdict and setting the variables */
+	SPIT_STAGES,
+};
+
+struct spit_perf_stage {
+	uint64_t cycles;
+	uint64_t calls;
+	uint64_t samples;
+	uint64_t analyses;	/* Analyses the stage ran in */
+	uint64_t verdicts;	/* Of those, the ones it decided */
+	uint64_t overBudget;	/* Of those, the ones it was stopped in for going over its budget */
+};
+
+/* A stage has to average a second of audio before its budget is checked */
+#define SPIT_BUDGET_MIN_SAMPLES     8000
+
+/* The detection stages and the order they run in */
+struct spit_pipeline {
+	int numStages;
+	int stages[SPIT_STAGES];	/* enum spit_stage */
+	int budget[SPIT_STAGES];	/* Cycles per sample a stage may average in an analysis, 0 for no limit */
+};
+
+/* Cheapest clock we have, TSC cycles on x86 and ns elsewhere */
+static inline uint64_t spit_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+enum spit_status {
+	SPIT_UNDECIDED = 0,
+	SPIT_HUMAN,
+	SPIT_MACHINE,
+	SPIT_NOTSURE,
+	SPIT_HANGUP,
+};
+
+/* What happened since the last progress report, see spit_engine_progress() */
+#define SPIT_EVENT_FIRSTWORD    (1 << 0)	/* The greeting started */
+#define SPIT_EVENT_WORD         (1 << 1)	/* The word count went up */
+#define SPIT_EVENT_SILENCE      (1 << 2)	/* Silence after a word, it may go on to afterGreetingSilence */
+#define SPIT_EVENT_PROVISIONAL  (1 << 3)	/* The provisional verdict or its confidence changed */
+#define SPIT_EVENT_VERDICT      (1 << 4)
+#define SPIT_EVENT_GREETINGEND  (1 << 5)
+
+/* How the greeting ended, when we keep listening after a MACHINE verdict */
+enum spit_greeting_end {
+	SPIT_END_NONE = 0,
+	SPIT_END_BEEP,
+	SPIT_END_SILENCE,
+	SPIT_END_TIMEOUT,
+	SPIT_END_HANGUP,
+};
+
+enum spit_cause {
+	SPIT_CAUSE_NONE = 0,
+	SPIT_CAUSE_TIMEOUT,
+	SPIT_CAUSE_INITIALSILENCE,
+	SPIT_CAUSE_SILENCEAFTERNOISE,
+	SPIT_CAUSE_MAXWORDLENGTH,
+	SPIT_CAUSE_MAXWORDS,
+	SPIT_CAUSE_LONGGREETING,
+	SPIT_CAUSE_DTMF,
+	SPIT_CAUSE_NOFRAMES,
+	SPIT_CAUSE_EARLYTIMEOUT,
+	SPIT_CAUSE_LOSS,
+	SPIT_CAUSE_BURST,
+	SPIT_CAUSE_BARGEIN,
+	SPIT_CAUSE_SYNTHETIC,
+};
+
+/* Algorithm parameters, from spit.conf and the application arguments */
+struct spit_params {
+	int initialSilence;
+	int greeting;
+	int afterGreetingSilence;
+	int totalAnalysisTime;
+	int minimumWordLength;
+	int betweenWordsSilence;
+	int maximumNumberOfWords;
+	int silenceThreshold;
+	int maximumWordLength;
+	int earlyMediaTimeout;
+	int lossTolerance;
+	int maxLossPercent;
+	int echoReturnLoss;
+	int bargeInSilence;
+	int perfCounters;
+	int synthetic;
+	int syntheticMinVoice;
+	int syntheticModulation;
+	int syntheticPitchJitter;
+	int trackGreetingEnd;	/* Keep listening after a MACHINE verdict until the greeting ends */
+	int greetingEndSilence;
+	int greetingEndTimeout;
+	int beepMinLength;
+	int progressEvents;
+	int progressInterval;
+};
+
+/* Timing information the channel gave us with a frame */
+struct spit_frame_info {
+	int hasSeqno;
+	int seqno;
+	int hasTimestamp;
+	long ts;
+};
+
+/* What an analysis measured, kept on the channel for SPIT_FEATURES() */
+struct spit_features {
+	int voiceDuration;
+	int words;
+	int shortWords;
+	int longestWord;
+	int initialSilence;
+	int longestSilence;
+	int gaps;
+	int analysisTime;
+	int earlyTime;
+	int decisionTime;
+	int lost;
+	int lossGaps;
+	int burstCalls;
+	int answered;
+	int bargeIn;
+	int echoTime;
+	int modulation;
+	int pitchJitter;
+};
+
+/* A progress report, what the analysis looks like so far */
+struct spit_progress {
+	unsigned int events;	/* SPIT_EVENT_* since the last report */
+	int time;	/* ms of audio since SPIT started */
+	int words;
+	int voiceDuration;
+	int silenceDuration;
+	enum spit_status provisional;	/* Where the analysis leans, the status once there is a verdict */
+	int confidence;	/* How far it got towards that verdict in %, 100 once it is final */
+};
+
+#define BURST_ACTION_STRICT     0
+#define BURST_ACTION_MACHINE    1
+
+#define BURST_MAX_PREFIXES      4
+#define BURST_MAX_PREFIX_LEN    15
+#define BURST_HEAVY_HITTERS     16
+
+struct spit_burst_config {
+	int enabled;
+	int window;
+	int threshold;
+	int action;
+	int prefixes[BURST_MAX_PREFIXES];
+	int numPrefixes;
+	/* Strict profile applied to calls from a bursting prefix, -1 keeps the normal value */
+	int greeting;
+	int maximumNumberOfWords;
+	int totalAnalysisTime;
+	int maximumWordLength;
+};
+
+/* Result of recording a call in the burst sketches */
+struct spit_burst_hit {
+	char prefix[BURST_MAX_PREFIX_LEN + 1];
+	unsigned int count;
+};
+
+struct spit_burst_heavy_hitter {
+	int sketch;	/* Index into the configured prefixes the prefix was counted under */
+	char prefix[BURST_MAX_PREFIX_LEN + 1];
+	unsigned int count;
+	int64_t last;
+};
+
+struct spit_engine {
+	struct spit_params params;
+	int maxWaitTimeForFrame;
+
+	/* Detection state machine */
+	int inInitialSilence;
+	int inGreeting;
+	int currentState;
+	int voiceDuration;
+	int silenceDuration;
+	int consecutiveVoiceDuration;
+	int iWordsCount;
+	int iTotalTime;
+	int dspSilence;
+	int detectorSilence;
+	int energy;
+
+	/* Early media */
+	int answered;
+	int inRingback;
+	int earlyTime;
+
+	/* Audio of the runs before a resume, each run gets totalAnalysisTime and earlyMediaTimeout of its own */
+	int resumedTime;
+	int resumedEarlyTime;
+
+	/* Time without audio. Only sequence and timestamp gaps count as lost */
+	int unknownRun;
+	int waitedTime;
+	int lostTime;
+	int lossGaps;
+	int lastSeqno;
+	int lastFrameLength;
+	long lastTs;
+
+	/* Barge-in, our prompt plays while we listen */
+	int promptPlaying;
+	int promptTime;
+	int promptPending;
+	int promptEnergy[SPIT_ECHO_TAIL];
+	int promptPos;
+	int echoGain;	/* Echo level relative to the prompt, in 1/4096 */
+	int bargeIn;
+	int echoTime;
+
+	/* Synthetic speech detector */
+	int envAccum;
+	int envCount;
+	int envMean;	/* Running mean of the envelope in 1/16 */
+	int envHistory[SPIT_MOD_WINDOW];
+	int envPos;
+	int envFilled;
+	double modRe[SPIT_MOD_BINS];	/* Sliding DFT of the envelope */
+	double modIm[SPIT_MOD_BINS];
+	int16_t pitchBuf[SPIT_PITCH_BUF];
+	int lastPitchLag;
+	int pitchFrames;
+	int pitchLagSum;
+	int pitchDeltaSum;
+	int modulation;
+	int pitchJitter;
+
+	/* Detection stages of this analysis, a stage with its bit in stagesOff is skipped */
+	struct spit_pipeline pipeline;
+	unsigned int stagesOff;
+	unsigned int budgetOff;	/* Stages off for going over their budget, they stay off after a resume */
+
+	/* Runs and verdicts per stage in this analysis, cycles only with perfCounters or a budget */
+	struct spit_perf_stage perf[SPIT_STAGES];
+
+	/* Measurements for SPIT_FEATURES() */
+	int longestWord;
+	int shortWords;
+	int longestSilence;
+	int wordGaps;
+	int greetingStart;
+
+	/* Start and length of the first words in 10ms, for the analytics log */
+	uint16_t timelineStart[SPIT_TIMELINE];
+	uint16_t timelineLength[SPIT_TIMELINE];
+	int timelineCount;
+	int timelineOpen;
+
+	/* Greeting end, tracked after a MACHINE verdict. Times are ms of audio since SPIT started. */
+	int endTracking;
+	int endClock;
+	int endStart;
+	int endSilence;
+	int toneTime;
+	int toneCoeff;	/* 2cos(w) of the tone in the last frame, in 1/4096 */
+	int greetingEnd;
+	enum spit_greeting_end greetingEndCause;
+
+	/* Progress reports */
+	unsigned int events;
+	int lastProgress;
+	enum spit_status provisional;
+	int confidenceStep;
+
+	/* Verdict */
+	enum spit_status status;
+	enum spit_cause cause;
+	int causeArgs[2];
+	struct spit_burst_hit burst;
+	int burstStrict;	/* The strict profile of [burst] is in params, a resumed run keeps it */
+
+	/* Where the engine's log messages go, formatted only when logLevel asks for them */
+	int logLevel;
+	void (*log)(void *data, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+	void *logData;
+};
+
+/*! \brief Whether a spit.conf value means yes */
+int spit_true(const char *value);
+
+/*! \brief Fill in the built in defaults */
+void spit_params_defaults(struct spit_params *params);
+
+/*!
+ * \brief Apply one spit.conf setting
+ * \retval 0 the setting was known and applied
+ * \retval -1 unknown category or keyword
+ */
+int spit_config_apply(struct spit_params *params, struct spit_burst_config *burst,
+	const char *category, const char *name, const char *value);
+
+/*!
+ * \brief Write the parameters as spit.conf [general] settings, name=value separated by spaces
+ * \retval 0 everything fit
+ * \retval -1 buf was too short
+ */
+int spit_params_format(const struct spit_params *params, char *buf, int len);
+
+/*! \brief Start a new analysis, answered is 0 for early media */
+void spit_engine_init(struct spit_engine *e, const struct spit_params *params, int answered);
+
+/*!
+ * \brief Continue an analysis an earlier run left unfinished
+ * \param e engine state kept from the earlier run
+ * \param params parameters for the rest of the analysis. totalAnalysisTime and
+ *        earlyMediaTimeout count from the resume, the words and silence heard
+ *        before still count. The strict burst profile goes on top of them
+ *        when the earlier run used it.
+ * \param answered whether the channel is answered now
+ * \return the status, SPIT_UNDECIDED when the analysis goes on. An earlier
+ *         verdict other than TIMEOUT or EARLYTIMEOUT is kept.
+ */
+enum spit_status spit_engine_resume(struct spit_engine *e, const struct spit_params *params, int answered);
+
+/*! \brief Apply the burst profile for a call, may settle the verdict right away */
+enum spit_status spit_engine_burst(struct spit_engine *e, const struct spit_burst_hit *hit);
+
+/*! \brief Feed a frame of signed linear audio */
+enum spit_status spit_engine_audio(struct spit_engine *e, const int16_t *samples, int nsamples,
+	const struct spit_frame_info *info);
+
+/*! \brief The far end sent comfort noise */
+enum spit_status spit_engine_comfort_noise(struct spit_engine *e);
+
+/*! \brief Waiting for media timed out */
+enum spit_status spit_engine_timeout(struct spit_engine *e);
+
+/*! \brief The far end sent a DTMF digit */
+enum spit_status spit_engine_dtmf(struct spit_engine *e, int digit);
+
+/*! \brief The channel hung up */
+enum spit_status spit_engine_hangup(struct spit_engine *e);
+
+/*! \brief The channel stopped giving us frames before a verdict */
+enum spit_status spit_engine_noframes(struct spit_engine *e);
+
+/*! \brief The call was answered during early media analysis */
+void spit_engine_answer(struct spit_engine *e);
+
+/*! \brief Ringback was found in the early media */
+void spit_engine_ringback(struct spit_engine *e);
+
+/*! \brief Our prompt started playing to the caller */
+void spit_engine_prompt_start(struct spit_engine *e);
+
+/*! \brief Feed a frame of the prompt as it was written to the caller */
+void spit_engine_prompt(struct spit_engine *e, const int16_t *samples, int nsamples);
+
+/*! \brief Our prompt stopped playing */
+void spit_engine_prompt_stop(struct spit_engine *e);
+
+/*!
+ * \brief Take a progress report when there is something new to tell
+ * \retval 1 progress was filled in and the events are cleared
+ * \retval 0 nothing new, or the last report was less than progressInterval ago
+ *
+ * The verdict and the end of the greeting are reported right away.
+ */
+int spit_engine_progress(struct spit_engine *e, struct spit_progress *progress);
+
+/*! \brief Comma separated names of SPIT_EVENT_* flags */
+void spit_event_names(unsigned int events, char *buf, int len);
+
+/*! \brief Name of a greeting end as set in SPITGREETINGENDCAUSE */
+const char *spit_greeting_end_name(enum spit_greeting_end end);
+
+/*! \brief Name of a status as set in SPITSTATUS */
+const char *spit_status_name(enum spit_status status);
+
+/*! \brief Format the verdict as SPITSTATUS and SPITCAUSE */
+void spit_engine_format(const struct spit_engine *e, char *status, int statuslen, char *cause, int causelen);
+
+/*! \brief Copy out the measurements, decisionTime is left to the caller */
+void spit_engine_features(const struct spit_engine *e, struct spit_features *features);
+
+/*! \brief Charge cycles spent outside the engine to a stage of this analysis */
+void spit_engine_perf(struct spit_engine *e, enum spit_stage stage, uint64_t cycles, int samples);
+
+/*! \brief Add the runs, verdicts and cycles of a finished analysis to the module totals */
+void spit_perf_commit(const struct spit_engine *e);
+
+/*! \brief Copy out the module totals, returns the number of analyses they cover */
+uint64_t spit_perf_get(struct spit_perf_stage *stages);
+
+/*! \brief Name of a stage as shown by "spit show perf" and listed in [pipeline] */
+const char *spit_stage_name(enum spit_stage stage);
+
+/*! \brief Fill in the built in pipeline, every detection stage in the order they always ran */
+void spit_pipeline_defaults(struct spit_pipeline *pipeline);
+
+/*!
+ * \brief Apply one setting of the [pipeline] section of spit.conf
+ * \retval 0 the setting was known and applied
+ * \retval -1 unknown keyword or bad value, the pipeline is left alone
+ */
+int spit_pipeline_config_apply(struct spit_pipeline *pipeline, const char *name, const char *value);
+
+/*! \brief Use a new pipeline for the analyses that start from now on */
+void spit_pipeline_configure(const struct spit_pipeline *pipeline);
+
+/*! \brief Copy out the pipeline in use */
+void spit_pipeline_get(struct spit_pipeline *pipeline);
+
+/*! \brief Format the stages of a pipeline as a comma separated list */
+void spit_pipeline_format(const struct spit_pipeline *pipeline, char *buf, int len);
+
+/*! \brief Fill in the built in burst defaults */
+void spit_burst_defaults(struct spit_burst_config *config);
+
+/*! \brief Copy out the burst configuration in effect */
+void spit_burst_get_config(struct spit_burst_config *config);
+
+/*! \brief Replace the burst configuration, counting starts over when the window or prefixes change */
+void spit_burst_configure(const struct spit_burst_config *config);
+
+/*! \brief Count a call from ani and report its busiest prefix, nothing when burst detection is off */
+void spit_burst_record(const char *ani, int64_t now, struct spit_burst_hit *hit);
+
+/*! \brief Copy out the heavy hitters with their live rate, returns how many */
+int spit_burst_heavy_hitters(int64_t now, struct spit_burst_heavy_hitter *hitters, int max);
+
+#endif /* _SPIT_ENGINE_H */
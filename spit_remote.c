@@ -0,0 +1,456 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Analysis on a spitd server, the protocol and the client the module uses
+ *
+ * Like the engine this file does not include any Asterisk header. Link it
+ * next to spit_engine.c, see there. spitd links it too.
+ *
+ * \author Justin Zimmer (jzimmer@leasehawk.com)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "spit_remote.h"
+
+#define RTP_HEADER              12
+
+static struct spit_remote_config remoteConfig;
+static pthread_mutex_t remoteLock = PTHREAD_MUTEX_INITIALIZER;
+
+void spit_remote_defaults(struct spit_remote_config *config)
+{
+	memset(config, 0, sizeof(*config));
+	strcpy(config->host, "127.0.0.1");
+	config->port = SPIT_REMOTE_PORT;
+	config->timeout = 2000;
+	config->fallback = 1;
+}
+
+int spit_remote_config_apply(struct spit_remote_config *config, const char *name, const char *value)
+{
+	if (!strcasecmp(name, "enabled")) {
+		config->enabled = spit_true(value);
+	} else if (!strcasecmp(name, "host")) {
+		snprintf(config->host, sizeof(config->host), "%s", value);
+	} else if (!strcasecmp(name, "port")) {
+		config->port = atoi(value);
+	} else if (!strcasecmp(name, "timeout")) {
+		config->timeout = atoi(value);
+	} else if (!strcasecmp(name, "fallback")) {
+		config->fallback = spit_true(value);
+	} else {
+		return -1;
+	}
+
+	return 0;
+}
+
+void spit_remote_configure(const struct spit_remote_config *config)
+{
+	pthread_mutex_lock(&remoteLock);
+	remoteConfig = *config;
+	if (remoteConfig.timeout < 1)
+		remoteConfig.timeout = 1;
+	pthread_mutex_unlock(&remoteLock);
+}
+
+void spit_remote_get_config(struct spit_remote_config *config)
+{
+	pthread_mutex_lock(&remoteLock);
+	*config = remoteConfig;
+	pthread_mutex_unlock(&remoteLock);
+}
+
+int spit_remote_enabled(void)
+{
+	return __atomic_load_n(&remoteConfig.enabled, __ATOMIC_RELAXED);
+}
+
+static int remote_send(struct spit_remote *r, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static int remote_send(struct spit_remote *r, const char *fmt, ...)
+{
+	char buf[SPIT_REMOTE_LINE_LEN];
+	va_list ap;
+	int len, sent = 0, res;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (len < 0 || len >= (int) sizeof(buf))
+		return -1;
+
+	while (sent < len) {
+		if ((res = send(r->control, buf + sent, len - sent, MSG_NOSIGNAL)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		sent += res;
+	}
+
+	return 0;
+}
+
+/* Connect without waiting longer than timeout ms */
+static int remote_connect(const struct sockaddr *addr, socklen_t addrlen, int timeout)
+{
+	struct pollfd pfd;
+	int fd, flags, err = 0;
+	socklen_t errlen = sizeof(err);
+
+	if ((fd = socket(addr->sa_family, SOCK_STREAM, 0)) < 0)
+		return -1;
+
+	flags = fcntl(fd, F_GETFL);
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+	if (connect(fd, addr, addrlen) && errno != EINPROGRESS) {
+		close(fd);
+		return -1;
+	}
+
+	pfd.fd = fd;
+	pfd.events = POLLOUT;
+	if (poll(&pfd, 1, timeout) != 1 || getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) || err) {
+		close(fd);
+		return -1;
+	}
+	fcntl(fd, F_SETFL, flags);
+
+	return fd;
+}
+
+/*
+ * Take the next whole line out of the buffer.
+ * \retval 1 line holds it
+ * \retval 0 no whole line yet
+ * \retval -1 the connection was lost
+ */
+static int remote_line(struct spit_remote *r, char *line, int len)
+{
+	char *end;
+	int res;
+
+	for (;;) {
+		if ((end = memchr(r->line, '\n', r->used))) {
+			*end = '\0';
+			snprintf(line, len, "%s", r->line);
+			r->used -= end + 1 - r->line;
+			memmove(r->line, end + 1, r->used);
+			return 1;
+		}
+		/* A line that does not fit is not one of ours */
+		if (r->used == sizeof(r->line))
+			r->used = 0;
+		if ((res = recv(r->control, r->line + r->used, sizeof(r->line) - r->used, MSG_DONTWAIT)) > 0) {
+			r->used += res;
+		} else if (!res) {
+			return -1;
+		} else if (errno != EINTR) {
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+		}
+	}
+}
+
+int spit_remote_start(struct spit_remote *r, const char *id, const struct spit_params *params, int answered,
+	const char *ani)
+{
+	struct spit_remote_config config;
+	struct addrinfo hints, *addrs, *ai;
+	struct sockaddr_storage peer;
+	socklen_t peerlen = sizeof(peer);
+	struct pollfd pfd;
+	struct timeval now;
+	char port[16], settings[SPIT_REMOTE_LINE_LEN - 192], line[SPIT_REMOTE_LINE_LEN], startedId[SPIT_REMOTE_ID_LEN];
+	char aniSetting[32] = "";
+	int64_t deadline;
+	int res, mediaPort;
+
+	spit_remote_get_config(&config);
+
+	memset(r, 0, sizeof(*r));
+	r->control = r->media = -1;
+	snprintf(r->id, sizeof(r->id), "%s", id);
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(port, sizeof(port), "%d", config.port);
+	if (getaddrinfo(config.host, port, &hints, &addrs))
+		return -1;
+	for (ai = addrs; ai && r->control < 0; ai = ai->ai_next)
+		r->control = remote_connect(ai->ai_addr, ai->ai_addrlen, config.timeout);
+	freeaddrinfo(addrs);
+	if (r->control < 0)
+		return -1;
+
+	/* An ANI with a space in it would break the line, it is only for the analytics log */
+	if (ani && *ani && !strchr(ani, ' '))
+		snprintf(aniSetting, sizeof(aniSetting), " ani=%.15s", ani);
+	if (spit_params_format(params, settings, sizeof(settings))
+		|| remote_send(r, "START %s answered=%d greeting_end=%d%s %s\n", r->id, answered ? 1 : 0,
+			params->trackGreetingEnd ? 1 : 0, aniSetting, settings)) {
+		spit_remote_stop(r);
+		return -1;
+	}
+
+	/* Wait for spitd to take the call */
+	gettimeofday(&now, NULL);
+	deadline = (int64_t) now.tv_sec * 1000 + now.tv_usec / 1000 + config.timeout;
+	for (;;) {
+		if ((res = remote_line(r, line, sizeof(line))) < 0) {
+			spit_remote_stop(r);
+			return -1;
+		} else if (res) {
+			if (sscanf(line, "STARTED %63s %d", startedId, &mediaPort) == 2 && !strcmp(startedId, r->id))
+				break;
+			if (!strncmp(line, "ERROR ", 6)) {
+				spit_remote_stop(r);
+				return -1;
+			}
+			continue;
+		}
+		gettimeofday(&now, NULL);
+		res = deadline - ((int64_t) now.tv_sec * 1000 + now.tv_usec / 1000);
+		pfd.fd = r->control;
+		pfd.events = POLLIN;
+		if (res <= 0 || poll(&pfd, 1, res) == 0) {
+			spit_remote_stop(r);
+			return -1;
+		}
+	}
+
+	/* The audio goes to the same host, on the port spitd gave us */
+	if (getpeername(r->control, (struct sockaddr *) &peer, &peerlen)) {
+		spit_remote_stop(r);
+		return -1;
+	}
+	if (peer.ss_family == AF_INET6)
+		((struct sockaddr_in6 *) &peer)->sin6_port = htons(mediaPort);
+	else
+		((struct sockaddr_in *) &peer)->sin_port = htons(mediaPort);
+	if ((r->media = socket(peer.ss_family, SOCK_DGRAM, 0)) < 0
+		|| connect(r->media, (struct sockaddr *) &peer, peerlen)) {
+		spit_remote_stop(r);
+		return -1;
+	}
+
+	r->ssrc = random();
+	r->seqno = random();
+	r->ts = random();
+	r->lastSeqno = -1;
+	r->lastTs = -1;
+
+	return 0;
+}
+
+int spit_remote_audio(struct spit_remote *r, const int16_t *samples, int nsamples,
+	const struct spit_frame_info *info)
+{
+	unsigned char packet[RTP_HEADER + SPIT_RTP_MAX_SAMPLES * 2];
+	int i, n, seqDelta;
+
+	/* Skip what the trunk skipped, the engine on spitd tells loss from a quiet far end by these gaps */
+	if (info && info->hasSeqno && r->lastSeqno >= 0) {
+		seqDelta = (info->seqno - r->lastSeqno) & 0xffff;
+		if (seqDelta > 1 && seqDelta < 0x8000)
+			r->seqno += seqDelta - 1;
+	}
+	if (info && info->hasTimestamp && r->lastTs >= 0 && info->ts > r->lastTs + r->lastFrameLength)
+		r->ts += (info->ts - r->lastTs - r->lastFrameLength) * SPIT_SAMPLES_PER_MS;
+	if (info && info->hasSeqno)
+		r->lastSeqno = info->seqno;
+	if (info && info->hasTimestamp)
+		r->lastTs = info->ts;
+	if (nsamples >= SPIT_SAMPLES_PER_MS)
+		r->lastFrameLength = nsamples / SPIT_SAMPLES_PER_MS;
+
+	while (nsamples > 0) {
+		n = nsamples > SPIT_RTP_MAX_SAMPLES ? SPIT_RTP_MAX_SAMPLES : nsamples;
+		packet[0] = 0x80;
+		packet[1] = SPIT_RTP_SLIN;
+		packet[2] = r->seqno >> 8;
+		packet[3] = r->seqno;
+		packet[4] = r->ts >> 24;
+		packet[5] = r->ts >> 16;
+		packet[6] = r->ts >> 8;
+		packet[7] = r->ts;
+		packet[8] = r->ssrc >> 24;
+		packet[9] = r->ssrc >> 16;
+		packet[10] = r->ssrc >> 8;
+		packet[11] = r->ssrc;
+		for (i = 0; i < n; i++) {
+			packet[RTP_HEADER + 2 * i] = (uint16_t) samples[i] >> 8;
+			packet[RTP_HEADER + 2 * i + 1] = samples[i];
+		}
+		/* Like any RTP a packet that does not make it is lost, spitd counts it as such */
+		send(r->media, packet, RTP_HEADER + 2 * n, MSG_DONTWAIT | MSG_NOSIGNAL);
+		r->seqno++;
+		r->ts += n;
+		samples += n;
+		nsamples -= n;
+	}
+
+	return 0;
+}
+
+int spit_remote_answer(struct spit_remote *r)
+{
+	return remote_send(r, "ANSWER %s\n", r->id);
+}
+
+int spit_remote_dtmf(struct spit_remote *r, int digit)
+{
+	return remote_send(r, "DTMF %s %c\n", r->id, digit);
+}
+
+int spit_remote_hangup(struct spit_remote *r)
+{
+	return remote_send(r, "HANGUP %s\n", r->id);
+}
+
+int spit_remote_read(struct spit_remote *r, struct spit_remote_verdict *verdict,
+	struct spit_remote_progress *progress)
+{
+	char line[SPIT_REMOTE_LINE_LEN];
+	int res;
+
+	while ((res = remote_line(r, line, sizeof(line))) > 0) {
+		if (!spit_remote_parse_verdict(line, r->id, verdict))
+			return 1;
+		if (progress && !spit_remote_parse_progress(line, r->id, progress))
+			return 2;
+	}
+
+	return res;
+}
+
+void spit_remote_stop(struct spit_remote *r)
+{
+	if (r->control >= 0) {
+		remote_send(r, "STOP %s\n", r->id);
+		close(r->control);
+		r->control = -1;
+	}
+	if (r->media >= 0) {
+		close(r->media);
+		r->media = -1;
+	}
+}
+
+int spit_remote_verdict_line(const struct spit_engine *e, const struct spit_features *features,
+	const char *id, char *buf, int len)
+{
+	const int *values = (const int *) features;
+	char status[32], cause[256];
+	int i, used;
+
+	spit_engine_format(e, status, sizeof(status), cause, sizeof(cause));
+	used = snprintf(buf, len, "VERDICT %s %s %s %d %d %s", id, status, *cause ? cause : "-", e->answered, e->greetingEnd,
+		e->greetingEndCause ? spit_greeting_end_name(e->greetingEndCause) : "-");
+	for (i = 0; i < (int) (sizeof(*features) / sizeof(int)) && used < len; i++)
+		used += snprintf(buf + used, len - used, " %d", values[i]);
+	if (used < len)
+		used += snprintf(buf + used, len - used, "\n");
+
+	return used < len ? used : len - 1;
+}
+
+int spit_remote_progress_line(const struct spit_engine *e, const struct spit_progress *progress,
+	const char *id, char *buf, int len)
+{
+	char status[32], cause[256] = "";
+	int used;
+
+	if (progress->events & SPIT_EVENT_VERDICT)
+		spit_engine_format(e, status, sizeof(status), cause, sizeof(cause));
+	used = snprintf(buf, len, "PROGRESS %s %u %d %d %d %d %s %d %s %d %s\n", id, progress->events, progress->time,
+		progress->words, progress->voiceDuration, progress->silenceDuration,
+		progress->provisional ? spit_status_name(progress->provisional) : "UNDECIDED", progress->confidence,
+		*cause ? cause : "-", e->greetingEnd, e->greetingEndCause ? spit_greeting_end_name(e->greetingEndCause) : "-");
+
+	return used < len ? used : len - 1;
+}
+
+int spit_remote_parse_progress(const char *line, const char *id, struct spit_remote_progress *progress)
+{
+	char lineId[SPIT_REMOTE_ID_LEN], provisional[32], endCause[16];
+	int i;
+
+	memset(progress, 0, sizeof(*progress));
+	if (sscanf(line, "PROGRESS %63s %u %d %d %d %d %31s %d %255s %d %15s", lineId, &progress->progress.events,
+			&progress->progress.time, &progress->progress.words, &progress->progress.voiceDuration,
+			&progress->progress.silenceDuration, provisional, &progress->progress.confidence, progress->cause,
+			&progress->greetingEnd, endCause) != 11 || strcmp(lineId, id))
+		return -1;
+
+	if (!strcmp(progress->cause, "-"))
+		*progress->cause = '\0';
+	for (i = SPIT_HUMAN; i <= SPIT_HANGUP; i++) {
+		if (!strcmp(provisional, spit_status_name(i)))
+			progress->progress.provisional = i;
+	}
+	for (i = SPIT_END_BEEP; i <= SPIT_END_HANGUP; i++) {
+		if (!strcmp(endCause, spit_greeting_end_name(i)))
+			progress->greetingEndCause = i;
+	}
+
+	return 0;
+}
+
+int spit_remote_parse_verdict(const char *line, const char *id, struct spit_remote_verdict *verdict)
+{
+	char lineId[SPIT_REMOTE_ID_LEN], endCause[16], *next;
+	int *values = (int *) &verdict->features;
+	int i, used;
+
+	memset(verdict, 0, sizeof(*verdict));
+	if (sscanf(line, "VERDICT %63s %31s %255s %d %d %15s%n", lineId, verdict->status, verdict->cause,
+			&verdict->answered, &verdict->greetingEnd, endCause, &used) != 6 || strcmp(lineId, id))
+		return -1;
+
+	if (!strcmp(verdict->cause, "-"))
+		*verdict->cause = '\0';
+	for (i = SPIT_END_BEEP; i <= SPIT_END_HANGUP; i++) {
+		if (!strcmp(endCause, spit_greeting_end_name(i)))
+			verdict->greetingEndCause = i;
+	}
+
+	line += used;
+	for (i = 0; i < (int) (sizeof(verdict->features) / sizeof(int)); i++) {
+		values[i] = strtol(line, &next, 10);
+		if (next == line)
+			return -1;
+		line = next;
+	}
+
+	return 0;
+}
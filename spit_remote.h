@@ -0,0 +1,213 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Analysis on a spitd server, the protocol and the client the module uses
+ *
+ * spitd runs the engine outside of Asterisk. A call is set up over a TCP
+ * control connection, its audio is sent to spitd as RTP over UDP and the
+ * verdict comes back over the control connection.
+ *
+ * The control protocol is made of lines of text ending in a newline, words
+ * are separated by single spaces. The client sends
+ *
+ *   START <id> [answered=0|1] [greeting_end=0|1] [ani=<number>] [<spit.conf [general] setting>=<value> ...]
+ *   ANSWER <id>
+ *   DTMF <id> <digit>
+ *   HANGUP <id>
+ *   STOP <id>
+ *   STATS
+ *
+ * and spitd answers
+ *
+ *   STARTED <id> <port>
+ *   ERROR <id> <reason>
+ *   PROGRESS <id> <events> <time> <words> <voice> <silence> <provisional> <confidence> <cause> <greeting end> <greeting end cause>
+ *   VERDICT <id> <status> <cause> <answered> <greeting end> <greeting end cause> <features ...>
+ *   STATS <name>=<value> ...
+ *
+ * The id is chosen by the client and names the call on its connection. Settings
+ * a START does not give come from the spit.conf spitd reads. Audio for the call
+ * goes to the port of STARTED on the host the control connection went to, as
+ * 8kHz RTP: payload type 0 is u-law, 8 is a-law, 13 is comfort noise and any
+ * other payload type is signed linear in network byte order, the way Asterisk
+ * sends slin. A packet carries at most SPIT_RTP_MAX_SAMPLES samples, longer
+ * frames are split. Gaps the module saw in the sequence numbers and timestamps
+ * of the trunk are kept in the ones it sends, so spitd counts the loss of the
+ * trunk. With progress_events=1 a PROGRESS comes whenever the engine has news,
+ * the events are the SPIT_EVENT_* bits and the provisional status is
+ * UNDECIDED while the engine leans nowhere. A VERDICT comes once, when the
+ * engine decides or with greeting_end=1 when the greeting ended. The cause and
+ * the greeting end cause are - when there is none, the features are the fields
+ * of struct spit_features in order. STOP ends the call on spitd, before or after the VERDICT. Closing
+ * the control connection stops all calls started on it.
+ *
+ * \author Justin Zimmer (jzimmer@leasehawk.com)
+ */
+
+#ifndef _SPIT_REMOTE_H
+#define _SPIT_REMOTE_H
+
+#include <stdint.h>
+
+#include "spit_engine.h"
+
+#define SPIT_REMOTE_PORT            5990
+#define SPIT_REMOTE_ID_LEN          64
+#define SPIT_REMOTE_LINE_LEN        1024
+
+/* RTP payload types of the media */
+#define SPIT_RTP_PCMU               0
+#define SPIT_RTP_PCMA               8
+#define SPIT_RTP_CN                 13
+#define SPIT_RTP_SLIN               118
+
+/* Most samples a packet carries, 120ms. spitd drops packets with more. */
+#define SPIT_RTP_MAX_SAMPLES        960
+
+struct spit_remote_config {
+	int enabled;
+	char host[256];
+	int port;
+	int timeout;	/* ms to connect and to wait for a verdict past the analysis time */
+	int fallback;	/* Analyze in the module when spitd can't be reached */
+};
+
+/* A call analyzed on spitd, as the module sees it */
+struct spit_remote {
+	int control;
+	int media;
+	char id[SPIT_REMOTE_ID_LEN];
+	uint16_t seqno;
+	uint32_t ts;
+	uint32_t ssrc;
+	int lastSeqno;		/* Of the trunk, -1 before the first frame that has one */
+	long lastTs;		/* Of the trunk in ms, -1 before the first frame that has one */
+	int lastFrameLength;	/* ms */
+	char line[SPIT_REMOTE_LINE_LEN];
+	int used;
+};
+
+/* What a VERDICT line carries */
+struct spit_remote_verdict {
+	char status[32];
+	char cause[256];
+	int answered;
+	int greetingEnd;
+	enum spit_greeting_end greetingEndCause;
+	struct spit_features features;
+};
+
+/* What a PROGRESS line carries */
+struct spit_remote_progress {
+	struct spit_progress progress;
+	char cause[256];	/* With SPIT_EVENT_VERDICT */
+	int greetingEnd;	/* With SPIT_EVENT_GREETINGEND */
+	enum spit_greeting_end greetingEndCause;
+};
+
+/*! \brief Fill in the built in defaults */
+void spit_remote_defaults(struct spit_remote_config *config);
+
+/*!
+ * \brief Apply one setting of the [remote] section of spit.conf
+ * \retval 0 the setting was known and applied
+ * \retval -1 unknown keyword
+ */
+int spit_remote_config_apply(struct spit_remote_config *config, const char *name, const char *value);
+
+/*! \brief Use a new configuration for the calls that start from now on */
+void spit_remote_configure(const struct spit_remote_config *config);
+
+/*! \brief Copy out the configuration in use */
+void spit_remote_get_config(struct spit_remote_config *config);
+
+/*! \brief Whether calls go to spitd */
+int spit_remote_enabled(void);
+
+/*!
+ * \brief Start the analysis of a call on spitd
+ * \param r the call, set up by this function
+ * \param id names the call on the control connection, no spaces
+ * \param params parameters for the analysis
+ * \param answered 0 for early media
+ * \param ani caller ANI for the analytics log of spitd, can be NULL
+ * \retval 0 spitd is waiting for the audio
+ * \retval -1 spitd could not be reached or refused the call
+ */
+int spit_remote_start(struct spit_remote *r, const char *id, const struct spit_params *params, int answered,
+	const char *ani);
+
+/*!
+ * \brief Send a frame of signed linear audio
+ * \param info sequence number and timestamp the frame had on the trunk, NULL if unknown
+ */
+int spit_remote_audio(struct spit_remote *r, const int16_t *samples, int nsamples,
+	const struct spit_frame_info *info);
+
+/*! \brief The channel was answered */
+int spit_remote_answer(struct spit_remote *r);
+
+/*! \brief A DTMF digit came in, once per digit */
+int spit_remote_dtmf(struct spit_remote *r, int digit);
+
+/*! \brief The caller hung up */
+int spit_remote_hangup(struct spit_remote *r);
+
+/*!
+ * \brief Read what spitd sent without blocking
+ * \param progress filled in with a PROGRESS, NULL to skip them
+ * \retval 2 a progress report is in, call again for the rest
+ * \retval 1 the verdict is in
+ * \retval 0 no verdict yet
+ * \retval -1 the control connection was lost
+ */
+int spit_remote_read(struct spit_remote *r, struct spit_remote_verdict *verdict,
+	struct spit_remote_progress *progress);
+
+/*! \brief Stop the call on spitd and close its sockets */
+void spit_remote_stop(struct spit_remote *r);
+
+/*!
+ * \brief Format the VERDICT line of an engine, for spitd
+ * \param features what the analysis measured
+ * \return the length of the line
+ */
+int spit_remote_verdict_line(const struct spit_engine *e, const struct spit_features *features,
+	const char *id, char *buf, int len);
+
+/*!
+ * \brief Format the PROGRESS line of an engine, for spitd
+ * \param progress what spit_engine_progress() reported
+ * \return the length of the line
+ */
+int spit_remote_progress_line(const struct spit_engine *e, const struct spit_progress *progress,
+	const char *id, char *buf, int len);
+
+/*!
+ * \brief Parse the PROGRESS line of a call
+ * \retval 0 the line is a PROGRESS for the call
+ * \retval -1 it is not
+ */
+int spit_remote_parse_progress(const char *line, const char *id, struct spit_remote_progress *progress);
+
+/*!
+ * \brief Parse the VERDICT line of a call
+ * \retval 0 the line is a VERDICT for the call
+ * \retval -1 it is not
+ */
+int spit_remote_parse_verdict(const char *line, const char *id, struct spit_remote_verdict *verdict);
+
+#endif /* _SPIT_REMOTE_H */
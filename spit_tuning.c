@@ -0,0 +1,384 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Per trunk tuning of the analysis from the true outcome of calls
+ *
+ * Like the engine this file does not include any Asterisk header. Link it
+ * next to spit_engine.c, see there.
+ *
+ * \author Justin Zimmer (jzimmer@leasehawk.com)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+
+#include "spit_tuning.h"
+
+/*
+ * The mistakes a window of reports is sorted into. Each one points at a
+ * parameter that is off for the trunk:
+ *  - a human taken for a machine on word count had its words split, the
+ *    between words silence is too short
+ *  - a machine taken for a human after its first words had its words run
+ *    together, the between words silence is too long
+ *  - a human taken for a machine on one long word or greeting talked over
+ *    a noise floor the threshold counts as voice
+ *  - a machine taken for a human on initial silence played its greeting
+ *    below the threshold
+ */
+enum tuning_miss {
+	MISS_SPLIT = 0,
+	MISS_MERGED,
+	MISS_NOISE,
+	MISS_QUIET,
+	MISSES,
+};
+
+struct tuning_slot {
+	/* Set once, before used is */
+	char name[SPIT_TUNING_NAME_LEN];
+	int used;
+
+	/* Read without a lock, odd seq while the feedback writes the values */
+	unsigned int seq;
+	int values[SPIT_TUNED];
+
+	/* Only touched with tuningLock held */
+	uint64_t reports;
+	uint64_t correct;
+	int windowReports;
+	int windowCorrect;
+	int misses[MISSES];
+	unsigned int adjustments;
+};
+
+static const char *tunedNames[SPIT_TUNED] = {
+	"silence_threshold",
+	"between_words_silence",
+	"total_analysis_time",
+};
+
+static struct spit_tuning_config tuningConfig;
+static int tuningEnabled;
+static int tuningDefaults[SPIT_TUNED];
+static struct tuning_slot tuningSlots[SPIT_TUNING_TRUNKS];
+static pthread_mutex_t tuningLock = PTHREAD_MUTEX_INITIALIZER;
+
+static int *tuned_param(struct spit_params *params, enum spit_tuned param)
+{
+	switch (param) {
+	case SPIT_TUNED_SILENCE_THRESHOLD:
+		return &params->silenceThreshold;
+	case SPIT_TUNED_BETWEEN_WORDS_SILENCE:
+		return &params->betweenWordsSilence;
+	case SPIT_TUNED_TOTAL_ANALYSIS_TIME:
+	default:
+		return &params->totalAnalysisTime;
+	}
+}
+
+const char *spit_tuned_name(enum spit_tuned param)
+{
+	return param >= 0 && param < SPIT_TUNED ? tunedNames[param] : "";
+}
+
+void spit_tuning_defaults(struct spit_tuning_config *config)
+{
+	memset(config, 0, sizeof(*config));
+	config->target = 95;
+	config->window = 50;
+	config->min[SPIT_TUNED_SILENCE_THRESHOLD] = 128;
+	config->max[SPIT_TUNED_SILENCE_THRESHOLD] = 1024;
+	config->step[SPIT_TUNED_SILENCE_THRESHOLD] = 32;
+	config->min[SPIT_TUNED_BETWEEN_WORDS_SILENCE] = 30;
+	config->max[SPIT_TUNED_BETWEEN_WORDS_SILENCE] = 200;
+	config->step[SPIT_TUNED_BETWEEN_WORDS_SILENCE] = 10;
+	config->min[SPIT_TUNED_TOTAL_ANALYSIS_TIME] = 2000;
+	config->max[SPIT_TUNED_TOTAL_ANALYSIS_TIME] = 5000;
+	config->step[SPIT_TUNED_TOTAL_ANALYSIS_TIME] = 250;
+}
+
+int spit_tuning_config_apply(struct spit_tuning_config *config, const char *name, const char *value)
+{
+	int i, len;
+
+	if (!strcasecmp(name, "enabled")) {
+		config->enabled = spit_true(value);
+	} else if (!strcasecmp(name, "target")) {
+		config->target = atoi(value);
+		if (config->target < 1 || config->target > 100)
+			return -1;
+	} else if (!strcasecmp(name, "window")) {
+		if ((config->window = atoi(value)) < 1)
+			return -1;
+	} else {
+		/* <parameter>_min, <parameter>_max and <parameter>_step */
+		for (i = 0; i < SPIT_TUNED; i++) {
+			len = strlen(tunedNames[i]);
+			if (strncasecmp(name, tunedNames[i], len) || name[len] != '_')
+				continue;
+			if (!strcasecmp(name + len + 1, "min"))
+				config->min[i] = atoi(value);
+			else if (!strcasecmp(name + len + 1, "max"))
+				config->max[i] = atoi(value);
+			else if (!strcasecmp(name + len + 1, "step"))
+				config->step[i] = atoi(value);
+			else
+				return -1;
+			return 0;
+		}
+		return -1;
+	}
+
+	return 0;
+}
+
+static int tuning_clamp(int value, enum spit_tuned param)
+{
+	if (value < tuningConfig.min[param])
+		return tuningConfig.min[param];
+	if (value > tuningConfig.max[param])
+		return tuningConfig.max[param];
+	return value;
+}
+
+/* Write the values of a trunk for the readers, with tuningLock held */
+static void tuning_publish(struct tuning_slot *slot, const int *values)
+{
+	int i;
+
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	for (i = 0; i < SPIT_TUNED; i++)
+		__atomic_store_n(&slot->values[i], values[i], __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+void spit_tuning_configure(const struct spit_tuning_config *config, const struct spit_params *params)
+{
+	struct spit_params defaults = *params;
+	int values[SPIT_TUNED];
+	int i, j;
+
+	pthread_mutex_lock(&tuningLock);
+	tuningConfig = *config;
+	for (i = 0; i < SPIT_TUNED; i++) {
+		if (tuningConfig.max[i] < tuningConfig.min[i])
+			tuningConfig.max[i] = tuningConfig.min[i];
+		if (tuningConfig.step[i] < 0)
+			tuningConfig.step[i] = 0;
+		tuningDefaults[i] = tuning_clamp(*tuned_param(&defaults, i), i);
+	}
+	for (i = 0; i < SPIT_TUNING_TRUNKS; i++) {
+		if (!tuningSlots[i].used)
+			continue;
+		for (j = 0; j < SPIT_TUNED; j++)
+			values[j] = tuning_clamp(tuningSlots[i].values[j], j);
+		tuning_publish(&tuningSlots[i], values);
+	}
+	__atomic_store_n(&tuningEnabled, config->enabled, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&tuningLock);
+}
+
+int spit_tuning_enabled(void)
+{
+	return __atomic_load_n(&tuningEnabled, __ATOMIC_RELAXED);
+}
+
+static unsigned int tuning_hash(const char *name)
+{
+	unsigned int hash = 2166136261u;
+
+	while (*name) {
+		hash ^= (unsigned char) *name++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+/* Open addressing, slots are only ever added so a reader stops at the first unused one */
+static struct tuning_slot *tuning_find(const char *name)
+{
+	unsigned int i, pos = tuning_hash(name);
+	struct tuning_slot *slot;
+
+	for (i = 0; i < SPIT_TUNING_TRUNKS; i++) {
+		slot = &tuningSlots[(pos + i) % SPIT_TUNING_TRUNKS];
+		if (!__atomic_load_n(&slot->used, __ATOMIC_ACQUIRE))
+			return NULL;
+		if (!strcmp(slot->name, name))
+			return slot;
+	}
+
+	return NULL;
+}
+
+int spit_tuning_apply(const char *trunk, struct spit_params *params)
+{
+	struct tuning_slot *slot;
+	int values[SPIT_TUNED];
+	unsigned int seq;
+	int i;
+
+	if (!spit_tuning_enabled() || !trunk || !*trunk || !(slot = tuning_find(trunk)))
+		return -1;
+
+	do {
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		for (i = 0; i < SPIT_TUNED; i++)
+			values[i] = __atomic_load_n(&slot->values[i], __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || seq != __atomic_load_n(&slot->seq, __ATOMIC_RELAXED));
+
+	for (i = 0; i < SPIT_TUNED; i++)
+		*tuned_param(params, i) = values[i];
+
+	return 0;
+}
+
+/* Find the slot of a trunk or take a new one for it, with tuningLock held */
+static struct tuning_slot *tuning_slot(const char *name)
+{
+	unsigned int i, pos = tuning_hash(name);
+	struct tuning_slot *slot;
+
+	for (i = 0; i < SPIT_TUNING_TRUNKS; i++) {
+		slot = &tuningSlots[(pos + i) % SPIT_TUNING_TRUNKS];
+		if (!slot->used) {
+			snprintf(slot->name, sizeof(slot->name), "%s", name);
+			tuning_publish(slot, tuningDefaults);
+			__atomic_store_n(&slot->used, 1, __ATOMIC_RELEASE);
+			return slot;
+		}
+		if (!strcmp(slot->name, name))
+			return slot;
+	}
+
+	return NULL;
+}
+
+static int tuning_miss(const struct spit_tuning_sample *sample)
+{
+	if (sample->status == SPIT_MACHINE) {
+		if (!strncmp(sample->cause, "MAXWORDS", 8))
+			return MISS_SPLIT;
+		if (!strncmp(sample->cause, "MAXWORDLENGTH", 13) || !strncmp(sample->cause, "LONGGREETING", 12))
+			return MISS_NOISE;
+	} else if (sample->status == SPIT_HUMAN) {
+		if (!strncmp(sample->cause, "SILENCEAFTERNOISE", 17))
+			return MISS_MERGED;
+		if (!strncmp(sample->cause, "INITIALSILENCE", 14))
+			return MISS_QUIET;
+	}
+
+	/* NOTSURE and the like only say the analysis ran out of time */
+	return -1;
+}
+
+/* The end of a window, move each parameter one step at most. With tuningLock held. */
+static void tuning_adjust(struct tuning_slot *slot)
+{
+	int values[SPIT_TUNED];
+	int *misses = slot->misses;
+	int i, met = slot->windowCorrect * 100 >= tuningConfig.target * slot->windowReports;
+
+	memcpy(values, slot->values, sizeof(values));
+
+	/* As short as the target allows, and back up quicker than it came down */
+	values[SPIT_TUNED_TOTAL_ANALYSIS_TIME] += met ? -tuningConfig.step[SPIT_TUNED_TOTAL_ANALYSIS_TIME]
+		: 2 * tuningConfig.step[SPIT_TUNED_TOTAL_ANALYSIS_TIME];
+
+	if (!met) {
+		if (misses[MISS_SPLIT] != misses[MISS_MERGED]) {
+			values[SPIT_TUNED_BETWEEN_WORDS_SILENCE] += misses[MISS_SPLIT] > misses[MISS_MERGED]
+				? tuningConfig.step[SPIT_TUNED_BETWEEN_WORDS_SILENCE] : -tuningConfig.step[SPIT_TUNED_BETWEEN_WORDS_SILENCE];
+		}
+		if (misses[MISS_NOISE] != misses[MISS_QUIET]) {
+			values[SPIT_TUNED_SILENCE_THRESHOLD] += misses[MISS_NOISE] > misses[MISS_QUIET]
+				? tuningConfig.step[SPIT_TUNED_SILENCE_THRESHOLD] : -tuningConfig.step[SPIT_TUNED_SILENCE_THRESHOLD];
+		}
+	}
+
+	for (i = 0; i < SPIT_TUNED; i++)
+		values[i] = tuning_clamp(values[i], i);
+	if (memcmp(values, slot->values, sizeof(values))) {
+		tuning_publish(slot, values);
+		slot->adjustments++;
+	}
+
+	slot->windowReports = 0;
+	slot->windowCorrect = 0;
+	memset(slot->misses, 0, sizeof(slot->misses));
+}
+
+int spit_tuning_feedback(const struct spit_tuning_sample *sample, enum spit_status truth)
+{
+	struct tuning_slot *slot;
+	int miss;
+
+	/* A caller that hung up says nothing about the parameters */
+	if (!spit_tuning_enabled() || !*sample->trunk || sample->status == SPIT_HANGUP)
+		return -1;
+
+	pthread_mutex_lock(&tuningLock);
+	if (!(slot = tuning_slot(sample->trunk))) {
+		pthread_mutex_unlock(&tuningLock);
+		return -1;
+	}
+
+	slot->reports++;
+	slot->windowReports++;
+	if (sample->status == truth) {
+		slot->correct++;
+		slot->windowCorrect++;
+	} else if ((miss = tuning_miss(sample)) >= 0) {
+		slot->misses[miss]++;
+	}
+
+	if (slot->windowReports >= tuningConfig.window)
+		tuning_adjust(slot);
+	pthread_mutex_unlock(&tuningLock);
+
+	return 0;
+}
+
+int spit_tuning_get_trunks(struct spit_tuning_trunk *trunks, int max)
+{
+	struct tuning_slot *slot;
+	int i, count = 0;
+
+	pthread_mutex_lock(&tuningLock);
+	for (i = 0; i < SPIT_TUNING_TRUNKS && count < max; i++) {
+		slot = &tuningSlots[i];
+		if (!slot->used)
+			continue;
+		memcpy(trunks[count].name, slot->name, sizeof(trunks[count].name));
+		memcpy(trunks[count].values, slot->values, sizeof(trunks[count].values));
+		trunks[count].reports = slot->reports;
+		trunks[count].correct = slot->correct;
+		trunks[count].windowReports = slot->windowReports;
+		trunks[count].windowCorrect = slot->windowCorrect;
+		trunks[count].adjustments = slot->adjustments;
+		count++;
+	}
+	pthread_mutex_unlock(&tuningLock);
+
+	return count;
+}
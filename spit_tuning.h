@@ -0,0 +1,123 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Per trunk tuning of the analysis from the true outcome of calls
+ *
+ * The dialplan tells SPIT after the fact what a call really was, with
+ * SPIT_FEEDBACK(). The reports are counted per trunk and every window of
+ * reports moves the silence threshold, the between words silence and the
+ * total analysis time of the trunk one step, within the configured bounds:
+ * the analysis time comes down while the trunk meets the accuracy target
+ * and goes back up twice as fast when it does not, the other two follow the
+ * mistakes the trunk makes.
+ *
+ * The values of a trunk are published with a sequence count. Starting an
+ * analysis reads them without taking a lock, only the feedback does.
+ *
+ * \author Justin Zimmer (jzimmer@leasehawk.com)
+ */
+
+#ifndef _SPIT_TUNING_H
+#define _SPIT_TUNING_H
+
+#include <stdint.h>
+
+#include "spit_engine.h"
+
+/* Trunks we keep values for, the table never shrinks until the module is unloaded */
+#define SPIT_TUNING_TRUNKS          256
+#define SPIT_TUNING_NAME_LEN        64
+
+/* The parameters that are tuned */
+enum spit_tuned {
+	SPIT_TUNED_SILENCE_THRESHOLD = 0,
+	SPIT_TUNED_BETWEEN_WORDS_SILENCE,
+	SPIT_TUNED_TOTAL_ANALYSIS_TIME,
+	SPIT_TUNED,
+};
+
+struct spit_tuning_config {
+	int enabled;
+	int target;		/* Percent of the reports the verdict has to get right */
+	int window;		/* Reports per trunk between two adjustments */
+	int min[SPIT_TUNED];
+	int max[SPIT_TUNED];
+	int step[SPIT_TUNED];
+};
+
+/* What SPIT_FEEDBACK() is told about, kept on the channel at the verdict */
+struct spit_tuning_sample {
+	char trunk[SPIT_TUNING_NAME_LEN];
+	enum spit_status status;
+	char cause[64];
+};
+
+struct spit_tuning_trunk {
+	char name[SPIT_TUNING_NAME_LEN];
+	int values[SPIT_TUNED];
+	uint64_t reports;	/* Since the trunk was first reported on */
+	uint64_t correct;
+	int windowReports;	/* In the window being counted */
+	int windowCorrect;
+	unsigned int adjustments;
+};
+
+/*! \brief Fill in the built in defaults */
+void spit_tuning_defaults(struct spit_tuning_config *config);
+
+/*!
+ * \brief Apply one setting of the [tuning] section of spit.conf
+ * \retval 0 the setting was known and applied
+ * \retval -1 unknown keyword or bad value
+ */
+int spit_tuning_config_apply(struct spit_tuning_config *config, const char *name, const char *value);
+
+/*!
+ * \brief Use a new configuration
+ * \param params the defaults, new trunks start from them. Trunks that were tuned
+ * keep their values, moved into the new bounds.
+ */
+void spit_tuning_configure(const struct spit_tuning_config *config, const struct spit_params *params);
+
+/*! \brief Whether trunks are tuned */
+int spit_tuning_enabled(void);
+
+/*!
+ * \brief Use the values of a trunk for an analysis, without locking
+ * \retval 0 the trunk has values and they are in params
+ * \retval -1 the trunk was never reported on, params are left alone
+ */
+int spit_tuning_apply(const char *trunk, struct spit_params *params);
+
+/*!
+ * \brief Count the true outcome of an analysis
+ * \param sample what the analysis decided on which trunk
+ * \param truth SPIT_HUMAN or SPIT_MACHINE
+ * \retval 0 counted
+ * \retval -1 the trunk table is full or tuning is disabled
+ */
+int spit_tuning_feedback(const struct spit_tuning_sample *sample, enum spit_status truth);
+
+/*!
+ * \brief Copy out the trunks with their values and counters
+ * \return the number of trunks copied
+ */
+int spit_tuning_get_trunks(struct spit_tuning_trunk *trunks, int max);
+
+/*! \brief Name of a tuned parameter as in spit.conf */
+const char *spit_tuned_name(enum spit_tuned param);
+
+#endif /* _SPIT_TUNING_H */
@@ -0,0 +1,402 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Simulated calls for spitd
+ *
+ * Sends calls to spitd through the same client the module uses and checks
+ * that every verdict is the one the engine reaches on the same audio in
+ * process. The calls are made of speech like fixtures, the ones of
+ * bench/spit_bench.c, and of raw 8kHz signed linear recordings given with -f.
+ * One of them also sends a u-law packet too long for spitd to take into the
+ * middle of the call, spitd has to drop it and go on. Another loses a frame
+ * in ten on the way to the client, spitd has to count the loss the client
+ * saw on its trunk.
+ * Build from the top of the tree and run against a spitd on loopback with
+ *
+ *   gcc -O2 -o spitd/spit_sim spitd/spit_sim.c spit_engine.c spit_remote.c -lm -lpthread
+ *   spitd/spitd -c spit.conf.sample &
+ *   spitd/spit_sim [-H host] [-p port] [-n calls] [-j concurrent] [-x speed] [-f file.sln]
+ *
+ * -x 1 sends the audio in real time, the default, -x 0 as fast as it goes.
+ * Exits with 1 when a verdict differs or a call fails.
+ *
+ * \author Justin Zimmer (jzimmer@leasehawk.com)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <math.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+
+#include "../spit_engine.h"
+#include "../spit_remote.h"
+
+#define FRAME_SAMPLES   160
+#define MAX_FIXTURES    8
+
+struct fixture {
+	const char *name;
+	int frames;
+	int16_t *slin;
+	int dtmfFrame;	/* Frame a DTMF digit comes in with, -1 for none */
+	int oversizedFrame;	/* Frame an oversized packet comes before, -1 for none */
+	int lossEvery;	/* One frame in this many never reaches the client, 0 for none */
+	/* What the engine decides in process */
+	char status[32];
+	char cause[256];
+	/* Totals of the simulated calls */
+	int calls;
+	int mismatches;
+	int failures;
+	int64_t latency;
+};
+
+static struct fixture fixtures[MAX_FIXTURES];
+static int numFixtures;
+static struct spit_params params;
+static double speed = 1;
+static int totalCalls = 20;
+static int nextCall;
+static pthread_mutex_t simLock = PTHREAD_MUTEX_INITIALIZER;
+
+static int64_t now_ms(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (int64_t) now.tv_sec * 1000 + now.tv_usec / 1000;
+}
+
+/* Fixtures are made of speech like bursts: a pitched tone under a syllable envelope
+   over a noise floor. The generator is seeded so every run sees the same audio. */
+static unsigned int seed = 12345;
+
+static int noise(int amplitude)
+{
+	seed = seed * 1103515245 + 12345;
+	return (int) ((seed >> 16) % (2 * amplitude + 1)) - amplitude;
+}
+
+static struct fixture *fixture_new(const char *name, int ms)
+{
+	struct fixture *fx = &fixtures[numFixtures++];
+
+	fx->name = name;
+	fx->frames = ms / 20;
+	fx->slin = calloc(fx->frames * FRAME_SAMPLES, sizeof(int16_t));
+	fx->dtmfFrame = -1;
+	fx->oversizedFrame = -1;
+
+	return fx;
+}
+
+static void fixture_speech(struct fixture *fx, int fromMs, int toMs)
+{
+	int i;
+	double t, envelope;
+
+	for (i = fromMs * SPIT_SAMPLES_PER_MS; i < toMs * SPIT_SAMPLES_PER_MS && i < fx->frames * FRAME_SAMPLES; i++) {
+		t = (double) i / 8000;
+		envelope = 0.6 + 0.4 * sin(2 * M_PI * 4 * t);
+		fx->slin[i] = envelope * (4000 * sin(2 * M_PI * 140 * t) + 1500 * sin(2 * M_PI * 280 * t)) + noise(200);
+	}
+}
+
+static void fixture_finish(struct fixture *fx)
+{
+	int i;
+
+	for (i = 0; i < fx->frames * FRAME_SAMPLES; i++) {
+		if (!fx->slin[i])
+			fx->slin[i] = noise(40);
+	}
+}
+
+static void fixtures_builtin(void)
+{
+	struct fixture *fx;
+	int i;
+
+	/* Hello and a pause */
+	fx = fixture_new("human", 3000);
+	fixture_speech(fx, 300, 800);
+	fixture_finish(fx);
+
+	/* A greeting that goes on and on */
+	fx = fixture_new("machine", 6000);
+	for (i = 200; i < 6000; i += 500)
+		fixture_speech(fx, i, i + 350);
+	fixture_finish(fx);
+
+	fx = fixture_new("silence", 4000);
+	fixture_finish(fx);
+
+	/* A dialer that answers with a tone */
+	fx = fixture_new("dtmf", 2000);
+	fixture_speech(fx, 200, 400);
+	fixture_finish(fx);
+	fx->dtmfFrame = 25;
+
+	/* Hello and a pause, with a packet in the middle that is too long */
+	fx = fixture_new("oversized", 3000);
+	fixture_speech(fx, 300, 800);
+	fixture_finish(fx);
+	fx->oversizedFrame = 20;
+
+	/* Hello and a pause over a trunk that loses one packet in ten */
+	fx = fixture_new("lossy", 3000);
+	fixture_speech(fx, 300, 800);
+	fixture_finish(fx);
+	fx->lossEvery = 10;
+}
+
+static int fixture_lost(const struct fixture *fx, int f)
+{
+	return fx->lossEvery && f % fx->lossEvery == fx->lossEvery - 1;
+}
+
+static int fixture_load(const char *path)
+{
+	struct fixture *fx;
+	struct stat st;
+	FILE *f;
+
+	if (numFixtures == MAX_FIXTURES) {
+		fprintf(stderr, "Too many fixtures\n");
+		return -1;
+	}
+	if (stat(path, &st) || !(f = fopen(path, "rb"))) {
+		fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	fx = fixture_new(path, st.st_size / sizeof(int16_t) / SPIT_SAMPLES_PER_MS);
+	if (fread(fx->slin, sizeof(int16_t), fx->frames * FRAME_SAMPLES, f) != (size_t) (fx->frames * FRAME_SAMPLES)) {
+		fprintf(stderr, "Unable to read %s\n", path);
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+
+	return 0;
+}
+
+/* The verdict of the engine in process, what spitd has to come up with too */
+static void fixture_expect(struct fixture *fx)
+{
+	struct spit_engine e;
+	struct spit_frame_info info = { 1, 0, 1, 0 };
+	int f;
+
+	spit_engine_init(&e, &params, 1);
+	for (f = 0; f < fx->frames && (!e.status || e.endTracking); f++) {
+		info.seqno = f & 0xffff;
+		info.ts = f * 20;
+		if (f == fx->dtmfFrame)
+			spit_engine_dtmf(&e, '5');
+		if (!fixture_lost(fx, f))
+			spit_engine_audio(&e, fx->slin + f * FRAME_SAMPLES, FRAME_SAMPLES, &info);
+	}
+	/* The simulated caller hangs up when it runs out of audio */
+	spit_engine_hangup(&e);
+	spit_engine_format(&e, fx->status, sizeof(fx->status), fx->cause, sizeof(fx->cause));
+}
+
+/* A u-law packet with more samples than spitd takes, to the media port of the call. It has the
+   SSRC of the call and the sequence number of the next frame, dropping it loses nothing. */
+static void sim_oversized(const struct spit_remote *r)
+{
+	unsigned char packet[12 + 2 * SPIT_RTP_MAX_SAMPLES];
+
+	memset(packet, 0xff, sizeof(packet));
+	packet[0] = 0x80;
+	packet[1] = SPIT_RTP_PCMU;
+	packet[2] = r->seqno >> 8;
+	packet[3] = r->seqno;
+	packet[4] = r->ts >> 24;
+	packet[5] = r->ts >> 16;
+	packet[6] = r->ts >> 8;
+	packet[7] = r->ts;
+	packet[8] = r->ssrc >> 24;
+	packet[9] = r->ssrc >> 16;
+	packet[10] = r->ssrc >> 8;
+	packet[11] = r->ssrc;
+	send(r->media, packet, sizeof(packet), MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+/* One call to spitd, 0 when it came back with the expected verdict */
+static int sim_call(int n, struct fixture *fx)
+{
+	struct spit_remote r;
+	struct spit_remote_verdict verdict;
+	struct spit_frame_info info = { 1, 0, 1, 0 };
+	struct pollfd pfd;
+	char id[32];
+	int64_t start = now_ms(), due;
+	int f, res = 0, wait;
+
+	snprintf(id, sizeof(id), "sim-%d", n);
+	if (spit_remote_start(&r, id, &params, 1, NULL)) {
+		fprintf(stderr, "%s %s: spitd did not take the call\n", id, fx->name);
+		return -1;
+	}
+
+	for (f = 0; f < fx->frames && !res; f++) {
+		if (f == fx->dtmfFrame) {
+			spit_remote_dtmf(&r, '5');
+			/* DTMF is not ordered with the RTP, give it time to land where the fixture has it */
+			if (speed <= 0)
+				usleep(50000);
+		}
+		if (f == fx->oversizedFrame)
+			sim_oversized(&r);
+		/* The sequence numbers and timestamps of the trunk, as the channel driver has them */
+		info.seqno = f & 0xffff;
+		info.ts = f * 20;
+		if (!fixture_lost(fx, f))
+			spit_remote_audio(&r, fx->slin + f * FRAME_SAMPLES, FRAME_SAMPLES, &info);
+		if ((res = spit_remote_read(&r, &verdict, NULL)))
+			break;
+		if (speed > 0) {
+			due = start + (int64_t) ((f + 1) * 20 / speed);
+			if ((wait = due - now_ms()) > 0)
+				usleep(wait * 1000);
+		}
+	}
+
+	if (!res)
+		spit_remote_hangup(&r);
+
+	pfd.fd = r.control;
+	pfd.events = POLLIN;
+	while (!res && poll(&pfd, 1, 5000) == 1)
+		res = spit_remote_read(&r, &verdict, NULL);
+	spit_remote_stop(&r);
+
+	pthread_mutex_lock(&simLock);
+	fx->calls++;
+	if (res != 1) {
+		fx->failures++;
+		pthread_mutex_unlock(&simLock);
+		fprintf(stderr, "%s %s: no verdict\n", id, fx->name);
+		return -1;
+	}
+	fx->latency += now_ms() - start;
+	if (strcmp(verdict.status, fx->status) || strcmp(verdict.cause, fx->cause)) {
+		fx->mismatches++;
+		pthread_mutex_unlock(&simLock);
+		fprintf(stderr, "%s %s: spitd says %s %s, expected %s %s\n", id, fx->name,
+			verdict.status, verdict.cause, fx->status, fx->cause);
+		return -1;
+	}
+	pthread_mutex_unlock(&simLock);
+
+	return 0;
+}
+
+static void *sim_thread(void *data __attribute__((unused)))
+{
+	int n;
+
+	for (;;) {
+		pthread_mutex_lock(&simLock);
+		n = nextCall < totalCalls ? nextCall++ : -1;
+		pthread_mutex_unlock(&simLock);
+		if (n < 0)
+			break;
+		sim_call(n, &fixtures[n % numFixtures]);
+	}
+
+	return NULL;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: spit_sim [-H host] [-p port] [-n calls] [-j concurrent] [-x speed] [-f file.sln]\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct spit_remote_config remote;
+	pthread_t threads[256];
+	int64_t start;
+	int concurrent = 4, i, c, failed = 0;
+
+	spit_remote_defaults(&remote);
+	remote.enabled = 1;
+	spit_params_defaults(&params);
+	fixtures_builtin();
+
+	while ((c = getopt(argc, argv, "H:p:n:j:x:f:h")) != -1) {
+		switch (c) {
+		case 'H':
+			snprintf(remote.host, sizeof(remote.host), "%s", optarg);
+			break;
+		case 'p':
+			remote.port = atoi(optarg);
+			break;
+		case 'n':
+			totalCalls = atoi(optarg);
+			break;
+		case 'j':
+			concurrent = atoi(optarg);
+			break;
+		case 'x':
+			speed = atof(optarg);
+			break;
+		case 'f':
+			if (fixture_load(optarg))
+				return 1;
+			break;
+		default:
+			usage();
+			return c == 'h' ? 0 : 1;
+		}
+	}
+	if (concurrent < 1)
+		concurrent = 1;
+	if (concurrent > 256)
+		concurrent = 256;
+
+	spit_remote_configure(&remote);
+	for (i = 0; i < numFixtures; i++)
+		fixture_expect(&fixtures[i]);
+
+	start = now_ms();
+	for (i = 0; i < concurrent; i++)
+		pthread_create(&threads[i], NULL, sim_thread, NULL);
+	for (i = 0; i < concurrent; i++)
+		pthread_join(threads[i], NULL);
+
+	printf("%-10s %-6s %-9s %-9s %-9s %s\n", "Fixture", "Calls", "Mismatch", "Failed", "Latency", "Verdict");
+	for (i = 0; i < numFixtures; i++) {
+		struct fixture *fx = &fixtures[i];
+		int ok = fx->calls - fx->failures;
+
+		printf("%-10s %-6d %-9d %-9d %-9d %s %s\n", fx->name, fx->calls, fx->mismatches, fx->failures,
+			ok ? (int) (fx->latency / ok) : 0, fx->status, fx->cause);
+		failed |= fx->mismatches || fx->failures;
+	}
+	printf("%d calls, %d at a time, in %d ms\n", totalCalls, concurrent, (int) (now_ms() - start));
+
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,964 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief spitd, the SPIT engine as a server of its own
+ *
+ * Runs the analysis of calls for Asterisk boxes with [remote] enabled in
+ * spit.conf, or for anything else that speaks the protocol described in
+ * spit_remote.h, such as an ARI application with an external media channel.
+ *
+ * Each control connection has a thread that reads its commands. The calls are
+ * spread over worker threads, a worker owns the engines of its calls and reads
+ * their RTP, so an engine is only ever touched by one thread. Control threads
+ * hand the worker what they get for a call through a pipe.
+ *
+ * spitd reads the [general], [pipeline], [analytics] and [spitd] sections of spit.conf.
+ * Burst detection stays with the module, it sends the strict profile along
+ * with the call. Build from the top of the tree with
+ *
+ *   gcc -O2 -o spitd/spitd spitd/spitd.c spit_engine.c spit_analytics.c spit_remote.c -lpthread
+ *   spitd/spitd [-c /etc/asterisk/spit.conf] [-v] [-d]
+ *
+ * spitd/spit_sim.c sends calls to it for testing on loopback.
+ *
+ * \author Justin Zimmer (jzimmer@leasehawk.com)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "../spit_engine.h"
+#include "../spit_analytics.h"
+#include "../spit_remote.h"
+
+#define MAX_WORKERS             64
+/* Longest a worker sleeps, timeouts of calls without media are this late at most */
+#define WORKER_TICK             10
+#define MAX_PACKET              (12 + 2 * SPIT_RTP_MAX_SAMPLES)
+
+struct spitd_config {
+	char bind[64];
+	int port;
+	int rtpStart;
+	int rtpEnd;
+	int threads;
+};
+
+enum command_type {
+	CMD_ADD,
+	CMD_ANSWER,
+	CMD_DTMF,
+	CMD_HANGUP,
+	CMD_STOP,
+};
+
+struct call;
+
+/* What a control thread hands to the worker of a call */
+struct command {
+	enum command_type type;
+	int digit;
+	struct call *call;
+};
+
+struct connection {
+	int fd;
+	int refs;	/* The control thread and every call started on the connection */
+	pthread_mutex_t lock;	/* Held while writing to fd */
+	struct call *calls;	/* Only touched by the control thread */
+	char peer[64];
+};
+
+struct worker {
+	pthread_t thread;
+	int epoll;
+	int pipe[2];
+	struct call *calls;	/* Only touched by the worker */
+};
+
+struct call {
+	struct call *next;	/* On the connection */
+	struct call *wnext;	/* On the worker */
+	char id[SPIT_REMOTE_ID_LEN];
+	char ani[SPIT_ANALYTICS_ANI_LEN];
+	struct connection *conn;
+	struct worker *worker;
+	int fd;
+	int port;
+	int latched;	/* The first SSRC we heard is the call, other streams are dropped */
+	uint32_t ssrc;
+	int64_t start;
+	int64_t lastMedia;	/* ms, or when we last gave up waiting for it */
+	int64_t cpu;
+	int done;	/* The VERDICT went out */
+	struct spit_engine engine;
+};
+
+struct spitd_stats {
+	uint64_t calls;
+	uint64_t active;
+	uint64_t rejected;
+	uint64_t verdicts[SPIT_HANGUP + 1];
+	uint64_t packets;
+	uint64_t dropped;	/* Packets we could not use */
+};
+
+static struct spitd_config config;
+static struct spit_params dfltParams;
+static struct worker workers[MAX_WORKERS];
+static int numWorkers;
+static unsigned int nextWorker;
+static int verbose;
+static int debug;
+static volatile sig_atomic_t stopping;
+
+/* RTP ports in use, one bit per port of the range */
+static pthread_mutex_t portLock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned char *portsUsed;
+static int nextPort;
+
+static struct spitd_stats stats;
+
+#define stat_add(field, n) __atomic_fetch_add(&stats.field, (n), __ATOMIC_RELAXED)
+
+/* G.711 tables, the same Asterisk builds in ulaw.c and alaw.c */
+static int16_t ulaw2lin[256];
+static int16_t alaw2lin[256];
+
+static void g711_init(void)
+{
+	int i, mantissa, exponent, sample;
+	unsigned char u, a;
+
+	for (i = 0; i < 256; i++) {
+		u = ~i;
+		exponent = (u >> 4) & 0x07;
+		mantissa = u & 0x0f;
+		sample = (((mantissa << 3) + 0x84) << exponent) - 0x84;
+		ulaw2lin[i] = (u & 0x80) ? -sample : sample;
+
+		a = i ^ 0x55;
+		mantissa = a & 0x0f;
+		exponent = (a & 0x70) >> 4;
+		sample = mantissa << 4;
+		sample += exponent ? 0x108 : 8;
+		if (exponent > 1)
+			sample <<= exponent - 1;
+		alaw2lin[i] = (a & 0x80) ? sample : -sample;
+	}
+}
+
+static int64_t spitd_now(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (int64_t) now.tv_sec * 1000 + now.tv_usec / 1000;
+}
+
+static void spitd_log(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+static void spitd_log(const char *fmt, ...)
+{
+	char stamp[32];
+	struct timeval now;
+	struct tm tm;
+	va_list ap;
+
+	gettimeofday(&now, NULL);
+	localtime_r(&now.tv_sec, &tm);
+	strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+
+	flockfile(stderr);
+	fprintf(stderr, "[%s.%03d] ", stamp, (int) (now.tv_usec / 1000));
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+	funlockfile(stderr);
+}
+
+/* Engine messages, with the call in front */
+static void spitd_engine_log(void *data, const char *fmt, ...)
+{
+	struct call *call = data;
+	char buf[256];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	spitd_log("SPIT: Call [%s/%s]. %s", call->conn->peer, call->id, buf);
+}
+
+static void connection_unref(struct connection *conn)
+{
+	if (__atomic_sub_fetch(&conn->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+	close(conn->fd);
+	pthread_mutex_destroy(&conn->lock);
+	free(conn);
+}
+
+static int connection_send(struct connection *conn, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static int connection_send(struct connection *conn, const char *fmt, ...)
+{
+	char buf[SPIT_REMOTE_LINE_LEN];
+	va_list ap;
+	int len, sent = 0, res = 0;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (len >= (int) sizeof(buf))
+		len = sizeof(buf) - 1;
+
+	pthread_mutex_lock(&conn->lock);
+	while (sent < len) {
+		if ((res = send(conn->fd, buf + sent, len - sent, MSG_NOSIGNAL)) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		sent += res;
+	}
+	pthread_mutex_unlock(&conn->lock);
+
+	return res < 0 ? -1 : 0;
+}
+
+/* Bind a UDP socket to a free port of the RTP range on the address the control connection came in on */
+static int call_bind(struct call *call, const struct sockaddr_storage *local, socklen_t locallen)
+{
+	struct sockaddr_storage addr = *local;
+	int range = config.rtpEnd - config.rtpStart + 1, i, port;
+
+	if ((call->fd = socket(addr.ss_family, SOCK_DGRAM, 0)) < 0)
+		return -1;
+	fcntl(call->fd, F_SETFL, fcntl(call->fd, F_GETFL) | O_NONBLOCK);
+
+	pthread_mutex_lock(&portLock);
+	for (i = 0; i < range; i++) {
+		port = nextPort++ % range;
+		if (portsUsed[port / 8] & (1 << (port % 8)))
+			continue;
+		if (addr.ss_family == AF_INET6)
+			((struct sockaddr_in6 *) &addr)->sin6_port = htons(config.rtpStart + port);
+		else
+			((struct sockaddr_in *) &addr)->sin_port = htons(config.rtpStart + port);
+		if (!bind(call->fd, (struct sockaddr *) &addr, locallen)) {
+			portsUsed[port / 8] |= 1 << (port % 8);
+			call->port = config.rtpStart + port;
+			pthread_mutex_unlock(&portLock);
+			return 0;
+		}
+	}
+	pthread_mutex_unlock(&portLock);
+
+	close(call->fd);
+	call->fd = -1;
+	return -1;
+}
+
+static void call_unbind(struct call *call)
+{
+	int port = call->port - config.rtpStart;
+
+	if (call->fd < 0)
+		return;
+
+	/* Closing the socket takes it out of the epoll set */
+	close(call->fd);
+	call->fd = -1;
+	pthread_mutex_lock(&portLock);
+	portsUsed[port / 8] &= ~(1 << (port % 8));
+	pthread_mutex_unlock(&portLock);
+}
+
+/* Tell the client what the engine has news of, and once it is done with the call */
+static void call_check(struct call *call)
+{
+	struct spit_engine *e = &call->engine;
+	struct spit_features features;
+	struct spit_progress progress;
+	char line[SPIT_REMOTE_LINE_LEN];
+
+	if (call->done)
+		return;
+
+	if (e->params.progressEvents && spit_engine_progress(e, &progress)) {
+		spit_remote_progress_line(e, &progress, call->id, line, sizeof(line));
+		connection_send(call->conn, "%s", line);
+	}
+
+	if (!e->status || e->endTracking)
+		return;
+
+	spit_perf_commit(e);
+	spit_engine_features(e, &features);
+	features.decisionTime = spitd_now() - call->start;
+	spit_remote_verdict_line(e, &features, call->id, line, sizeof(line));
+	connection_send(call->conn, "%s", line);
+	call->done = 1;
+	stat_add(verdicts[e->status], 1);
+	call_unbind(call);
+
+	if (spit_analytics_enabled())
+		spit_analytics_log(e, &features, call->ani, call->start, call->cpu);
+
+	if (verbose)
+		spitd_log("Call [%s/%s]. %.*s", call->conn->peer, call->id, (int) strcspn(line, "\n"), line);
+}
+
+static void call_free(struct call *call)
+{
+	call_unbind(call);
+	connection_unref(call->conn);
+	stat_add(active, -1);
+	free(call);
+}
+
+/* Read what the call's socket has and feed the engine */
+static void call_media(struct call *call)
+{
+	unsigned char packet[MAX_PACKET];
+	int16_t samples[SPIT_RTP_MAX_SAMPLES];
+	struct spit_frame_info info;
+	int len, offset, n, i, pt;
+	uint32_t ssrc;
+	int64_t cpu = 0;
+
+	while (call->fd >= 0 && (len = recv(call->fd, packet, sizeof(packet), 0)) >= 0) {
+		stat_add(packets, 1);
+
+		/* RTP version 2, skip CSRCs, extension and padding */
+		if (len < 12 || (packet[0] >> 6) != 2) {
+			stat_add(dropped, 1);
+			continue;
+		}
+		offset = 12 + (packet[0] & 0x0f) * 4;
+		if ((packet[0] & 0x10) && offset + 4 <= len)
+			offset += 4 + ((packet[offset + 2] << 8 | packet[offset + 3]) * 4);
+		if (packet[0] & 0x20)
+			len -= packet[len - 1];
+		if (offset >= len) {
+			stat_add(dropped, 1);
+			continue;
+		}
+
+		ssrc = (uint32_t) packet[8] << 24 | packet[9] << 16 | packet[10] << 8 | packet[11];
+		if (!call->latched) {
+			call->latched = 1;
+			call->ssrc = ssrc;
+		} else if (ssrc != call->ssrc) {
+			stat_add(dropped, 1);
+			continue;
+		}
+
+		if (spit_analytics_enabled())
+			cpu = spit_analytics_cpu();
+
+		pt = packet[1] & 0x7f;
+		info.hasSeqno = 1;
+		info.seqno = packet[2] << 8 | packet[3];
+		info.hasTimestamp = 1;
+		info.ts = ((uint32_t) packet[4] << 24 | packet[5] << 16 | packet[6] << 8 | packet[7]) / SPIT_SAMPLES_PER_MS;
+
+		switch (pt) {
+		case SPIT_RTP_CN:
+			spit_engine_comfort_noise(&call->engine);
+			break;
+		case SPIT_RTP_PCMU:
+		case SPIT_RTP_PCMA:
+			if ((n = len - offset) > SPIT_RTP_MAX_SAMPLES) {
+				stat_add(dropped, 1);
+				continue;
+			}
+			for (i = 0; i < n; i++)
+				samples[i] = (pt == SPIT_RTP_PCMU ? ulaw2lin : alaw2lin)[packet[offset + i]];
+			spit_engine_audio(&call->engine, samples, n, &info);
+			break;
+		default:
+			n = (len - offset) / 2;
+			for (i = 0; i < n; i++)
+				samples[i] = packet[offset + 2 * i] << 8 | packet[offset + 2 * i + 1];
+			spit_engine_audio(&call->engine, samples, n, &info);
+			break;
+		}
+
+		call->lastMedia = spitd_now();
+		if (spit_analytics_enabled())
+			call->cpu += spit_analytics_cpu() - cpu;
+		call_check(call);
+	}
+}
+
+static void worker_command(struct worker *w, const struct command *cmd)
+{
+	struct call *call = cmd->call, **prev;
+	struct epoll_event ev;
+
+	/* Audio the client sent before the command goes to the engine first */
+	if (cmd->type != CMD_ADD && cmd->type != CMD_STOP)
+		call_media(call);
+
+	switch (cmd->type) {
+	case CMD_ADD:
+		call->wnext = w->calls;
+		w->calls = call;
+		ev.events = EPOLLIN;
+		ev.data.ptr = call;
+		if (epoll_ctl(w->epoll, EPOLL_CTL_ADD, call->fd, &ev))
+			spitd_log("Unable to watch the RTP of call [%s/%s]: %s", call->conn->peer, call->id, strerror(errno));
+		call->lastMedia = spitd_now();
+		call_media(call);
+		break;
+	case CMD_ANSWER:
+		spit_engine_answer(&call->engine);
+		break;
+	case CMD_DTMF:
+		spit_engine_dtmf(&call->engine, cmd->digit);
+		break;
+	case CMD_HANGUP:
+		spit_engine_hangup(&call->engine);
+		break;
+	case CMD_STOP:
+		for (prev = &w->calls; *prev; prev = &(*prev)->wnext) {
+			if (*prev == call) {
+				*prev = call->wnext;
+				break;
+			}
+		}
+		call_free(call);
+		return;
+	}
+
+	call_check(call);
+}
+
+static void *worker_run(void *data)
+{
+	struct worker *w = data;
+	struct epoll_event events[64];
+	struct command cmds[32];
+	struct call *call;
+	int64_t now;
+	int n, i, len, commands;
+
+	while (!stopping) {
+		if ((n = epoll_wait(w->epoll, events, 64, WORKER_TICK)) < 0 && errno != EINTR)
+			break;
+
+		/* Media first, a STOP among the commands may free a call that is in events too */
+		for (i = 0, commands = 0; i < n; i++) {
+			if (events[i].data.ptr)
+				call_media(events[i].data.ptr);
+			else
+				commands = 1;
+		}
+
+		/* Commands are written whole, a pipe write that small is atomic */
+		while (commands && (len = read(w->pipe[0], cmds, sizeof(cmds))) > 0) {
+			for (i = 0; i < len / (int) sizeof(cmds[0]); i++)
+				worker_command(w, &cmds[i]);
+		}
+
+		/* Time goes on for calls that send nothing, the way ast_waitfor() times out in the module */
+		now = spitd_now();
+		for (call = w->calls; call; call = call->wnext) {
+			if (call->done)
+				continue;
+			while (!call->done && now - call->lastMedia >= 2 * call->engine.maxWaitTimeForFrame) {
+				call->lastMedia += 2 * call->engine.maxWaitTimeForFrame;
+				spit_engine_timeout(&call->engine);
+				call_check(call);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+static void worker_send(struct call *call, enum command_type type, int digit)
+{
+	struct command cmd = { type, digit, call };
+
+	while (write(call->worker->pipe[1], &cmd, sizeof(cmd)) < 0 && errno == EINTR)
+		;
+}
+
+static struct call *connection_find(struct connection *conn, const char *id, int unlink)
+{
+	struct call **prev, *call;
+
+	for (prev = &conn->calls; (call = *prev); prev = &call->next) {
+		if (!strcmp(call->id, id)) {
+			if (unlink)
+				*prev = call->next;
+			return call;
+		}
+	}
+
+	return NULL;
+}
+
+static void connection_start(struct connection *conn, char *args)
+{
+	struct sockaddr_storage local;
+	socklen_t locallen = sizeof(local);
+	struct spit_params params = dfltParams;
+	struct call *call;
+	char *id, *setting, *value;
+	int answered = 1;
+
+	if (!(id = strsep(&args, " ")) || !*id || strlen(id) >= SPIT_REMOTE_ID_LEN) {
+		connection_send(conn, "ERROR - bad id\n");
+		return;
+	}
+	if (connection_find(conn, id, 0)) {
+		connection_send(conn, "ERROR %s duplicate id\n", id);
+		return;
+	}
+
+	if (!(call = calloc(1, sizeof(*call)))) {
+		connection_send(conn, "ERROR %s out of memory\n", id);
+		return;
+	}
+	snprintf(call->id, sizeof(call->id), "%s", id);
+	call->fd = -1;
+
+	while ((setting = strsep(&args, " "))) {
+		if (!*setting)
+			continue;
+		if (!(value = strchr(setting, '='))) {
+			connection_send(conn, "ERROR %s bad setting %s\n", id, setting);
+			free(call);
+			return;
+		}
+		*value++ = '\0';
+		if (!strcasecmp(setting, "answered")) {
+			answered = spit_true(value);
+		} else if (!strcasecmp(setting, "greeting_end")) {
+			params.trackGreetingEnd = spit_true(value);
+		} else if (!strcasecmp(setting, "ani")) {
+			snprintf(call->ani, sizeof(call->ani), "%s", value);
+		} else if (spit_config_apply(&params, NULL, "general", setting, value)) {
+			connection_send(conn, "ERROR %s unknown setting %s\n", id, setting);
+			free(call);
+			return;
+		}
+	}
+
+	if (getsockname(conn->fd, (struct sockaddr *) &local, &locallen) || call_bind(call, &local, locallen)) {
+		connection_send(conn, "ERROR %s no free RTP port\n", id);
+		stat_add(rejected, 1);
+		free(call);
+		return;
+	}
+
+	spit_engine_init(&call->engine, &params, answered);
+	call->engine.log = spitd_engine_log;
+	call->engine.logData = call;
+	call->engine.logLevel = debug ? SPIT_LOG_DEBUG : verbose ? SPIT_LOG_VERBOSE : SPIT_LOG_NONE;
+	call->start = spitd_now();
+	call->conn = conn;
+	__atomic_add_fetch(&conn->refs, 1, __ATOMIC_ACQ_REL);
+	call->worker = &workers[__atomic_fetch_add(&nextWorker, 1, __ATOMIC_RELAXED) % numWorkers];
+	call->next = conn->calls;
+	conn->calls = call;
+	stat_add(calls, 1);
+	stat_add(active, 1);
+
+	/* Audio that comes in before the worker has the call waits in the socket */
+	connection_send(conn, "STARTED %s %d\n", id, call->port);
+	worker_send(call, CMD_ADD, 0);
+
+	if (verbose)
+		spitd_log("Call [%s/%s]. Started on port %d", conn->peer, id, call->port);
+}
+
+static void connection_command(struct connection *conn, char *line)
+{
+	char *command, *id, *digit;
+	struct call *call;
+	int i;
+
+	command = strsep(&line, " ");
+
+	if (!strcasecmp(command, "STATS")) {
+		char verdicts[128] = "";
+		int used = 0;
+
+		for (i = SPIT_HUMAN; i <= SPIT_HANGUP; i++) {
+			used += snprintf(verdicts + used, sizeof(verdicts) - used, " %s=%" PRIu64,
+				spit_status_name(i), __atomic_load_n(&stats.verdicts[i], __ATOMIC_RELAXED));
+		}
+		connection_send(conn, "STATS calls=%" PRIu64 " active=%" PRIu64 " rejected=%" PRIu64 " packets=%" PRIu64
+			" dropped=%" PRIu64 " workers=%d%s\n",
+			__atomic_load_n(&stats.calls, __ATOMIC_RELAXED), __atomic_load_n(&stats.active, __ATOMIC_RELAXED),
+			__atomic_load_n(&stats.rejected, __ATOMIC_RELAXED), __atomic_load_n(&stats.packets, __ATOMIC_RELAXED),
+			__atomic_load_n(&stats.dropped, __ATOMIC_RELAXED), numWorkers, verdicts);
+		return;
+	}
+
+	if (!strcasecmp(command, "START")) {
+		connection_start(conn, line ? line : "");
+		return;
+	}
+
+	if (!(id = strsep(&line, " ")) || !*id) {
+		connection_send(conn, "ERROR - bad command %s\n", command);
+		return;
+	}
+
+	if (!strcasecmp(command, "STOP")) {
+		if ((call = connection_find(conn, id, 1)))
+			worker_send(call, CMD_STOP, 0);
+		return;
+	}
+
+	if (!(call = connection_find(conn, id, 0))) {
+		connection_send(conn, "ERROR %s unknown call\n", id);
+		return;
+	}
+
+	if (!strcasecmp(command, "ANSWER")) {
+		worker_send(call, CMD_ANSWER, 0);
+	} else if (!strcasecmp(command, "HANGUP")) {
+		worker_send(call, CMD_HANGUP, 0);
+	} else if (!strcasecmp(command, "DTMF") && (digit = strsep(&line, " ")) && *digit) {
+		worker_send(call, CMD_DTMF, *digit);
+	} else {
+		connection_send(conn, "ERROR %s bad command %s\n", id, command);
+	}
+}
+
+static void *connection_run(void *data)
+{
+	struct connection *conn = data;
+	struct call *call;
+	char buf[SPIT_REMOTE_LINE_LEN], *end;
+	int used = 0, res;
+
+	if (verbose)
+		spitd_log("Connection from %s", conn->peer);
+
+	while ((res = recv(conn->fd, buf + used, sizeof(buf) - 1 - used, 0)) > 0 || (res < 0 && errno == EINTR)) {
+		if (res < 0)
+			continue;
+		used += res;
+		while ((end = memchr(buf, '\n', used))) {
+			*end = '\0';
+			if (end > buf && end[-1] == '\r')
+				end[-1] = '\0';
+			if (*buf)
+				connection_command(conn, buf);
+			used -= end + 1 - buf;
+			memmove(buf, end + 1, used);
+		}
+		/* A line that long is no command of ours */
+		if (used == sizeof(buf) - 1)
+			used = 0;
+	}
+
+	/* The client is gone, so are its calls */
+	while ((call = conn->calls)) {
+		conn->calls = call->next;
+		worker_send(call, CMD_STOP, 0);
+	}
+
+	if (verbose)
+		spitd_log("Connection from %s closed", conn->peer);
+
+	shutdown(conn->fd, SHUT_RDWR);
+	connection_unref(conn);
+
+	return NULL;
+}
+
+static int listen_control(void)
+{
+	struct addrinfo hints, *addrs;
+	char port[16];
+	int fd, on = 1, res;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	snprintf(port, sizeof(port), "%d", config.port);
+	if ((res = getaddrinfo(*config.bind ? config.bind : NULL, port, &hints, &addrs))) {
+		spitd_log("Unable to resolve %s: %s", config.bind, gai_strerror(res));
+		return -1;
+	}
+
+	if ((fd = socket(addrs->ai_family, SOCK_STREAM, 0)) < 0
+		|| setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on))
+		|| bind(fd, addrs->ai_addr, addrs->ai_addrlen) || listen(fd, 64)) {
+		spitd_log("Unable to listen on %s port %d: %s", config.bind, config.port, strerror(errno));
+		freeaddrinfo(addrs);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	freeaddrinfo(addrs);
+
+	return fd;
+}
+
+static char *trim(char *s)
+{
+	char *end;
+
+	while (isspace((unsigned char) *s))
+		s++;
+	for (end = s + strlen(s); end > s && isspace((unsigned char) end[-1]); end--)
+		;
+	*end = '\0';
+
+	return s;
+}
+
+/* Read the sections of spit.conf we use. Asterisk syntax, without templates and includes. */
+static int load_config(const char *path)
+{
+	struct spit_analytics_config analytics;
+	struct spit_pipeline pipeline;
+	char buf[512], category[64] = "", *line, *name, *value;
+	int lineno = 0;
+	FILE *f;
+
+	spit_params_defaults(&dfltParams);
+	spit_analytics_defaults(&analytics);
+	spit_pipeline_defaults(&pipeline);
+	memset(&config, 0, sizeof(config));
+	config.port = SPIT_REMOTE_PORT;
+	config.rtpStart = 20000;
+	config.rtpEnd = 20999;
+
+	if (!(f = fopen(path, "r"))) {
+		spitd_log("Unable to open %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	while (fgets(buf, sizeof(buf), f)) {
+		lineno++;
+		if ((line = strchr(buf, ';')))
+			*line = '\0';
+		line = trim(buf);
+		if (!*line)
+			continue;
+
+		if (*line == '[') {
+			if ((value = strchr(line, ']')))
+				*value = '\0';
+			snprintf(category, sizeof(category), "%s", trim(line + 1));
+			continue;
+		}
+
+		if (!(value = strchr(line, '='))) {
+			spitd_log("%s: Bad line %d", path, lineno);
+			continue;
+		}
+		*value++ = '\0';
+		if (*value == '>')
+			value++;
+		name = trim(line);
+		value = trim(value);
+
+		if (!strcasecmp(category, "general")) {
+			/* Ringback is spotted by the module, the progress detector is part of Asterisk */
+			if (strcasecmp(name, "progress_zone") && spit_config_apply(&dfltParams, NULL, category, name, value))
+				spitd_log("%s: Cat:%s. Unknown keyword or bad value %s at line %d", path, category, name, lineno);
+		} else if (!strcasecmp(category, "pipeline")) {
+			if (spit_pipeline_config_apply(&pipeline, name, value))
+				spitd_log("%s: Cat:%s. Unknown keyword or bad value %s at line %d", path, category, name, lineno);
+		} else if (!strcasecmp(category, "analytics")) {
+			if (spit_analytics_config_apply(&analytics, name, value))
+				spitd_log("%s: Cat:%s. Unknown keyword %s at line %d", path, category, name, lineno);
+		} else if (!strcasecmp(category, "spitd")) {
+			if (!strcasecmp(name, "bind"))
+				snprintf(config.bind, sizeof(config.bind), "%s", value);
+			else if (!strcasecmp(name, "port"))
+				config.port = atoi(value);
+			else if (!strcasecmp(name, "rtp_start"))
+				config.rtpStart = atoi(value);
+			else if (!strcasecmp(name, "rtp_end"))
+				config.rtpEnd = atoi(value);
+			else if (!strcasecmp(name, "threads"))
+				config.threads = atoi(value);
+			else
+				spitd_log("%s: Cat:%s. Unknown keyword %s at line %d", path, category, name, lineno);
+		}
+	}
+	fclose(f);
+
+	if (config.rtpStart < 1 || config.rtpEnd > 65535 || config.rtpEnd < config.rtpStart) {
+		spitd_log("%s: Bad RTP port range %d-%d", path, config.rtpStart, config.rtpEnd);
+		return -1;
+	}
+	if (config.threads < 1)
+		config.threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (config.threads < 1)
+		config.threads = 1;
+	if (config.threads > MAX_WORKERS)
+		config.threads = MAX_WORKERS;
+
+	spit_pipeline_configure(&pipeline);
+	spit_analytics_configure(&analytics);
+
+	return 0;
+}
+
+static void handle_signal(int sig)
+{
+	stopping = sig;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: spitd [-c spit.conf] [-v] [-d]\n"
+		"  -c  configuration file, /etc/asterisk/spit.conf by default\n"
+		"  -v  log every call and the engine messages\n"
+		"  -d  log the engine debug messages too\n");
+}
+
+int main(int argc, char *argv[])
+{
+	const char *path = "/etc/asterisk/spit.conf";
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	struct epoll_event ev;
+	struct connection *conn;
+	struct pollfd pfd;
+	struct timeval sndtimeo = { 1, 0 };
+	pthread_attr_t attr;
+	pthread_t thread;
+	char host[48], port[8];
+	int listener, fd, i, on = 1, c;
+
+	while ((c = getopt(argc, argv, "c:vdh")) != -1) {
+		switch (c) {
+		case 'c':
+			path = optarg;
+			break;
+		case 'd':
+			debug = 1;
+			/* Fall through */
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage();
+			return c == 'h' ? 0 : 1;
+		}
+	}
+
+	g711_init();
+	if (load_config(path))
+		return 1;
+	if (!(portsUsed = calloc((config.rtpEnd - config.rtpStart) / 8 + 1, 1)))
+		return 1;
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+
+	if ((listener = listen_control()) < 0)
+		return 1;
+
+	for (numWorkers = 0; numWorkers < config.threads; numWorkers++) {
+		struct worker *w = &workers[numWorkers];
+
+		if ((w->epoll = epoll_create1(0)) < 0 || pipe(w->pipe)) {
+			spitd_log("Unable to set up a worker: %s", strerror(errno));
+			return 1;
+		}
+		fcntl(w->pipe[0], F_SETFL, O_NONBLOCK);
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		epoll_ctl(w->epoll, EPOLL_CTL_ADD, w->pipe[0], &ev);
+		if (pthread_create(&w->thread, NULL, worker_run, w)) {
+			spitd_log("Unable to start a worker: %s", strerror(errno));
+			return 1;
+		}
+	}
+
+	spitd_log("spitd listening on %s port %d, RTP ports %d-%d, %d worker%s", *config.bind ? config.bind : "*",
+		config.port, config.rtpStart, config.rtpEnd, numWorkers, numWorkers == 1 ? "" : "s");
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	pfd.fd = listener;
+	pfd.events = POLLIN;
+	while (!stopping) {
+		if (poll(&pfd, 1, 500) <= 0)
+			continue;
+		addrlen = sizeof(addr);
+		if ((fd = accept(listener, (struct sockaddr *) &addr, &addrlen)) < 0)
+			continue;
+
+		if (!(conn = calloc(1, sizeof(*conn)))) {
+			close(fd);
+			continue;
+		}
+		conn->fd = fd;
+		conn->refs = 1;
+		pthread_mutex_init(&conn->lock, NULL);
+		if (getnameinfo((struct sockaddr *) &addr, addrlen, host, sizeof(host), port, sizeof(port),
+				NI_NUMERICHOST | NI_NUMERICSERV))
+			strcpy(host, "?");
+		snprintf(conn->peer, sizeof(conn->peer), "%s:%s", host, port);
+
+		/* Verdicts go out right away, a client that stops reading does not hold up a worker for long */
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &sndtimeo, sizeof(sndtimeo));
+
+		if (pthread_create(&thread, &attr, connection_run, conn)) {
+			spitd_log("Unable to serve %s: %s", conn->peer, strerror(errno));
+			connection_unref(conn);
+		}
+	}
+
+	spitd_log("spitd stopping on signal %d", (int) stopping);
+	close(listener);
+	for (i = 0; i < numWorkers; i++)
+		pthread_join(workers[i].thread, NULL);
+	spit_analytics_shutdown();
+
+	return 0;
+}